@@ -0,0 +1,135 @@
+import ctypes
+import os
+
+RGB8 = 0
+RGBA8 = 1
+RGBA32F = 2
+
+_PIXEL_BYTES = {RGB8: 3, RGBA8: 4, RGBA32F: 16}
+
+
+class _Image(ctypes.Structure):
+    _fields_ = [("glyph", ctypes.c_char),
+                ("size", ctypes.c_int),
+                ("spp", ctypes.c_int),
+                ("format", ctypes.c_int),
+                ("stride", ctypes.c_size_t),
+                ("pixels", ctypes.c_void_p),
+                ("palette", ctypes.POINTER(ctypes.c_float))]
+
+
+def _load(path):
+    lib = ctypes.CDLL(path)
+    lib.myavatar_api_version.restype = ctypes.c_int
+    lib.myavatar_status_string.restype = ctypes.c_char_p
+    lib.myavatar_status_string.argtypes = [ctypes.c_int]
+    lib.myavatar_scene_create.restype = ctypes.c_void_p
+    lib.myavatar_scene_create.argtypes = [ctypes.c_uint]
+    lib.myavatar_scene_destroy.restype = None
+    lib.myavatar_scene_destroy.argtypes = [ctypes.c_void_p]
+    lib.myavatar_scene_set_transform.argtypes = [
+        ctypes.c_void_p, ctypes.POINTER(ctypes.c_double)]
+    lib.myavatar_avatar_transform.restype = None
+    lib.myavatar_avatar_transform.argtypes = [
+        ctypes.c_double, ctypes.POINTER(ctypes.c_double)]
+    lib.myavatar_render.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Image)]
+    lib.myavatar_render_batch.argtypes = [
+        ctypes.c_void_p, ctypes.POINTER(_Image), ctypes.c_int]
+    return lib
+
+
+# output/libmyavatar.so next to this file, or MYAVATAR_LIBRARY
+lib = _load(os.environ.get("MYAVATAR_LIBRARY", os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "output", "libmyavatar.so")))
+
+
+def avatar_transform(spin=0.0):
+    m = (ctypes.c_double * 16)()
+    lib.myavatar_avatar_transform(spin, m)
+    return list(m)
+
+
+class Scene:
+    """the avatar cube, threads may render from one scene at once. ctypes
+    lets go of the gil during every call"""
+
+    def __init__(self, seed=0):
+        self.handle = lib.myavatar_scene_create(seed)
+        if not self.handle:
+            raise MemoryError("myavatar_scene_create")
+
+    def close(self):
+        if self.handle:
+            lib.myavatar_scene_destroy(self.handle)
+            self.handle = None
+
+    def __del__(self):
+        self.close()
+
+    def set_transform(self, matrix):
+        """16 numbers, row major"""
+        self._check(lib.myavatar_scene_set_transform(
+            self.handle, (ctypes.c_double * 16)(*matrix)))
+
+    def render(self, glyph, size=128, spp=40, format=RGB8, out=None,
+               stride=0, palette=None):
+        """pixels of one image in out, any writable buffer such as a
+        bytearray or a numpy array, or in a new bytearray"""
+        out = self._buffer(out, size, format, stride)
+        image = self._image(glyph, size, spp, format, out, stride, palette)
+        self._check(lib.myavatar_render(self.handle, ctypes.byref(image)))
+        return out
+
+    def render_batch(self, glyphs, size=128, spp=40, format=RGB8):
+        """one new bytearray per glyph, rendered side by side"""
+        outs = [self._buffer(None, size, format, 0) for _ in glyphs]
+        images = (_Image * len(glyphs))(*[
+            self._image(g, size, spp, format, o, 0, None)
+            for g, o in zip(glyphs, outs)])
+        self._check(lib.myavatar_render_batch(
+            self.handle, images, len(glyphs)))
+        return outs
+
+    @staticmethod
+    def _bytes(size, format, stride):
+        if format not in _PIXEL_BYTES:
+            raise ValueError("unknown format %r" % (format,))
+        return stride * size or size * size * _PIXEL_BYTES[format]
+
+    @staticmethod
+    def _buffer(out, size, format, stride):
+        if out is None:
+            return bytearray(Scene._bytes(size, format, stride))
+        Scene._fits(out, size, format, stride)
+        return out
+
+    @staticmethod
+    def _fits(out, size, format, stride):
+        """the library writes every row, a short buffer would be overrun"""
+        n = len(memoryview(out).cast("B"))
+        need = Scene._bytes(size, format, stride)
+        if n < need:
+            raise ValueError("out holds %d bytes, the image needs %d"
+                             % (n, need))
+        return n
+
+    @staticmethod
+    def _image(glyph, size, spp, format, out, stride, palette):
+        if len(glyph) != 1 or not glyph.isascii() or not glyph.isalpha():
+            raise ValueError("glyph must be one ascii letter")
+        n = Scene._fits(out, size, format, stride)
+        # from_buffer shares the memory of out, nothing is copied back
+        pixels = (ctypes.c_char * n).from_buffer(out)
+        colors = None
+        if palette is not None:
+            colors = (ctypes.c_float * 12)(*palette)
+        image = _Image(glyph.encode(), size, spp, format, stride,
+                       ctypes.addressof(pixels), colors)
+        # kept alive as long as the image
+        image._refs = (pixels, colors)
+        return image
+
+    @staticmethod
+    def _check(status):
+        if status != 0:
+            raise RuntimeError(lib.myavatar_status_string(status).decode())
@@ -0,0 +1,73 @@
+#ifndef AVATAR_H
+#define AVATAR_H
+
+#include "base.h"
+#include "camera.h"
+
+// the unfolded cube texture covers 4 x 3 glyph cells
+void generate_avatar_cube(std::vector<Triangle> &triangles, Mat4x4 &mat) {
+  Vec3 vertexs[8] = {Vec3(0.5, 0.5, 0.5),   Vec3(0.5, 0.5, -0.5),
+                     Vec3(0.5, -0.5, 0.5),  Vec3(0.5, -0.5, -0.5),
+                     Vec3(-0.5, 0.5, 0.5),  Vec3(-0.5, 0.5, -0.5),
+                     Vec3(-0.5, -0.5, 0.5), Vec3(-0.5, -0.5, -0.5)};
+  for (int i = 0; i < 8; i++) {
+    vertexs[i] = mat * vertexs[i];
+  }
+
+  triangles.push_back(
+      Triangle(vertexs[0], vertexs[2], vertexs[6])
+          .set_texture_coor(Vec3(0, 1, 0), Vec3(1, 1, 0), Vec3(1, 0, 0)));
+  triangles.push_back(
+      Triangle(vertexs[6], vertexs[4], vertexs[0])
+          .set_texture_coor(Vec3(1, 0, 0), Vec3(0, 0, 0), Vec3(0, 1, 0)));
+  triangles.push_back(
+      Triangle(vertexs[0], vertexs[1], vertexs[2])
+          .set_texture_coor(Vec3(0, 1, 0), Vec3(0, 2, 0), Vec3(1, 1, 0)));
+  triangles.push_back(
+      Triangle(vertexs[3], vertexs[2], vertexs[1])
+          .set_texture_coor(Vec3(1, 2, 0), Vec3(1, 1, 0), Vec3(0, 2, 0)));
+  triangles.push_back(
+      Triangle(vertexs[1], vertexs[0], vertexs[5])
+          .set_texture_coor(Vec3(4, 2, 0), Vec3(4, 1, 0), Vec3(3, 2, 0)));
+  triangles.push_back(
+      Triangle(vertexs[0], vertexs[4], vertexs[5])
+          .set_texture_coor(Vec3(4, 1, 0), Vec3(3, 1, 0), Vec3(3, 2, 0)));
+  triangles.push_back(
+      Triangle(vertexs[4], vertexs[5], vertexs[6])
+          .set_texture_coor(Vec3(3, 1, 0), Vec3(3, 2, 0), Vec3(2, 1, 0)));
+  triangles.push_back(
+      Triangle(vertexs[5], vertexs[7], vertexs[6])
+          .set_texture_coor(Vec3(3, 2, 0), Vec3(2, 2, 0), Vec3(2, 1, 0)));
+  triangles.push_back(
+      Triangle(vertexs[2], vertexs[6], vertexs[7])
+          .set_texture_coor(Vec3(1, 1, 0), Vec3(2, 1, 0), Vec3(2, 2, 0)));
+  triangles.push_back(
+      Triangle(vertexs[3], vertexs[2], vertexs[7])
+          .set_texture_coor(Vec3(1, 2, 0), Vec3(1, 1, 0), Vec3(2, 2, 0)));
+  triangles.push_back(
+      Triangle(vertexs[1], vertexs[3], vertexs[7])
+          .set_texture_coor(Vec3(0, 2, 0), Vec3(1, 2, 0), Vec3(1, 3, 0)));
+  triangles.push_back(
+      Triangle(vertexs[7], vertexs[5], vertexs[1])
+          .set_texture_coor(Vec3(1, 3, 0), Vec3(0, 3, 0), Vec3(0, 2, 0)));
+}
+
+// spin turns the cube around its own y axis, for turntables
+Mat4x4 avatar_transform(double spin = 0) {
+  Mat4x4 mat;
+  mat.rotate_y(spin)
+      .rotate_x(40 * M_PI / 180)
+      .rotate_y(45 * M_PI / 180)
+      .rotate_z(50 * M_PI / 180)
+      .scale(Vec3(2, 2, 2))
+      .translate(Vec3(0.2, 0, 1.0));
+  return mat;
+}
+
+// camera at (0, 0, 6) looking at a 4 x 4 window on the z = 0 plane
+Camera avatar_camera(int size) {
+  return Camera(Vec3(0, 0, 6), Vec3(0, 0, 0), Vec3(1, 0, 0), 6, 4, size,
+                size);
+}
+
+#endif
@@ -1,304 +1,455 @@
-// #include "font.h"
-// #include "vec.h"
-// #include <algorithm>
-// #include <cmath>
-// #include <fstream>
-// #include <iostream>
-// #include <random>
-// #include <string>
-// #include <vector>
-
-// using namespace std;
-
-// #define FILENAME "pic0.ppm"
-
-// char c = 'a';
-
-// const int PIC_SIZE = 512;
-
-// class Ray {
-// public:
-//   Ray() : origin(), direction() {}
-//   Ray(Vec3 &o, Vec3 &d) : origin(o), direction(d) {}
-//   Vec3 origin;
-//   Vec3 direction;
-//   friend std::ostream &operator<<(std::ostream &output, const Ray &r) {
-//     output << r.origin << " " << r.direction;
-//     return output;
-//   }
-// };
-
-// class Primitive {
-// public:
-//   Vec3 n;
-//   double offset;
-
-//   Primitive(Vec3 &iv0, Vec3 &iv1, Vec3 &iv2)
-//       : v0(iv0), v1(iv1), v2(iv2), t_v0(), t_v1(), t_v2() {
-//     n = cross(v1 - v0, v2 - v0);
-//     offset = dot(v0, n);
-//   }
-
-//   Primitive &set_texture_coor(const Vec3 &it_v0, const Vec3 &it_v1,
-//                               const Vec3 &it_v2) {
-//     t_v0 = it_v0;
-//     t_v1 = it_v1;
-//     t_v2 = it_v2;
-//     return *this;
-//   }
-
-//   inline friend ostream &operator<<(ostream &output, Primitive &primitive) {
-//     output << primitive.v0 << ", " << primitive.v1 << ", " << primitive.v2;
-//     return output;
-//   }
-
-//   bool contain(Vec3 &v) {
-//     // check if v is in the same side with v0, v1, v2
-//     double t0 = is_contain_help(v0, v1, v);
-//     double t1 = is_contain_help(v1, v2, v);
-//     double t2 = is_contain_help(v2, v0, v);
-
-//     return (t0 >= 0 && t1 >= 0 && t2 >= 0) || (t0 <= 0 && t1 <= 0 && t2 <=
-//     0);
-//   }
-
-//   Vec3 cal_barycentric_coor(Vec3 &v) {
-//     double a, b, c;
-
-//     a = ((v.b - v1.b) * (v2.a - v1.a) - (v.a - v1.a) * (v2.b - v1.b)) /
-//         ((v0.b - v1.b) * (v2.a - v1.a) - (v0.a - v1.a) * (v2.b - v1.b));
-
-//     b = ((v.b - v2.b) * (v0.a - v2.a) - (v.a - v2.a) * (v0.b - v2.b)) /
-//         ((v1.b - v2.b) * (v0.a - v2.a) - (v1.a - v2.a) * (v0.b - v2.b));
-
-//     c = 1 - a - b;
-//     return Vec3(a, b, c);
-//   }
-
-//   Vec3 get_texture_coor(Vec3 &v) {
-//     Vec3 baryCoor = cal_barycentric_coor(v);
-//     return baryCoor.a * t_v0 + baryCoor.b * t_v1 + baryCoor.c * t_v2;
-//   }
-
-//   Vec4 get_texture_color(Vec3 &v) {
-//     Vec3 textCoor = get_texture_coor(v);
-
-//     textCoor = textCoor * 1;
-
-//     double x = textCoor.a - trunc(textCoor.a);
-//     double y = textCoor.b - trunc(textCoor.b);
-
-//     x = x + 0.0;
-//     y = y + 0.0;
-//     if (x > 1)
-//       x = x - 1;
-//     if (y > 1)
-//       y = y - 1;
-
-//     int ix = (int)ceil(x * FONT_SIZE);
-//     int iy = (int)ceil(y * FONT_SIZE);
-
-//     if (ix == FONT_SIZE)
-//       ix = FONT_SIZE - 1;
-//     if (iy == FONT_SIZE)
-//       iy = FONT_SIZE - 1;
-
-//     if (need_draw(Fonts::get_instance().get_font(c), ix, iy)) {
-//       return Vec4(0, 0, 0, 0.6);
-//     } else {
-//       return Vec4(1, 1, 1, 0.3);
-//     }
-//   }
-
-// private:
-//   Vec3 v0;
-//   Vec3 v1;
-//   Vec3 v2;
-
-//   Vec3 t_v0;
-//   Vec3 t_v1;
-//   Vec3 t_v2;
-
-//   double is_contain_help(Vec3 &v0, Vec3 &v1, Vec3 &p) {
-//     return dot(cross(v1 - v0, p - v0), n);
-//   }
-// };
-
-// bool interset(Ray &ray, Primitive &p, double &res) {
-//   // check if ray interset with primitive
-//   // res is t for ray
-//   // return bool
-//   double temp = dot(ray.direction, p.n);
-//   if (temp > 0.001 || temp < -0.001) {
-//     double t = (p.offset - dot(ray.origin, p.n)) / temp;
-//     res = t;
-//     return true;
-//   } else {
-//     return false;
-//   }
-// }
-
-// class TransparentColor {
-// public:
-//   Vec4 color;
-//   double t;
-
-//   TransparentColor(const Vec4 &nc, const double nt) : color(nc), t(nt) {}
-
-//   static bool transparnet_color_comp(const TransparentColor &a,
-//                                      const TransparentColor &b) {
-//     return a.t > b.t;
-//   }
-// };
-
-// Vec4 cal_color(Vec3 &target, Vec3 &camera, vector<Primitive> &primitives) {
-//   vector<TransparentColor> colors;
-//   colors.clear();
-//   Ray r(camera, (target - camera).normalize());
-//   double t;
-//   for (Primitive &p : primitives) {
-//     if (interset(r, p, t)) {
-//       Vec3 temp = r.origin + r.direction * t;
-//       if (p.contain(temp)) {
-//         Vec4 c = p.get_texture_color(temp);
-//         colors.push_back(TransparentColor(c, t));
-//       }
-//     }
-//   }
-
-//   sort(colors.begin(), colors.end(),
-//   TransparentColor::transparnet_color_comp);
-
-//   Vec4 color(60.0 / 255.0, 240.0 / 255.0, 165.0 / 255.0, 0.1);
-
-//   for (auto c = colors.begin(); c != colors.end(); c++) {
-//     color = (1 - c->color.d) * color + c->color.d * c->color;
-//   }
-//   return color;
-// }
-
-// inline Vec3 get_sample_coor(const int x, const int y, const int w) {
-//   return Vec3(1.0 / (w * 2.0) + (double)x / (double)w,
-//               1.0 / (w * 2.0) + (double)y / (double)w, 0);
-// }
-
-// std::default_random_engine e;
-// std::uniform_real_distribution<double> u(0, 1);
-// double range = 4.0 / PIC_SIZE;
-// inline Vec3 random_offset() {
-//   return Vec3(range * u(e) - range / 2.0, range * u(e) - range / 2.0, 0);
-// }
-
-// int main() {
-//   ofstream file;
-//   Vec3 camera(0, 0, 6);
-//   int width = PIC_SIZE;
-//   int height = PIC_SIZE;
-//   Vec3 base(-2, -2, 0);
-//   Vec3 u(4, 0, 0);
-//   Vec3 v(0, 4, 0);
-
-//   int sample = 2;
-//   int randomOffsetTime = 10;
-
-//   Vec3 vertexs[8] = {Vec3(0.5, 0.5, 0.5),   Vec3(0.5, 0.5, -0.5),
-//                      Vec3(0.5, -0.5, 0.5),  Vec3(0.5, -0.5, -0.5),
-//                      Vec3(-0.5, 0.5, 0.5),  Vec3(-0.5, 0.5, -0.5),
-//                      Vec3(-0.5, -0.5, 0.5), Vec3(-0.5, -0.5, -0.5)};
-
-//   Mat4x4 mat;
-//   mat.rotate_x(40 * M_PI / 180)
-//       .rotate_y(45 * M_PI / 180)
-//       .rotate_z(50 * M_PI / 180)
-//       .scale(Vec3(2, 2, 2))
-//       .translate(Vec3(0.2, 0, 1.0));
-//   for (int i = 0; i < 8; i++) {
-//     vertexs[i] = mat * vertexs[i];
-//   }
-//   vector<Primitive> primitives;
-//   {
-//     primitives.push_back(
-//         Primitive(vertexs[0], vertexs[2], vertexs[6])
-//             .set_texture_coor(Vec3(0, 1, 0), Vec3(1, 1, 0), Vec3(1, 0, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[6], vertexs[4], vertexs[0])
-//             .set_texture_coor(Vec3(1, 0, 0), Vec3(0, 0, 0), Vec3(0, 1, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[0], vertexs[1], vertexs[2])
-//             .set_texture_coor(Vec3(0, 1, 0), Vec3(0, 2, 0), Vec3(1, 1, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[3], vertexs[2], vertexs[1])
-//             .set_texture_coor(Vec3(1, 2, 0), Vec3(1, 1, 0), Vec3(0, 2, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[1], vertexs[0], vertexs[5])
-//             .set_texture_coor(Vec3(4, 2, 0), Vec3(4, 1, 0), Vec3(3, 2, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[0], vertexs[4], vertexs[5])
-//             .set_texture_coor(Vec3(4, 1, 0), Vec3(3, 1, 0), Vec3(3, 2, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[4], vertexs[5], vertexs[6])
-//             .set_texture_coor(Vec3(3, 1, 0), Vec3(3, 2, 0), Vec3(2, 1, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[5], vertexs[7], vertexs[6])
-//             .set_texture_coor(Vec3(3, 2, 0), Vec3(2, 2, 0), Vec3(2, 1, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[2], vertexs[6], vertexs[7])
-//             .set_texture_coor(Vec3(1, 1, 0), Vec3(2, 1, 0), Vec3(2, 2, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[3], vertexs[2], vertexs[7])
-//             .set_texture_coor(Vec3(1, 2, 0), Vec3(1, 1, 0), Vec3(2, 2, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[1], vertexs[3], vertexs[7])
-//             .set_texture_coor(Vec3(0, 2, 0), Vec3(1, 2, 0), Vec3(1, 3, 0)));
-//     primitives.push_back(
-//         Primitive(vertexs[7], vertexs[5], vertexs[1])
-//             .set_texture_coor(Vec3(1, 3, 0), Vec3(0, 3, 0), Vec3(0, 2, 0)));
-//   }
-
-//   e.seed(time(NULL));
-
-//   for (; c <= 'z'; c++) {
-//     string s("./output/pic_a.ppm");
-//     s[13] = c;
-//     cout << s << endl;
-//     file.open(s, std::fstream::out | fstream::trunc);
-//     file << "P3" << endl;
-//     file << width << " " << height << endl;
-//     file << "255" << endl;
-
-//     for (int i = width - 1; i >= 0; i--) {
-//       for (int j = 0; j < width; j++) {
-//         Vec4 color;
-//         Vec3 target;
-
-//         for (int k = 0; k < randomOffsetTime; k++) {
-//           for (int m = 0; m < sample; m++) {
-//             for (int n = 0; n < sample; n++) {
-//               Vec3 sample_coor = get_sample_coor(m, n, sample);
-//               target = base + u / width * ((double)i + sample_coor.a) +
-//                        v / height * ((double)j + sample_coor.b) +
-//                        random_offset();
-//               color = color + cal_color(target, camera, primitives);
-//             }
-//           }
-//         }
-
-//         color = color / (sample * sample * randomOffsetTime);
-
-//         // target =
-//         //     base + u / width * ((double)i + 0.5) + v / height * ((double)j
-//         +
-//         //     0.5);
-//         // color = color + cal_color(target, camera, primitives);
-
-//         int a = (int)(round(color.a * 255));
-//         int b = (int)(round(color.b * 255));
-//         int c = (int)(round(color.c * 255));
-//         file << a << " " << b << " " << c << "\n";
-//       }
-//     }
-//     file.close();
-//     cout << "finish render " << c << " " << time(NULL) << endl;
-//   }
-//   return 0;
-// }
\ No newline at end of file
+#include "avatar.h"
+#include "cache.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "progressive.h"
+#include "raster.h"
+#include "resample.h"
+#include "render.h"
+#include "sampler.h"
+#include "sequence.h"
+#include "server.h"
+#include "sponge.h"
+#include "wavefront.h"
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+const int PIC_SIZE = 512;
+
+class Options {
+public:
+  int spp;
+  SamplerType samplerType;
+  unsigned seed;
+  bool sequence;
+  char glyph;
+  int frameNum;
+  int passNum, passSpp, previewInterval;
+  string checkpointPath;
+  int workerNum; // -1 when not distributed
+  bool worker;
+  string address, sceneCachePath;
+  bool serve;
+  int requestNum, size; // client
+  string cacheDirectory; // empty to render everything
+  vector<int> sizes;
+  ResampleFilter filter;
+  Shading shading;
+  bool raster;    // primary visibility by rasterizing
+  bool wavefront; // stage by stage over queues of rays
+  int spongeLevel; // -1 for the avatar cube
+  bool denoise;    // filter guided by the first surfaces
+  ResolveOptions resolve; // bytes of the written images
+
+  Options()
+      : spp(RENDER_SPP), samplerType(SAMPLER_SOBOL), seed(0), sequence(false),
+        glyph('a'), frameNum(36), passNum(0), passSpp(4), previewInterval(0),
+        checkpointPath(), workerNum(-1), worker(false), address(),
+        sceneCachePath("./output/scene.cache"), serve(false), requestNum(0),
+        size(128), cacheDirectory(), sizes(),
+        filter(FILTER_MITCHELL), shading(), raster(false),
+        wavefront(false), spongeLevel(-1),
+        denoise(false), resolve() {}
+};
+
+void render_alphabet(Options &options) {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.shading = options.shading;
+  scene.build();
+  Camera camera = avatar_camera(PIC_SIZE);
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+  RenderCache cache(CACHE_MEMORY_BUDGET, options.cacheDirectory);
+  WavefrontStats stats;
+
+  for (char c = 'a'; c <= 'z'; c++) {
+    string s("./output/pic_a.ppm");
+    s[13] = c;
+    cout << s << endl;
+    scene.glyph = c;
+    string key = render_key(scene, camera, *sampler, options.spp, false,
+                            options.denoise, options.resolve);
+    vector<char> image;
+    if (options.cacheDirectory.empty() || !cache.get(key, image)) {
+      Framebuffer fb(PIC_SIZE, PIC_SIZE);
+      if (options.denoise) {
+        AuxBuffer aux(PIC_SIZE, PIC_SIZE);
+        render_aux(scene, camera, *sampler, fb, aux, options.spp);
+        denoise(fb, aux);
+      } else if (options.raster) {
+        rasterize(scene, camera, *sampler, fb, options.spp);
+      } else if (options.wavefront) {
+        render_wavefront(scene, camera, *sampler, fb, options.spp, 0, &stats);
+      } else {
+        render(scene, camera, *sampler, fb, options.spp);
+      }
+      image = fb.encode_ppm(false, options.resolve);
+      if (!options.cacheDirectory.empty()) {
+        cache.put(key, image);
+      }
+    }
+    write_file(s, image);
+    cout << "finish render " << c << " " << time(NULL) << endl;
+  }
+  if (!options.cacheDirectory.empty()) {
+    cout << cache.stats();
+  }
+  if (options.wavefront) {
+    cout << stats.report();
+  }
+  delete sampler;
+}
+
+// every letter is rendered once at the largest size, the smaller ones are
+// filtered down from it
+void render_alphabet_sizes(Options &options) {
+  int maxSize = *max_element(options.sizes.begin(), options.sizes.end());
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.shading = options.shading;
+  scene.build();
+  Camera camera = avatar_camera(maxSize);
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+  Framebuffer fb(maxSize, maxSize);
+  LinearImage linear, small, temp;
+
+  for (char c = 'a'; c <= 'z'; c++) {
+    scene.glyph = c;
+    fb.clear();
+    if (options.raster) {
+      rasterize(scene, camera, *sampler, fb, options.spp);
+    } else if (options.wavefront) {
+      render_wavefront(scene, camera, *sampler, fb, options.spp);
+    } else {
+      render(scene, camera, *sampler, fb, options.spp);
+    }
+    to_linear(fb, linear);
+    for (int size : options.sizes) {
+      char name[64];
+      snprintf(name, sizeof(name), "./output/pic_%c_%d.ppm", c, size);
+      if (size == maxSize) {
+        fb.write_ppm(name, options.resolve);
+        continue;
+      }
+      small.resize(size, size);
+      resample(linear, small, options.filter, temp);
+      Framebuffer out(size, size);
+      to_framebuffer(small, out);
+      out.write_ppm(name, options.resolve);
+    }
+    cout << "finish render " << c << " " << time(NULL) << endl;
+  }
+  delete sampler;
+}
+
+// one full turn of the cube in frameNum frames
+void render_turntable(Options &options) {
+  Scene scene;
+  Mat4x4 identity;
+  generate_avatar_cube(scene.triangles, identity);
+  scene.shading = options.shading;
+  scene.build();
+  Camera camera = avatar_camera(PIC_SIZE);
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+  SequenceRenderer sequence(scene, *sampler, options.spp);
+
+  for (int i = 0; i < options.frameNum; i++) {
+    SequenceFrame frame(avatar_transform(2 * M_PI * i / options.frameNum),
+                        camera, options.glyph);
+    Framebuffer fb(PIC_SIZE, PIC_SIZE);
+    sequence.render_frame(frame, fb);
+
+    char name[64];
+    snprintf(name, sizeof(name), "./output/seq_%c_%03d.ppm", options.glyph,
+             i);
+    fb.write_ppm(name, options.resolve);
+    cout << "finish frame " << i << " " << time(NULL) << endl;
+  }
+  cout << "reused " << sequence.reusedNum << " rejected "
+       << sequence.rejectedNum << endl;
+  delete sampler;
+}
+
+// the glyph on an implicit menger sponge, cells under a pixel are solid
+void render_sponge_glyph(Options &options) {
+  Scene scene;
+  scene.glyph = options.glyph;
+  Camera camera(Vec3(2.5, 1.8, 3), Vec3(0.5, 0.5, 0.5), Vec3(0, 1, 0), 1, 1,
+                PIC_SIZE, PIC_SIZE);
+  MengerSponge sponge(Vec3(0, 0, 0), 1, options.spongeLevel,
+                      camera.planeSize /
+                          (camera.planeDistance * PIC_SIZE));
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+  Framebuffer fb(PIC_SIZE, PIC_SIZE);
+  render_sponge(scene, sponge, camera, *sampler, fb, options.spp);
+
+  char name[64];
+  snprintf(name, sizeof(name), "./output/sponge_%c_%d.ppm", options.glyph,
+           options.spongeLevel);
+  fb.write_ppm(name, options.resolve);
+  cout << "finish sponge " << name << " " << time(NULL) << endl;
+  delete sampler;
+}
+
+// passes are accumulated into one image, a restarted job with the same
+// checkpoint continues after the last saved pass
+int render_progressive(Options &options) {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.glyph = options.glyph;
+  scene.shading = options.shading;
+  scene.build();
+  Camera camera = avatar_camera(PIC_SIZE);
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+
+  string s("./output/progressive_a.ppm");
+  s[21] = options.glyph;
+  ProgressiveRenderer progressive(scene, camera, *sampler, options.passSpp,
+                                  options.passNum);
+  progressive.previewPath = s;
+  progressive.previewInterval =
+      options.previewInterval > 0 ? options.previewInterval : options.passNum;
+  progressive.checkpointPath = options.checkpointPath;
+
+  signal(SIGTERM, progressive_stop_handler);
+  signal(SIGINT, progressive_stop_handler);
+  Framebuffer fb(PIC_SIZE, PIC_SIZE);
+  bool finish = progressive.render(fb);
+  cout << (finish ? "finish render " : "stop render ") << options.glyph
+       << " pass " << progressive.passDone << " " << time(NULL) << endl;
+  delete sampler;
+  return finish ? 0 : 1;
+}
+
+// tiles of every letter are rendered by worker processes, the workers load
+// the scene from the cache file written here
+void render_alphabet_distributed(Options &options) {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.shading = options.shading;
+  scene.build();
+  Camera camera = avatar_camera(PIC_SIZE);
+  Sampler *sampler =
+      create_sampler(options.samplerType, options.seed, options.spp);
+  if (!write_scene_cache(options.sceneCachePath, scene, camera)) {
+    cout << "fail to write " << options.sceneCachePath << endl;
+    return;
+  }
+
+  Coordinator coordinator(options.address);
+  if (!coordinator.ok()) {
+    cout << "fail to listen " << options.address << endl;
+    return;
+  }
+  coordinator.start_local_workers(options.workerNum, options.sceneCachePath);
+
+  vector<char> glyphs;
+  vector<Framebuffer *> images;
+  for (char c = 'a'; c <= 'z'; c++) {
+    glyphs.push_back(c);
+    images.push_back(new Framebuffer(PIC_SIZE, PIC_SIZE));
+  }
+  coordinator.render(scene, camera, *sampler, options.spp, 0, glyphs, images);
+
+  for (int i = 0; i < (int)images.size(); i++) {
+    string s("./output/pic_a.ppm");
+    s[13] = glyphs[i];
+    images[i]->write_ppm(s, options.resolve);
+    delete images[i];
+  }
+  cout << "finish render, lost workers " << coordinator.workerDeathNum
+       << " late " << coordinator.lateWorkerNum << " local jobs "
+       << coordinator.localJobNum << " " << time(NULL) << endl;
+  delete sampler;
+}
+
+// resident render daemon, answers until SIGTERM or SIGINT
+int run_server(Options &options) {
+  RenderServer server(options.address, options.samplerType, options.seed,
+                      options.cacheDirectory);
+  if (!server.ok()) {
+    cout << "fail to listen " << options.address << endl;
+    return 1;
+  }
+  signal(SIGTERM, server_stop_handler);
+  signal(SIGINT, server_stop_handler);
+  cout << "serve " << options.address << endl;
+  server.run();
+  cout << server.stats();
+  return 0;
+}
+
+// requestNum requests one after another, the last image is written out
+int run_client(Options &options) {
+  int fd = connect_socket(options.address);
+  if (fd < 0) {
+    cout << "fail to connect " << options.address << endl;
+    return 1;
+  }
+  RenderRequest request;
+  request.glyph = options.glyph;
+  request.size = options.size;
+  request.spp = options.spp;
+
+  LatencyHistogram latency;
+  vector<char> image;
+  for (int i = 0; i < options.requestNum; i++) {
+    auto start = chrono::steady_clock::now();
+    if (!request_render(fd, request, image)) {
+      cout << "request fail" << endl;
+      close(fd);
+      return 1;
+    }
+    chrono::duration<double, milli> ms = chrono::steady_clock::now() - start;
+    latency.add(ms.count());
+  }
+  string s("./output/server_a.ppm");
+  s[16] = options.glyph;
+  write_file(s, image);
+
+  string stats;
+  request_stats(fd, stats);
+  close(fd);
+  cout << "client " << latency.report() << "server " << stats;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // avatar_a [--spp n] [--sampler stratified|halton|sobol|blue_noise]
+  //          [--seed n] [--glyph c] [--sequence [glyph] [frames]]
+  //          [--progressive passes [--pass-spp n] [--preview-interval n]
+  //           [--checkpoint path]]
+  //          [--distributed local_workers | --worker] [--address addr]
+  //          [--scene-cache path]
+  //          [--serve | --client requests [--size n]] [--address addr]
+  //          [--cache dir | --no-cache]
+  //          [--sizes n,n,... [--filter box|mitchell|lanczos]]
+  //          [--light x,y,z] [--ao rays] [--ao-distance d] [--ambient a]
+  //          [--raster | --wavefront | --denoise] [--sponge level]
+  //          [--dither ordered|blue_noise] [--cpu scalar|sse2|avx2|avx512]
+  // addr is unix:/path or tcp:host:port
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+      options.spp = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+      options.samplerType = get_sampler_type(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      options.seed = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--glyph") == 0 && i + 1 < argc) {
+      options.glyph = argv[++i][0];
+    } else if (strcmp(argv[i], "--progressive") == 0 && i + 1 < argc) {
+      options.passNum = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--pass-spp") == 0 && i + 1 < argc) {
+      options.passSpp = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--preview-interval") == 0 && i + 1 < argc) {
+      options.previewInterval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      options.checkpointPath = argv[++i];
+    } else if (strcmp(argv[i], "--distributed") == 0 && i + 1 < argc) {
+      options.workerNum = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--worker") == 0) {
+      options.worker = true;
+    } else if (strcmp(argv[i], "--address") == 0 && i + 1 < argc) {
+      options.address = argv[++i];
+    } else if (strcmp(argv[i], "--scene-cache") == 0 && i + 1 < argc) {
+      options.sceneCachePath = argv[++i];
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      options.cacheDirectory = argv[++i];
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      options.cacheDirectory.clear();
+    } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      for (char *p = strtok(argv[++i], ","); p != nullptr;
+           p = strtok(nullptr, ",")) {
+        if (atoi(p) > 0) {
+          options.sizes.push_back(atoi(p));
+        }
+      }
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = get_resample_filter(argv[++i]);
+    } else if (strcmp(argv[i], "--light") == 0 && i + 1 < argc) {
+      Vec3 &light = options.shading.light;
+      options.shading.shadow =
+          sscanf(argv[++i], "%lf,%lf,%lf", &light.a, &light.b, &light.c) == 3;
+    } else if (strcmp(argv[i], "--ao") == 0 && i + 1 < argc) {
+      options.shading.aoRayNum = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--ao-distance") == 0 && i + 1 < argc) {
+      options.shading.aoDistance = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--ambient") == 0 && i + 1 < argc) {
+      options.shading.ambient = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--raster") == 0) {
+      options.raster = true;
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      options.wavefront = true;
+    } else if (strcmp(argv[i], "--denoise") == 0) {
+      options.denoise = true;
+    } else if (strcmp(argv[i], "--dither") == 0 && i + 1 < argc) {
+      options.resolve.dither = get_dither_type(argv[++i]);
+    } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+      CpuInfo::get_instance().set_level(get_cpu_level(argv[++i]));
+    } else if (strcmp(argv[i], "--sponge") == 0 && i + 1 < argc) {
+      options.spongeLevel = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      options.serve = true;
+    } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+      options.requestNum = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      options.size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sequence") == 0) {
+      options.sequence = true;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.glyph = argv[++i][0];
+      }
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.frameNum = atoi(argv[++i]);
+      }
+    }
+  }
+
+  if (options.address.empty() && (options.serve || options.requestNum > 0)) {
+    options.address = "unix:/tmp/myavatar.sock";
+  }
+  if (options.address.empty()) {
+    options.address =
+        "unix:/tmp/myavatar_" + to_string((int)getpid()) + ".sock";
+  }
+
+  if (options.serve) {
+    return run_server(options);
+  }
+  if (options.requestNum > 0) {
+    return run_client(options);
+  }
+  if (options.worker) {
+    return run_worker(options.address, options.sceneCachePath);
+  }
+  if (options.workerNum >= 0) {
+    render_alphabet_distributed(options);
+    return 0;
+  }
+  if (options.passNum > 0) {
+    return render_progressive(options);
+  }
+  if (options.spongeLevel >= 0) {
+    render_sponge_glyph(options);
+  } else if (!options.sizes.empty()) {
+    render_alphabet_sizes(options);
+  } else if (options.sequence) {
+    render_turntable(options);
+  } else {
+    render_alphabet(options);
+  }
+  return 0;
+}
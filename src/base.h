@@ -1,14 +1,22 @@
 #ifndef BASE_H
 #define BASE_H
 
+#include "cpu.h"
 #include "vec.h"
 #include <algorithm>
+#include <atomic>
 #include <cfloat>
 #include <deque>
 #include <iostream>
+#include <mutex>
+#include <random>
 #include <vector>
 
 #define BOX_MAX_CHILD_NUM 4
+// lazy nodes pick one of these mutexes by address to split
+#define BOX_LAZY_MUTEX_NUM 64
+// bins of the centers a lazy node is split over
+#define BOX_BIN_NUM 16
 
 namespace MyAvatar {
 namespace Help {
@@ -60,7 +68,7 @@ inline Vec3 help_max(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2) {
 class Ray {
 public:
   Ray() : origin(), direction() {}
-  Ray(Vec3 &o, Vec3 &d) : origin(o), direction(d) {}
+  Ray(const Vec3 &o, const Vec3 &d) : origin(o), direction(d) {}
   Vec3 origin;
   Vec3 direction;
   friend std::ostream &operator<<(std::ostream &output, const Ray &r) {
@@ -74,15 +82,44 @@ public:
   Vec3 v0, v1, v2;
   Vec3 n;
   double offset;
+  Vec3 t_v0, t_v1, t_v2;
 
   Triangle(const Vec3 &iv0, const Vec3 &iv1, const Vec3 &iv2)
-      : v0(iv0), v1(iv1), v2(iv2) {
+      : v0(iv0), v1(iv1), v2(iv2), t_v0(), t_v1(), t_v2() {
     n = cross(v1 - v0, v2 - v0);
     offset = dot(v0, n);
   }
 
   Triangle(const Triangle &t)
-      : v0(t.v0), v1(t.v1), v2(t.v2), n(t.n), offset(t.offset) {}
+      : v0(t.v0), v1(t.v1), v2(t.v2), n(t.n), offset(t.offset), t_v0(t.t_v0),
+        t_v1(t.t_v1), t_v2(t.t_v2) {}
+
+  Triangle &set_texture_coor(const Vec3 &it_v0, const Vec3 &it_v1,
+                             const Vec3 &it_v2) {
+    t_v0 = it_v0;
+    t_v1 = it_v1;
+    t_v2 = it_v2;
+    return *this;
+  }
+
+  Vec3 get_texture_coor(Vec3 &v) {
+    // barycentric weights are the sub triangle areas along n
+    double area = dot(n, n);
+    double b0 = dot(cross(v1 - v, v2 - v), n) / area;
+    double b1 = dot(cross(v2 - v, v0 - v), n) / area;
+    double b2 = 1 - b0 - b1;
+    return b0 * t_v0 + b1 * t_v1 + b2 * t_v2;
+  }
+
+  Triangle &transform(Mat4x4 &mat) {
+    // move vertices in place, plane must follow
+    v0 = mat * v0;
+    v1 = mat * v1;
+    v2 = mat * v2;
+    n = cross(v1 - v0, v2 - v0);
+    offset = dot(v0, n);
+    return *this;
+  }
 
   friend std::ostream &operator<<(std::ostream &output,
                                   const Triangle &triangle) {
@@ -119,6 +156,69 @@ private:
   }
 };
 
+// an axis aligned rectangle on the plane where coordinate axis is plane,
+// covering [min, max] of the two other axes in order (axis + 1, axis + 2).
+// texture coordinates run linearly from t_min at min to t_max at max
+class Rect {
+public:
+  int axis;
+  double plane;
+  double min[2], max[2];
+  Vec3 t_min, t_max;
+
+  Rect(int iaxis, double iplane, double u0, double v0, double u1, double v1)
+      : axis(iaxis), plane(iplane), t_min(), t_max() {
+    min[0] = std::min(u0, u1);
+    min[1] = std::min(v0, v1);
+    max[0] = std::max(u0, u1);
+    max[1] = std::max(v0, v1);
+  }
+
+  Rect &set_texture_coor(const Vec3 &it_min, const Vec3 &it_max) {
+    t_min = it_min;
+    t_max = it_max;
+    return *this;
+  }
+
+  Vec3 normal() const {
+    return Vec3(axis == 0 ? 1 : 0, axis == 1 ? 1 : 0, axis == 2 ? 1 : 0);
+  }
+
+  Vec3 corner(double u, double v) const {
+    double p[3];
+    p[axis] = plane;
+    p[(axis + 1) % 3] = u;
+    p[(axis + 2) % 3] = v;
+    return Vec3(p[0], p[1], p[2]);
+  }
+
+  Vec3 get_texture_coor(Vec3 &v) {
+    double u = (get(v, (axis + 1) % 3) - min[0]) / (max[0] - min[0]);
+    double w = (get(v, (axis + 2) % 3) - min[1]) / (max[1] - min[1]);
+    return Vec3(t_min.a + (t_max.a - t_min.a) * u,
+                t_min.b + (t_max.b - t_min.b) * w, 0);
+  }
+
+  // t of the ray on the plane, true when the point is inside. no normal,
+  // no cross products, rays along the plane never hit
+  bool interset(Ray &ray, double &res) {
+    double d = get(ray.direction, axis);
+    if (d == 0) {
+      return false;
+    }
+    res = (plane - get(ray.origin, axis)) / d;
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    double pu = get(ray.origin, u) + get(ray.direction, u) * res;
+    double pv = get(ray.origin, v) + get(ray.direction, v) * res;
+    return pu >= min[0] && pu <= max[0] && pv >= min[1] && pv <= max[1];
+  }
+
+private:
+  static double get(const Vec3 &v, int i) {
+    return i == 0 ? v.a : i == 1 ? v.b : v.c;
+  }
+};
+
 using namespace MyAvatar::Help;
 
 class Box {
@@ -126,19 +226,25 @@ public:
   Vec3 min, max;
   Box *lChild, *rChild;
   std::vector<Triangle *> leaf;
+  std::vector<Rect *> rects; // next to the triangles of a leaf
+  // a leaf holding every primitive below it, not split yet. see expand_box
+  std::atomic<bool> lazy;
 
   Box()
-      : min(1, 1, 1), max(0, 0, 0), lChild(nullptr), rChild(nullptr), leaf() {}
+      : min(DBL_MAX, DBL_MAX, DBL_MAX), max(-DBL_MAX, -DBL_MAX, -DBL_MAX),
+        lChild(nullptr), rChild(nullptr), leaf(), rects(), lazy(false) {}
 
   Box(const Vec3 &imin, const Vec3 &imax)
-      : min(imin), max(imax), lChild(nullptr), rChild(nullptr), leaf() {}
+      : min(imin), max(imax), lChild(nullptr), rChild(nullptr), leaf(),
+        rects(), lazy(false) {}
 
   Box(const Box &box)
       : min(box.min), max(box.max), lChild(box.lChild), rChild(box.rChild),
-        leaf(box.leaf) {}
+        leaf(box.leaf), rects(box.rects), lazy(box.lazy.load()) {}
 
   Box(const Triangle &triangle)
-      : min(1, 1, 1), max(0, 0, 0), lChild(nullptr), rChild(nullptr), leaf() {
+      : min(1, 1, 1), max(0, 0, 0), lChild(nullptr), rChild(nullptr), leaf(),
+        rects(), lazy(false) {
     min = help_min(triangle.v0, triangle.v1, triangle.v2);
     max = help_max(triangle.v0, triangle.v1, triangle.v2);
   }
@@ -148,39 +254,12 @@ public:
     delete rChild;
   }
 
-  bool hit(const Ray &r) {
-    double aMin, aMax, bMin, bMax, cMin, cMax;
-    if (r.direction.a != 0) {
-      aMin = (min.a - r.origin.a) / r.direction.a;
-      aMax = (max.a - r.origin.a) / r.direction.a;
-    } else {
-      aMin = DBL_MAX;
-      aMax = DBL_MIN;
-    }
-    if (r.direction.b != 0) {
-      bMin = (min.b - r.origin.b) / r.direction.b;
-      bMax = (max.b - r.origin.b) / r.direction.b;
-    } else {
-      bMin = DBL_MAX;
-      bMax = DBL_MIN;
-    }
-    if (r.direction.c != 0) {
-      cMin = (min.c - r.origin.c) / r.direction.c;
-      cMax = (max.c - r.origin.c) / r.direction.c;
-    } else {
-      cMin = DBL_MAX;
-      cMax = DBL_MIN;
-    }
-
-    double hitMin, hitMax;
-    hitMin = aMin;
-    hitMin = hitMin < bMin ? hitMin : bMin;
-    hitMin = hitMin < cMin ? hitMin : cMin;
-    hitMax = aMax;
-    hitMax = hitMax > bMax ? hitMax : bMax;
-    hitMax = hitMax > cMax ? hitMax : cMax;
-
-    return hitMin <= hitMax;
+  // only hits within [0, tMax] count
+  bool hit(const Ray &r, double tMax = DBL_MAX) {
+    double tMin = 0;
+    return slab(r.origin.a, r.direction.a, min.a, max.a, tMin, tMax) &&
+           slab(r.origin.b, r.direction.b, min.b, max.b, tMin, tMax) &&
+           slab(r.origin.c, r.direction.c, min.c, max.c, tMin, tMax);
   }
 
   Box &combine(const Vec3 &v) {
@@ -196,9 +275,358 @@ public:
     return *this;
   }
 
+  Box &combine(Rect *q) {
+    combine(q->corner(q->min[0], q->min[1]));
+    combine(q->corner(q->max[0], q->max[1]));
+    rects.push_back(q);
+    return *this;
+  }
+
+  int primitive_num() { return leaf.size() + rects.size(); }
+
+  double surface_area() {
+    Vec3 d = max - min;
+    return 2 * (d.a * d.b + d.b * d.c + d.c * d.a);
+  }
+
+  bool is_leaf() { return lChild == nullptr && rChild == nullptr; }
+
   friend Box combine_box(const Box &b1, const Box &b2) {
     return Box(Vec3(help_min(b1.min, b2.min)), Vec3(help_max(b1.max, b2.max)));
   }
+
+private:
+  static bool slab(double o, double d, double lo, double hi, double &tMin,
+                   double &tMax) {
+    // clip [tMin, tMax] against one axis
+    if (d == 0) {
+      return o >= lo && o <= hi;
+    }
+    double t0 = (lo - o) / d;
+    double t1 = (hi - o) / d;
+    if (t0 > t1) {
+      std::swap(t0, t1);
+    }
+    tMin = tMin > t0 ? tMin : t0;
+    tMax = tMax < t1 ? tMax : t1;
+    return tMin <= tMax;
+  }
+};
+
+// triangles tested against one ray at once by hit_triangles
+#define TRIANGLE_LANE_NUM 4
+
+#ifdef CPU_DISPATCH
+// the plane, offset and vertices of num triangles, a row per component and
+// a column per lane. lanes past num repeat the first triangle
+void gather_triangles(Triangle *const *p, int num, double f[13][4]) {
+  for (int j = 0; j < TRIANGLE_LANE_NUM; j++) {
+    Triangle *q = p[j < num ? j : 0];
+    const Vec3 *vs[4] = {&q->n, &q->v0, &q->v1, &q->v2};
+    for (int k = 0; k < 4; k++) {
+      f[k * 3 + (k > 0)][j] = vs[k]->a;
+      f[k * 3 + (k > 0) + 1][j] = vs[k]->b;
+      f[k * 3 + (k > 0) + 2][j] = vs[k]->c;
+    }
+    f[3][j] = q->offset;
+  }
+}
+
+// the edge function of contain, dot(cross(vj - vi, p - vi), n) lane by lane
+// in the order of cross and dot
+CPU_TARGET("sse2")
+inline __m128d edge_sse2(const __m128d *vi, const __m128d *vj,
+                         const __m128d *p, const __m128d *n) {
+  __m128d e[3], q[3];
+  for (int k = 0; k < 3; k++) {
+    e[k] = _mm_sub_pd(vj[k], vi[k]);
+    q[k] = _mm_sub_pd(p[k], vi[k]);
+  }
+  __m128d c0 = _mm_sub_pd(_mm_mul_pd(e[1], q[2]), _mm_mul_pd(e[2], q[1]));
+  __m128d c1 = _mm_sub_pd(_mm_mul_pd(e[2], q[0]), _mm_mul_pd(e[0], q[2]));
+  __m128d c2 = _mm_sub_pd(_mm_mul_pd(e[0], q[1]), _mm_mul_pd(e[1], q[0]));
+  return _mm_add_pd(_mm_add_pd(_mm_mul_pd(c0, n[0]), _mm_mul_pd(c1, n[1])),
+                    _mm_mul_pd(c2, n[2]));
+}
+
+// interset, t > 0 and contain for two triangles a register
+CPU_TARGET("sse2")
+int hit_triangles_sse2(Triangle *const *p, int num, Ray &r, double *t) {
+  double f[13][4];
+  gather_triangles(p, num, f);
+  __m128d o[3] = {_mm_set1_pd(r.origin.a), _mm_set1_pd(r.origin.b),
+                  _mm_set1_pd(r.origin.c)};
+  __m128d d[3] = {_mm_set1_pd(r.direction.a), _mm_set1_pd(r.direction.b),
+                  _mm_set1_pd(r.direction.c)};
+  __m128d zero = _mm_setzero_pd();
+  int mask = 0;
+  for (int h = 0; h < num; h += 2) {
+    __m128d v[13];
+    for (int k = 0; k < 13; k++) {
+      v[k] = _mm_loadu_pd(&f[k][h]);
+    }
+    __m128d *n = v, *v0 = v + 4, *v1 = v + 7, *v2 = v + 10;
+    __m128d temp = _mm_add_pd(
+        _mm_add_pd(_mm_mul_pd(d[0], n[0]), _mm_mul_pd(d[1], n[1])),
+        _mm_mul_pd(d[2], n[2]));
+    __m128d ok = _mm_or_pd(_mm_cmpgt_pd(temp, _mm_set1_pd(0.001)),
+                           _mm_cmplt_pd(temp, _mm_set1_pd(-0.001)));
+    __m128d od = _mm_add_pd(
+        _mm_add_pd(_mm_mul_pd(o[0], n[0]), _mm_mul_pd(o[1], n[1])),
+        _mm_mul_pd(o[2], n[2]));
+    __m128d s = _mm_div_pd(_mm_sub_pd(v[3], od), temp);
+    ok = _mm_and_pd(ok, _mm_cmpgt_pd(s, zero));
+    __m128d point[3];
+    for (int k = 0; k < 3; k++) {
+      point[k] = _mm_add_pd(o[k], _mm_mul_pd(d[k], s));
+    }
+    __m128d t0 = edge_sse2(v0, v1, point, n);
+    __m128d t1 = edge_sse2(v1, v2, point, n);
+    __m128d t2 = edge_sse2(v2, v0, point, n);
+    __m128d ge = _mm_and_pd(
+        _mm_and_pd(_mm_cmpge_pd(t0, zero), _mm_cmpge_pd(t1, zero)),
+        _mm_cmpge_pd(t2, zero));
+    __m128d le = _mm_and_pd(
+        _mm_and_pd(_mm_cmple_pd(t0, zero), _mm_cmple_pd(t1, zero)),
+        _mm_cmple_pd(t2, zero));
+    ok = _mm_and_pd(ok, _mm_or_pd(ge, le));
+    _mm_storeu_pd(t + h, s);
+    mask |= _mm_movemask_pd(ok) << h;
+  }
+  return mask & ((1 << num) - 1);
+}
+
+CPU_TARGET("avx2")
+inline __m256d edge_avx2(const __m256d *vi, const __m256d *vj,
+                         const __m256d *p, const __m256d *n) {
+  __m256d e[3], q[3];
+  for (int k = 0; k < 3; k++) {
+    e[k] = _mm256_sub_pd(vj[k], vi[k]);
+    q[k] = _mm256_sub_pd(p[k], vi[k]);
+  }
+  __m256d c0 =
+      _mm256_sub_pd(_mm256_mul_pd(e[1], q[2]), _mm256_mul_pd(e[2], q[1]));
+  __m256d c1 =
+      _mm256_sub_pd(_mm256_mul_pd(e[2], q[0]), _mm256_mul_pd(e[0], q[2]));
+  __m256d c2 =
+      _mm256_sub_pd(_mm256_mul_pd(e[0], q[1]), _mm256_mul_pd(e[1], q[0]));
+  return _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(c0, n[0]), _mm256_mul_pd(c1, n[1])),
+      _mm256_mul_pd(c2, n[2]));
+}
+
+CPU_TARGET("avx2")
+int hit_triangles_avx2(Triangle *const *p, int num, Ray &r, double *t) {
+  double f[13][4];
+  gather_triangles(p, num, f);
+  __m256d v[13];
+  for (int k = 0; k < 13; k++) {
+    v[k] = _mm256_loadu_pd(f[k]);
+  }
+  __m256d *n = v, *v0 = v + 4, *v1 = v + 7, *v2 = v + 10;
+  __m256d o[3] = {_mm256_set1_pd(r.origin.a), _mm256_set1_pd(r.origin.b),
+                  _mm256_set1_pd(r.origin.c)};
+  __m256d d[3] = {_mm256_set1_pd(r.direction.a),
+                  _mm256_set1_pd(r.direction.b),
+                  _mm256_set1_pd(r.direction.c)};
+  __m256d zero = _mm256_setzero_pd();
+  __m256d temp = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(d[0], n[0]), _mm256_mul_pd(d[1], n[1])),
+      _mm256_mul_pd(d[2], n[2]));
+  __m256d ok = _mm256_or_pd(
+      _mm256_cmp_pd(temp, _mm256_set1_pd(0.001), _CMP_GT_OQ),
+      _mm256_cmp_pd(temp, _mm256_set1_pd(-0.001), _CMP_LT_OQ));
+  __m256d od = _mm256_add_pd(
+      _mm256_add_pd(_mm256_mul_pd(o[0], n[0]), _mm256_mul_pd(o[1], n[1])),
+      _mm256_mul_pd(o[2], n[2]));
+  __m256d s = _mm256_div_pd(_mm256_sub_pd(v[3], od), temp);
+  ok = _mm256_and_pd(ok, _mm256_cmp_pd(s, zero, _CMP_GT_OQ));
+  __m256d point[3];
+  for (int k = 0; k < 3; k++) {
+    point[k] = _mm256_add_pd(o[k], _mm256_mul_pd(d[k], s));
+  }
+  __m256d t0 = edge_avx2(v0, v1, point, n);
+  __m256d t1 = edge_avx2(v1, v2, point, n);
+  __m256d t2 = edge_avx2(v2, v0, point, n);
+  __m256d ge =
+      _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(t0, zero, _CMP_GE_OQ),
+                                  _mm256_cmp_pd(t1, zero, _CMP_GE_OQ)),
+                    _mm256_cmp_pd(t2, zero, _CMP_GE_OQ));
+  __m256d le =
+      _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(t0, zero, _CMP_LE_OQ),
+                                  _mm256_cmp_pd(t1, zero, _CMP_LE_OQ)),
+                    _mm256_cmp_pd(t2, zero, _CMP_LE_OQ));
+  ok = _mm256_and_pd(ok, _mm256_or_pd(ge, le));
+  _mm256_storeu_pd(t, s);
+  return _mm256_movemask_pd(ok) & ((1 << num) - 1);
+}
+#endif
+
+// which of the num <= TRIANGLE_LANE_NUM triangles of p the ray hits with
+// t > 0, bit i for p[i] with its t in t[i], which needs room for all lanes.
+// the answers of interset, t > 0 and contain at every level. avx512 hosts
+// run the avx2 kernel, a leaf has fewer triangles than 8 lanes
+int hit_triangles(Triangle *const *p, int num, Ray &r, double *t) {
+#ifdef CPU_DISPATCH
+  CpuLevel level = cpu_level();
+  if (level >= CPU_AVX2) {
+    return hit_triangles_avx2(p, num, r, t);
+  }
+  if (level == CPU_SSE2) {
+    return hit_triangles_sse2(p, num, r, t);
+  }
+#endif
+  int mask = 0;
+  for (int i = 0; i < num; i++) {
+    if (p[i]->interset(r, t[i]) && t[i] > 0) {
+      Vec3 point = r.origin + r.direction * t[i];
+      mask |= p[i]->contain(point) << i;
+    }
+  }
+  return mask;
+}
+
+// the bounds of a list of boxes, one array per component, so one ray is
+// tested against all of them at once. hit sets hits[i] to what
+// boxes[i]->hit(r) returns, every level gives the same answers
+class BoxBounds {
+public:
+  int size;
+  std::vector<Box *> boxes;
+  std::vector<double> lo[3], hi[3];
+  std::vector<unsigned char> hits;
+
+  // padded to a multiple of 8 with empty boxes
+  BoxBounds(const std::vector<Box *> &iboxes)
+      : size(iboxes.size()), boxes(iboxes), hits((size + 7) / 8 * 8) {
+    for (int k = 0; k < 3; k++) {
+      lo[k].assign(hits.size(), DBL_MAX);
+      hi[k].assign(hits.size(), -DBL_MAX);
+    }
+    for (int i = 0; i < size; i++) {
+      lo[0][i] = boxes[i]->min.a;
+      lo[1][i] = boxes[i]->min.b;
+      lo[2][i] = boxes[i]->min.c;
+      hi[0][i] = boxes[i]->max.a;
+      hi[1][i] = boxes[i]->max.b;
+      hi[2][i] = boxes[i]->max.c;
+    }
+  }
+
+  void hit(const Ray &r) {
+#ifdef CPU_DISPATCH
+    CpuLevel level = cpu_level();
+    if (level == CPU_AVX512) {
+      hit_avx512(r);
+      return;
+    }
+    if (level == CPU_AVX2) {
+      hit_avx2(r);
+      return;
+    }
+    if (level == CPU_SSE2) {
+      hit_sse2(r);
+      return;
+    }
+#endif
+    for (int i = 0; i < size; i++) {
+      hits[i] = boxes[i]->hit(r);
+    }
+  }
+
+private:
+#ifdef CPU_DISPATCH
+  // the slabs of Box::hit lane by lane, min and max pick the same operand
+  // as its comparisons. an axis the ray runs parallel to only checks the
+  // origin, the other axes clip [tMin, tMax]
+  CPU_TARGET("sse2")
+  void hit_sse2(const Ray &r) {
+    double o[3] = {r.origin.a, r.origin.b, r.origin.c};
+    double d[3] = {r.direction.a, r.direction.b, r.direction.c};
+    for (int i = 0; i < size; i += 2) {
+      __m128d tMin = _mm_setzero_pd(), tMax = _mm_set1_pd(DBL_MAX);
+      __m128d ok = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (int k = 0; k < 3; k++) {
+        __m128d vo = _mm_set1_pd(o[k]);
+        __m128d l = _mm_loadu_pd(&lo[k][i]), h = _mm_loadu_pd(&hi[k][i]);
+        if (d[k] == 0) {
+          ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpge_pd(vo, l),
+                                         _mm_cmple_pd(vo, h)));
+          continue;
+        }
+        __m128d vd = _mm_set1_pd(d[k]);
+        __m128d t0 = _mm_div_pd(_mm_sub_pd(l, vo), vd);
+        __m128d t1 = _mm_div_pd(_mm_sub_pd(h, vo), vd);
+        tMin = _mm_max_pd(tMin, _mm_min_pd(t1, t0));
+        tMax = _mm_min_pd(tMax, _mm_max_pd(t0, t1));
+        ok = _mm_and_pd(ok, _mm_cmple_pd(tMin, tMax));
+      }
+      int mask = _mm_movemask_pd(ok);
+      hits[i] = mask & 1;
+      hits[i + 1] = mask >> 1 & 1;
+    }
+  }
+
+  CPU_TARGET("avx2")
+  void hit_avx2(const Ray &r) {
+    double o[3] = {r.origin.a, r.origin.b, r.origin.c};
+    double d[3] = {r.direction.a, r.direction.b, r.direction.c};
+    for (int i = 0; i < size; i += 4) {
+      __m256d tMin = _mm256_setzero_pd(), tMax = _mm256_set1_pd(DBL_MAX);
+      __m256d ok = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+      for (int k = 0; k < 3; k++) {
+        __m256d vo = _mm256_set1_pd(o[k]);
+        __m256d l = _mm256_loadu_pd(&lo[k][i]);
+        __m256d h = _mm256_loadu_pd(&hi[k][i]);
+        if (d[k] == 0) {
+          ok = _mm256_and_pd(ok,
+                             _mm256_and_pd(_mm256_cmp_pd(vo, l, _CMP_GE_OQ),
+                                           _mm256_cmp_pd(vo, h, _CMP_LE_OQ)));
+          continue;
+        }
+        __m256d vd = _mm256_set1_pd(d[k]);
+        __m256d t0 = _mm256_div_pd(_mm256_sub_pd(l, vo), vd);
+        __m256d t1 = _mm256_div_pd(_mm256_sub_pd(h, vo), vd);
+        tMin = _mm256_max_pd(tMin, _mm256_min_pd(t1, t0));
+        tMax = _mm256_min_pd(tMax, _mm256_max_pd(t0, t1));
+        ok = _mm256_and_pd(ok, _mm256_cmp_pd(tMin, tMax, _CMP_LE_OQ));
+      }
+      int mask = _mm256_movemask_pd(ok);
+      for (int j = 0; j < 4; j++) {
+        hits[i + j] = mask >> j & 1;
+      }
+    }
+  }
+
+  CPU_TARGET("avx512f")
+  void hit_avx512(const Ray &r) {
+    double o[3] = {r.origin.a, r.origin.b, r.origin.c};
+    double d[3] = {r.direction.a, r.direction.b, r.direction.c};
+    for (int i = 0; i < size; i += 8) {
+      __m512d tMin = _mm512_setzero_pd(), tMax = _mm512_set1_pd(DBL_MAX);
+      __mmask8 ok = 0xff;
+      for (int k = 0; k < 3; k++) {
+        __m512d vo = _mm512_set1_pd(o[k]);
+        __m512d l = _mm512_loadu_pd(&lo[k][i]);
+        __m512d h = _mm512_loadu_pd(&hi[k][i]);
+        if (d[k] == 0) {
+          ok &= _mm512_cmp_pd_mask(vo, l, _CMP_GE_OQ) &
+                _mm512_cmp_pd_mask(vo, h, _CMP_LE_OQ);
+          continue;
+        }
+        __m512d vd = _mm512_set1_pd(d[k]);
+        __m512d t0 = _mm512_div_pd(_mm512_sub_pd(l, vo), vd);
+        __m512d t1 = _mm512_div_pd(_mm512_sub_pd(h, vo), vd);
+        tMin = _mm512_max_pd(tMin, _mm512_min_pd(t1, t0));
+        tMax = _mm512_min_pd(tMax, _mm512_max_pd(t0, t1));
+        ok &= _mm512_cmp_pd_mask(tMin, tMax, _CMP_LE_OQ);
+      }
+      for (int j = 0; j < 8; j++) {
+        hits[i + j] = ok >> j & 1;
+      }
+    }
+  }
+#endif
 };
 
 bool compare_triangle_a(const Triangle &t1, const Triangle &t2) {
@@ -219,8 +647,11 @@ bool compare_triangle_c(const Triangle &t1, const Triangle &t2) {
   return v1.c < v2.c;
 }
 
+// the split axes come from rand() unless random is given. rand() is shared
+// by every thread, builds running at once each need a generator of their own
 void build_box(const std::vector<Triangle>::iterator &start,
-               const std::vector<Triangle>::iterator &end, int num, Box *box) {
+               const std::vector<Triangle>::iterator &end, int num, Box *box,
+               std::minstd_rand *random = nullptr) {
   if (num < BOX_MAX_CHILD_NUM) {
     box->lChild = nullptr;
     box->rChild = nullptr;
@@ -230,7 +661,7 @@ void build_box(const std::vector<Triangle>::iterator &start,
       it++;
     }
   } else {
-    int axis = rand() % 3;
+    int axis = random == nullptr ? rand() % 3 : (*random)() % 3;
 
     switch (axis) {
     case 0:
@@ -249,8 +680,8 @@ void build_box(const std::vector<Triangle>::iterator &start,
     std::vector<Triangle>::iterator mid = start + newNum;
     Box *l = new Box(), *r = new Box();
 
-    build_box(start, mid, newNum, l);
-    build_box(mid, end, num - newNum, r);
+    build_box(start, mid, newNum, l, random);
+    build_box(mid, end, num - newNum, r, random);
     box->lChild = l;
     box->rChild = r;
     box->min = help_min(l->min, r->min);
@@ -258,4 +689,311 @@ void build_box(const std::vector<Triangle>::iterator &start,
   }
 }
 
+// a triangle or a rect of a tree holding both, while it is built
+class BoxItem {
+public:
+  Vec3 center;
+  Triangle *triangle;
+  Rect *rect;
+};
+
+void build_box(const std::vector<BoxItem>::iterator &start,
+               const std::vector<BoxItem>::iterator &end, int num, Box *box) {
+  if (num < BOX_MAX_CHILD_NUM) {
+    for (std::vector<BoxItem>::iterator it = start; it < end; it++) {
+      if (it->triangle != nullptr) {
+        box->combine(it->triangle);
+      } else {
+        box->combine(it->rect);
+      }
+    }
+    return;
+  }
+  int axis = rand() % 3;
+  sort(start, end, [axis](const BoxItem &x, const BoxItem &y) {
+    return axis == 0   ? x.center.a < y.center.a
+           : axis == 1 ? x.center.b < y.center.b
+                       : x.center.c < y.center.c;
+  });
+
+  int newNum = (num + 1) / 2;
+  Box *l = new Box(), *r = new Box();
+  build_box(start, start + newNum, newNum, l);
+  build_box(start + newNum, end, num - newNum, r);
+  box->lChild = l;
+  box->rChild = r;
+  box->min = help_min(l->min, r->min);
+  box->max = help_max(l->max, r->max);
+}
+
+// one tree over triangles and rects, split like the triangle only one.
+// neither vector is reordered
+void build_box(std::vector<Triangle> &triangles, std::vector<Rect> &rects,
+               Box *box) {
+  std::vector<BoxItem> items;
+  for (Triangle &t : triangles) {
+    BoxItem item = {(t.v0 + t.v1 + t.v2) / 3.0, &t, nullptr};
+    items.push_back(item);
+  }
+  for (Rect &q : rects) {
+    BoxItem item = {q.corner((q.min[0] + q.max[0]) / 2,
+                             (q.min[1] + q.max[1]) / 2),
+                    nullptr, &q};
+    items.push_back(item);
+  }
+  build_box(items.begin(), items.end(), items.size(), box);
+}
+
+// the root of a lazy tree, one leaf over every primitive with the bounds
+// of all. nodes are split by expand_box when a ray first reaches them, so
+// only the part of the scene rays go through is ever built
+void build_lazy_box(std::vector<Triangle> &triangles,
+                    std::vector<Rect> &rects, Box *box) {
+  for (Triangle &t : triangles) {
+    box->combine(&t);
+  }
+  for (Rect &q : rects) {
+    box->combine(&q);
+  }
+  box->lazy = box->primitive_num() >= BOX_MAX_CHILD_NUM;
+}
+
+#ifdef CPU_DISPATCH
+// bin_bounds with the three components of a bound in one register or two,
+// min and max pick the same operand as help_min and help_max
+CPU_TARGET("sse2")
+void bin_bounds_sse2(const double *lo, const double *hi, const int *bins,
+                     int n, double *binLo, double *binHi) {
+  for (int i = 0; i < n; i++) {
+    double *l = binLo + bins[i] * 4, *h = binHi + bins[i] * 4;
+    _mm_storeu_pd(l, _mm_min_pd(_mm_loadu_pd(l), _mm_loadu_pd(lo + i * 4)));
+    _mm_store_sd(l + 2, _mm_min_sd(_mm_load_sd(l + 2),
+                                   _mm_load_sd(lo + i * 4 + 2)));
+    _mm_storeu_pd(h, _mm_max_pd(_mm_loadu_pd(h), _mm_loadu_pd(hi + i * 4)));
+    _mm_store_sd(h + 2, _mm_max_sd(_mm_load_sd(h + 2),
+                                   _mm_load_sd(hi + i * 4 + 2)));
+  }
+}
+
+CPU_TARGET("avx2")
+void bin_bounds_avx2(const double *lo, const double *hi, const int *bins,
+                     int n, double *binLo, double *binHi) {
+  for (int i = 0; i < n; i++) {
+    double *l = binLo + bins[i] * 4, *h = binHi + bins[i] * 4;
+    _mm256_storeu_pd(l, _mm256_min_pd(_mm256_loadu_pd(l),
+                                      _mm256_loadu_pd(lo + i * 4)));
+    _mm256_storeu_pd(h, _mm256_max_pd(_mm256_loadu_pd(h),
+                                      _mm256_loadu_pd(hi + i * 4)));
+  }
+}
+#endif
+
+// grows the bounds of bin bins[i] by the bounds lo, hi of primitive i. a
+// bound is 4 doubles, the last one padding. avx512 hosts run the avx2
+// kernel, a bound fills only 4 lanes
+void bin_bounds(const double *lo, const double *hi, const int *bins, int n,
+                double *binLo, double *binHi) {
+#ifdef CPU_DISPATCH
+  CpuLevel level = cpu_level();
+  if (level >= CPU_AVX2) {
+    bin_bounds_avx2(lo, hi, bins, n, binLo, binHi);
+    return;
+  }
+  if (level == CPU_SSE2) {
+    bin_bounds_sse2(lo, hi, bins, n, binLo, binHi);
+    return;
+  }
+#endif
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < 3; k++) {
+      double &l = binLo[bins[i] * 4 + k], &h = binHi[bins[i] * 4 + k];
+      l = l < lo[i * 4 + k] ? l : lo[i * 4 + k];
+      h = h > hi[i * 4 + k] ? h : hi[i * 4 + k];
+    }
+  }
+}
+
+// the bin of each center along axis, BOX_BIN_NUM bins evenly over the
+// centers, and the split between bins of least sah cost. false when every
+// center is the same along axis or no split leaves primitives on both sides
+bool find_bin_split(const std::vector<BoxItem> &items, int axis,
+                    std::vector<int> &bins, int &split) {
+  int n = items.size();
+  double cMin = DBL_MAX, cMax = -DBL_MAX;
+  std::vector<double> centers(n), lo(n * 4), hi(n * 4);
+  for (int i = 0; i < n; i++) {
+    const BoxItem &item = items[i];
+    const Vec3 &c = item.center;
+    centers[i] = axis == 0 ? c.a : axis == 1 ? c.b : c.c;
+    cMin = std::min(cMin, centers[i]);
+    cMax = std::max(cMax, centers[i]);
+    Vec3 l, h;
+    if (item.triangle != nullptr) {
+      Triangle *t = item.triangle;
+      l = help_min(t->v0, t->v1, t->v2);
+      h = help_max(t->v0, t->v1, t->v2);
+    } else {
+      Rect *q = item.rect;
+      l = q->corner(q->min[0], q->min[1]);
+      h = q->corner(q->max[0], q->max[1]);
+    }
+    double bound[2][3] = {{l.a, l.b, l.c}, {h.a, h.b, h.c}};
+    for (int k = 0; k < 3; k++) {
+      lo[i * 4 + k] = bound[0][k];
+      hi[i * 4 + k] = bound[1][k];
+    }
+  }
+  if (!(cMax > cMin)) {
+    return false;
+  }
+  double scale = BOX_BIN_NUM / (cMax - cMin);
+  int binNum[BOX_BIN_NUM] = {};
+  bins.resize(n);
+  for (int i = 0; i < n; i++) {
+    bins[i] = std::min((int)((centers[i] - cMin) * scale), BOX_BIN_NUM - 1);
+    binNum[bins[i]]++;
+  }
+  std::vector<double> binLo(BOX_BIN_NUM * 4, DBL_MAX);
+  std::vector<double> binHi(BOX_BIN_NUM * 4, -DBL_MAX);
+  bin_bounds(&lo[0], &hi[0], &bins[0], n, &binLo[0], &binHi[0]);
+
+  // sah cost of each split, the area of the bins on either side times
+  // their primitives. empty bins add nothing
+  double cost[BOX_BIN_NUM] = {};
+  Box left, right;
+  int num = 0;
+  for (int i = 0; i < BOX_BIN_NUM - 1; i++) {
+    if (binNum[i] > 0) {
+      left.combine(Vec3(binLo[i * 4], binLo[i * 4 + 1], binLo[i * 4 + 2]));
+      left.combine(Vec3(binHi[i * 4], binHi[i * 4 + 1], binHi[i * 4 + 2]));
+      num += binNum[i];
+    }
+    cost[i + 1] = left.surface_area() * num;
+  }
+  num = 0;
+  split = 0;
+  for (int i = BOX_BIN_NUM - 1; i > 0; i--) {
+    if (binNum[i] > 0) {
+      right.combine(Vec3(binLo[i * 4], binLo[i * 4 + 1], binLo[i * 4 + 2]));
+      right.combine(Vec3(binHi[i * 4], binHi[i * 4 + 1], binHi[i * 4 + 2]));
+      num += binNum[i];
+    }
+    if (num == 0 || num == n) {
+      continue;
+    }
+    cost[i] += right.surface_area() * num;
+    if (split == 0 || cost[i] <= cost[split]) {
+      split = i;
+    }
+  }
+  return split > 0;
+}
+
+// splits a lazy box where the binned sah cost along the longest axis of the
+// centers is least, the children start lazy. boxes whose centers all sit in
+// one bin are halved at the median center. each split is linear in the
+// primitives below it
+void split_lazy_box(Box *box) {
+  std::vector<BoxItem> items;
+  for (Triangle *t : box->leaf) {
+    BoxItem item = {(t->v0 + t->v1 + t->v2) / 3.0, t, nullptr};
+    items.push_back(item);
+  }
+  for (Rect *q : box->rects) {
+    BoxItem item = {q->corner((q->min[0] + q->max[0]) / 2,
+                              (q->min[1] + q->max[1]) / 2),
+                    nullptr, q};
+    items.push_back(item);
+  }
+  Box centers;
+  for (BoxItem &item : items) {
+    centers.combine(item.center);
+  }
+  Vec3 d = centers.max - centers.min;
+  int axis = d.a >= d.b && d.a >= d.c ? 0 : d.b >= d.c ? 1 : 2;
+  std::vector<int> bins;
+  int split;
+  std::vector<int> sides(items.size());
+  if (find_bin_split(items, axis, bins, split)) {
+    for (int i = 0; i < (int)items.size(); i++) {
+      sides[i] = bins[i] >= split;
+    }
+  } else {
+    int newNum = (items.size() + 1) / 2;
+    std::nth_element(items.begin(), items.begin() + newNum, items.end(),
+                     [axis](const BoxItem &x, const BoxItem &y) {
+                       return axis == 0   ? x.center.a < y.center.a
+                              : axis == 1 ? x.center.b < y.center.b
+                                          : x.center.c < y.center.c;
+                     });
+    for (int i = 0; i < (int)items.size(); i++) {
+      sides[i] = i >= newNum;
+    }
+  }
+
+  Box *children[2] = {new Box(), new Box()};
+  for (int i = 0; i < (int)items.size(); i++) {
+    Box *child = children[sides[i]];
+    if (items[i].triangle != nullptr) {
+      child->combine(items[i].triangle);
+    } else {
+      child->combine(items[i].rect);
+    }
+  }
+  for (Box *child : children) {
+    child->lazy = child->primitive_num() >= BOX_MAX_CHILD_NUM;
+  }
+  std::vector<Triangle *>().swap(box->leaf);
+  std::vector<Rect *>().swap(box->rects);
+  box->lChild = children[0];
+  box->rChild = children[1];
+}
+
+// splits box if it is still lazy, once. threads reaching it meanwhile wait
+// for the split and then go on below it. traversals that skip this see a
+// lazy box as the leaf it is, right but slow, and must not run alongside
+// ones that expand
+inline void expand_box(Box *box) {
+  if (!box->lazy.load(std::memory_order_acquire)) {
+    return;
+  }
+  static std::mutex mutexes[BOX_LAZY_MUTEX_NUM];
+  std::lock_guard<std::mutex> lock(
+      mutexes[(size_t)box / sizeof(Box) % BOX_LAZY_MUTEX_NUM]);
+  if (box->lazy.load(std::memory_order_relaxed)) {
+    split_lazy_box(box);
+    box->lazy.store(false, std::memory_order_release);
+  }
+}
+
+// any hit with 0 < t < tMax, stops at the first one found. no sorting and
+// no nearest hit, shadow and occlusion rays only need a yes or no
+bool occluded(Box *box, Ray &r, double tMax) {
+  if (!box->hit(r, tMax)) {
+    return false;
+  }
+  expand_box(box);
+  if (!box->is_leaf()) {
+    return occluded(box->lChild, r, tMax) || occluded(box->rChild, r, tMax);
+  }
+  int size = box->leaf.size();
+  for (int i = 0; i < size; i += TRIANGLE_LANE_NUM) {
+    int num = std::min(size - i, TRIANGLE_LANE_NUM);
+    double ts[TRIANGLE_LANE_NUM];
+    int mask = hit_triangles(&box->leaf[i], num, r, ts);
+    for (int j = 0; j < num; j++) {
+      if (mask >> j & 1 && ts[j] < tMax) {
+        return true;
+      }
+    }
+  }
+  double t;
+  for (Rect *q : box->rects) {
+    if (q->interset(r, t) && t > 0 && t < tMax) {
+      return true;
+    }
+  }
+  return false;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,134 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "render.h"
+#include "sampler.h"
+#include "serialize.h"
+#include <list>
+#include <mutex>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#define CACHE_MEMORY_BUDGET (64 << 20)
+
+// 64 bit fnv-1a, stable across runs and machines of the same endianness
+unsigned long long hash_bytes(const std::vector<char> &data) {
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (char c : data) {
+    h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// everything that decides the bytes of an encoded image. the triangles are
+// stored after the transform, so the model matrix is part of them. the cpu
+// level is not, every level gives the same bits and a changed kernel bumps
+// RENDER_VERSION
+std::string render_key(Scene &scene, Camera &camera, Sampler &sampler,
+                       int spp, bool binary, bool denoised = false,
+                       const ResolveOptions &resolve = ResolveOptions()) {
+  ByteWriter writer;
+  writer.put(RENDER_VERSION);
+  write_scene(writer, scene);
+  write_camera(writer, camera);
+  writer.put((int)sampler.type).put(sampler.seed).put(sampler.strata());
+  writer.put(spp).put(binary);
+  writer.put(denoised);
+  writer.put(resolve.srgb).put((int)resolve.dither);
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", hash_bytes(writer.data));
+  return key;
+}
+
+// encoded images by key. a memory tier keeps the most recently used ones
+// within a byte budget, an optional directory keeps every image on disk.
+// safe to share between threads, and processes may share the directory
+class RenderCache {
+public:
+  long hitNum, diskHitNum, missNum, evictionNum;
+
+  RenderCache(size_t ibudget = CACHE_MEMORY_BUDGET,
+              const std::string &idirectory = std::string())
+      : hitNum(0), diskHitNum(0), missNum(0), evictionNum(0), budget(ibudget),
+        bytes(0), directory(idirectory) {
+    if (!directory.empty()) {
+      mkdir(directory.c_str(), 0755);
+    }
+  }
+
+  bool get(const std::string &key, std::vector<char> &data) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = index.find(key);
+      if (it != index.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        data = it->second->second;
+        hitNum++;
+        return true;
+      }
+    }
+    // the disk is read without the lock, other lookups go on meanwhile
+    if (!directory.empty() && read_file(path(key), data) && !data.empty()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      insert(key, data);
+      diskHitNum++;
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    missNum++;
+    return false;
+  }
+
+  void put(const std::string &key, const std::vector<char> &data) {
+    if (!directory.empty()) {
+      write_file(path(key), data);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    insert(key, data);
+  }
+
+  std::string stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return "cache hit " + std::to_string(hitNum) + " disk hit " +
+           std::to_string(diskHitNum) + " miss " + std::to_string(missNum) +
+           " eviction " + std::to_string(evictionNum) + " bytes " +
+           std::to_string(bytes) + "\n";
+  }
+
+private:
+  typedef std::pair<std::string, std::vector<char>> Entry;
+
+  size_t budget, bytes;
+  std::string directory;
+  std::mutex mutex;
+  std::list<Entry> entries; // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+  std::string path(const std::string &key) {
+    return directory + "/" + key + ".ppm";
+  }
+
+  // mutex held
+  void insert(const std::string &key, const std::vector<char> &data) {
+    auto it = index.find(key);
+    if (it != index.end()) {
+      bytes -= it->second->second.size();
+      entries.erase(it->second);
+      index.erase(it);
+    }
+    if (data.size() > budget) {
+      return;
+    }
+    entries.push_front(Entry(key, data));
+    index[key] = entries.begin();
+    bytes += data.size();
+    while (bytes > budget) {
+      bytes -= entries.back().second.size();
+      index.erase(entries.back().first);
+      entries.pop_back();
+      evictionNum++;
+    }
+  }
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "base.h"
+#include "cpu.h"
 #include "vec.h"
 
 Mat4x4 look_at(Vec3 &pos, Vec3 &look, Vec3 &up) {
@@ -31,4 +33,260 @@ Mat4x4 look_at(Vec3 &pos, Vec3 &look, Vec3 &up) {
   return inverse_mat(cameraToWorld);
 }
 
-#endif
\ No newline at end of file
+// rays of one batch share a tile, stored per component so the setup loop
+// runs over plain arrays
+#define RAY_BATCH_SIZE 64
+
+class RayBatch {
+public:
+  int size;
+  double originA[RAY_BATCH_SIZE], originB[RAY_BATCH_SIZE],
+      originC[RAY_BATCH_SIZE];
+  double directionA[RAY_BATCH_SIZE], directionB[RAY_BATCH_SIZE],
+      directionC[RAY_BATCH_SIZE];
+
+  RayBatch() : size(0) {}
+
+  Ray get_ray(int i) {
+    return Ray(Vec3(originA[i], originB[i], originC[i]),
+               Vec3(directionA[i], directionB[i], directionC[i]));
+  }
+};
+
+class Camera {
+public:
+  // image plane in world space, corner is the top left of pixel (0, 0),
+  // screen x follows the right axis of look_at, cross(up, dir)
+  Vec3 pos, corner, right, down;
+  int width, height;
+  Mat4x4 view, cameraToWorld;
+  // arguments of the constructor, enough to rebuild the camera elsewhere
+  Vec3 look, up;
+  double planeDistance, planeSize;
+
+  Camera(Vec3 ipos, Vec3 ilook, Vec3 iup, double iplaneDistance,
+         double iplaneSize, int iwidth, int iheight)
+      : pos(ipos), width(iwidth), height(iheight), look(ilook), up(iup),
+        planeDistance(iplaneDistance), planeSize(iplaneSize) {
+    view = look_at(ipos, ilook, iup);
+    cameraToWorld = inverse_mat(view);
+
+    double half = iplaneSize / 2;
+    Vec3 topLeft(-half, half, iplaneDistance);
+    Vec3 topRight(half, half, iplaneDistance);
+    Vec3 bottomLeft(-half, -half, iplaneDistance);
+    corner = cameraToWorld * topLeft;
+    right = cameraToWorld * topRight - corner;
+    down = cameraToWorld * bottomLeft - corner;
+
+    // per pixel steps, a ray is start + dx * x + dy * y
+    start = corner - pos;
+    dx = right / width;
+    dy = down / height;
+  }
+
+  // x, y in pixels, (0.5, 0.5) is the center of the top left pixel
+  Ray generate_ray(double x, double y) {
+    return Ray(pos, (start + dx * x + dy * y).normalize());
+  }
+
+  void generate_batch(const double *x, const double *y, int n,
+                      RayBatch &batch) {
+    batch.size = n;
+    int i = 0;
+#ifdef CPU_DISPATCH
+    CpuLevel level = cpu_level();
+    if (level == CPU_AVX512) {
+      i = generate_batch_avx512(x, y, n, batch);
+    } else if (level == CPU_AVX2) {
+      i = generate_batch_avx2(x, y, n, batch);
+    } else if (level == CPU_SSE2) {
+      i = generate_batch_sse2(x, y, n, batch);
+    }
+#endif
+    for (; i < n; i++) {
+      double a = start.a + dx.a * x[i] + dy.a * y[i];
+      double b = start.b + dx.b * x[i] + dy.b * y[i];
+      double c = start.c + dx.c * x[i] + dy.c * y[i];
+      double inv = 1 / sqrt(a * a + b * b + c * c);
+      batch.originA[i] = pos.a;
+      batch.originB[i] = pos.b;
+      batch.originC[i] = pos.c;
+      batch.directionA[i] = a * inv;
+      batch.directionB[i] = b * inv;
+      batch.directionC[i] = c * inv;
+    }
+  }
+
+  // inverse of generate_ray, false if p is behind the camera
+  bool project(const Vec3 &p, double &x, double &y) {
+    Vec3 n = cross(right, down);
+    double denom = dot(p - pos, n);
+    double s = dot(corner - pos, n);
+    if (denom == 0 || s / denom <= 0) {
+      return false;
+    }
+    Vec3 q = pos + (p - pos) * (s / denom) - corner;
+    x = dot(q, right) / dot(right, right) * width;
+    y = dot(q, down) / dot(down, down) * height;
+    return true;
+  }
+
+private:
+  Vec3 start, dx, dy;
+
+#ifdef CPU_DISPATCH
+  // the rays of generate_batch a register of lanes at a time, with the
+  // operations of the scalar loop in the same order. return how many rays
+  // are done, the scalar loop does the rest
+  CPU_TARGET("sse2")
+  int generate_batch_sse2(const double *x, const double *y, int n,
+                          RayBatch &batch) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+      __m128d vx = _mm_loadu_pd(x + i), vy = _mm_loadu_pd(y + i);
+      __m128d a = _mm_add_pd(
+          _mm_add_pd(_mm_set1_pd(start.a), _mm_mul_pd(_mm_set1_pd(dx.a), vx)),
+          _mm_mul_pd(_mm_set1_pd(dy.a), vy));
+      __m128d b = _mm_add_pd(
+          _mm_add_pd(_mm_set1_pd(start.b), _mm_mul_pd(_mm_set1_pd(dx.b), vx)),
+          _mm_mul_pd(_mm_set1_pd(dy.b), vy));
+      __m128d c = _mm_add_pd(
+          _mm_add_pd(_mm_set1_pd(start.c), _mm_mul_pd(_mm_set1_pd(dx.c), vx)),
+          _mm_mul_pd(_mm_set1_pd(dy.c), vy));
+      __m128d inv = _mm_div_pd(
+          _mm_set1_pd(1),
+          _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(a, a), _mm_mul_pd(b, b)),
+                                 _mm_mul_pd(c, c))));
+      _mm_storeu_pd(batch.originA + i, _mm_set1_pd(pos.a));
+      _mm_storeu_pd(batch.originB + i, _mm_set1_pd(pos.b));
+      _mm_storeu_pd(batch.originC + i, _mm_set1_pd(pos.c));
+      _mm_storeu_pd(batch.directionA + i, _mm_mul_pd(a, inv));
+      _mm_storeu_pd(batch.directionB + i, _mm_mul_pd(b, inv));
+      _mm_storeu_pd(batch.directionC + i, _mm_mul_pd(c, inv));
+    }
+    return i;
+  }
+
+  CPU_TARGET("avx2")
+  int generate_batch_avx2(const double *x, const double *y, int n,
+                          RayBatch &batch) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256d vx = _mm256_loadu_pd(x + i), vy = _mm256_loadu_pd(y + i);
+      __m256d a = _mm256_add_pd(
+          _mm256_add_pd(_mm256_set1_pd(start.a),
+                        _mm256_mul_pd(_mm256_set1_pd(dx.a), vx)),
+          _mm256_mul_pd(_mm256_set1_pd(dy.a), vy));
+      __m256d b = _mm256_add_pd(
+          _mm256_add_pd(_mm256_set1_pd(start.b),
+                        _mm256_mul_pd(_mm256_set1_pd(dx.b), vx)),
+          _mm256_mul_pd(_mm256_set1_pd(dy.b), vy));
+      __m256d c = _mm256_add_pd(
+          _mm256_add_pd(_mm256_set1_pd(start.c),
+                        _mm256_mul_pd(_mm256_set1_pd(dx.c), vx)),
+          _mm256_mul_pd(_mm256_set1_pd(dy.c), vy));
+      __m256d inv = _mm256_div_pd(
+          _mm256_set1_pd(1),
+          _mm256_sqrt_pd(_mm256_add_pd(
+              _mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b)),
+              _mm256_mul_pd(c, c))));
+      _mm256_storeu_pd(batch.originA + i, _mm256_set1_pd(pos.a));
+      _mm256_storeu_pd(batch.originB + i, _mm256_set1_pd(pos.b));
+      _mm256_storeu_pd(batch.originC + i, _mm256_set1_pd(pos.c));
+      _mm256_storeu_pd(batch.directionA + i, _mm256_mul_pd(a, inv));
+      _mm256_storeu_pd(batch.directionB + i, _mm256_mul_pd(b, inv));
+      _mm256_storeu_pd(batch.directionC + i, _mm256_mul_pd(c, inv));
+    }
+    return i;
+  }
+
+  CPU_TARGET("avx512f")
+  int generate_batch_avx512(const double *x, const double *y, int n,
+                            RayBatch &batch) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m512d vx = _mm512_loadu_pd(x + i), vy = _mm512_loadu_pd(y + i);
+      __m512d a = _mm512_add_pd(
+          _mm512_add_pd(_mm512_set1_pd(start.a),
+                        _mm512_mul_pd(_mm512_set1_pd(dx.a), vx)),
+          _mm512_mul_pd(_mm512_set1_pd(dy.a), vy));
+      __m512d b = _mm512_add_pd(
+          _mm512_add_pd(_mm512_set1_pd(start.b),
+                        _mm512_mul_pd(_mm512_set1_pd(dx.b), vx)),
+          _mm512_mul_pd(_mm512_set1_pd(dy.b), vy));
+      __m512d c = _mm512_add_pd(
+          _mm512_add_pd(_mm512_set1_pd(start.c),
+                        _mm512_mul_pd(_mm512_set1_pd(dx.c), vx)),
+          _mm512_mul_pd(_mm512_set1_pd(dy.c), vy));
+      __m512d inv = _mm512_div_pd(
+          _mm512_set1_pd(1),
+          _mm512_sqrt_pd(_mm512_add_pd(
+              _mm512_add_pd(_mm512_mul_pd(a, a), _mm512_mul_pd(b, b)),
+              _mm512_mul_pd(c, c))));
+      _mm512_storeu_pd(batch.originA + i, _mm512_set1_pd(pos.a));
+      _mm512_storeu_pd(batch.originB + i, _mm512_set1_pd(pos.b));
+      _mm512_storeu_pd(batch.originC + i, _mm512_set1_pd(pos.c));
+      _mm512_storeu_pd(batch.directionA + i, _mm512_mul_pd(a, inv));
+      _mm512_storeu_pd(batch.directionB + i, _mm512_mul_pd(b, inv));
+      _mm512_storeu_pd(batch.directionC + i, _mm512_mul_pd(c, inv));
+    }
+    return i;
+  }
+#endif
+};
+
+inline unsigned morton_part(unsigned v) {
+  // spread the low 16 bits to the even bits
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+inline unsigned morton_encode(unsigned x, unsigned y) {
+  return morton_part(x) | (morton_part(y) << 1);
+}
+
+bool morton_comp(const std::pair<unsigned, int> &a,
+                 const std::pair<unsigned, int> &b) {
+  return a.first < b.first;
+}
+
+// pixel indices tile by tile, both tiles and pixels inside a tile follow the
+// z-order curve so neighbor rays stay close on screen
+std::vector<int> tile_morton_order(int width, int height, int tileSize) {
+  int tileX = (width + tileSize - 1) / tileSize;
+  int tileY = (height + tileSize - 1) / tileSize;
+  std::vector<std::pair<unsigned, int>> tiles, pixels;
+  for (int i = 0; i < tileY; i++) {
+    for (int j = 0; j < tileX; j++) {
+      tiles.push_back(std::make_pair(morton_encode(j, i), i * tileX + j));
+    }
+  }
+  for (int i = 0; i < tileSize; i++) {
+    for (int j = 0; j < tileSize; j++) {
+      pixels.push_back(std::make_pair(morton_encode(j, i), i * tileSize + j));
+    }
+  }
+  sort(tiles.begin(), tiles.end(), morton_comp);
+  sort(pixels.begin(), pixels.end(), morton_comp);
+
+  std::vector<int> order;
+  for (std::pair<unsigned, int> &tile : tiles) {
+    int originX = tile.second % tileX * tileSize;
+    int originY = tile.second / tileX * tileSize;
+    for (std::pair<unsigned, int> &pixel : pixels) {
+      int x = originX + pixel.second % tileSize;
+      int y = originY + pixel.second / tileSize;
+      if (x < width && y < height) {
+        order.push_back(y * width + x);
+      }
+    }
+  }
+  return order;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <atomic>
+#include <cstdlib>
+#include <string>
+
+// a multiply and add must never be fused, not in the kernels (avx512f brings
+// fma) and not in the scalar code built with -march=native, or the levels
+// stop giving the same bits. builds pass -ffp-contract=off, which the target
+// attributes keep
+
+// kernels for newer instruction sets are compiled into every build with
+// target attributes and picked at run time, the rest of the code keeps the
+// flags of the build
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#endif
+
+// levels of the kernels, each runs on every host of the levels above it.
+// sse4.2 hosts run the sse2 kernels
+enum CpuLevel { CPU_SCALAR, CPU_SSE2, CPU_AVX2, CPU_AVX512 };
+
+const char *cpu_level_name(CpuLevel level) {
+  static const char *names[] = {"scalar", "sse2", "avx2", "avx512"};
+  return names[level];
+}
+
+CpuLevel get_cpu_level(const std::string &name) {
+  for (int i = CPU_AVX512; i > CPU_SCALAR; i--) {
+    if (name == cpu_level_name((CpuLevel)i)) {
+      return (CpuLevel)i;
+    }
+  }
+  return CPU_SCALAR;
+}
+
+// the best level of this host, by cpuid
+CpuLevel detect_cpu_level() {
+#ifdef CPU_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return CPU_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return CPU_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return CPU_SSE2;
+  }
+#endif
+  return CPU_SCALAR;
+}
+
+class CpuInfo {
+public:
+  static CpuInfo &get_instance() {
+    static CpuInfo info;
+    return info;
+  }
+
+  CpuLevel detected;
+  // the level kernels run at, never above detected. pool threads read it
+  // while set_level may write it
+  std::atomic<CpuLevel> level;
+
+  // forces a lower level, for tests and to compare kernels. a level the host
+  // lacks falls back to the detected one
+  void set_level(CpuLevel ilevel) {
+    level.store(ilevel < detected ? ilevel : detected,
+                std::memory_order_relaxed);
+  }
+
+private:
+  // MYAVATAR_CPU=scalar|sse2|avx2|avx512 forces a level from the start
+  CpuInfo() : detected(detect_cpu_level()), level(detected) {
+    const char *name = getenv("MYAVATAR_CPU");
+    if (name != nullptr) {
+      set_level(get_cpu_level(name));
+    }
+  }
+};
+
+inline CpuLevel cpu_level() {
+  return CpuInfo::get_instance().level.load(std::memory_order_relaxed);
+}
+
+#endif
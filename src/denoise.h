@@ -0,0 +1,356 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "parallel.h"
+#include "render.h"
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DENOISE_TILE_SIZE 32
+// gaussian width in pixels of the window the edge direction is found in
+#define DENOISE_TENSOR_SIGMA 2.0
+#define DENOISE_TENSOR_RADIUS 4
+// pixels filtered on each side along the edge, and their gaussian width
+#define DENOISE_TAP_NUM 2
+#define DENOISE_TAP_SIGMA 1.0
+// edge stopping scales of filter_pixel. color and coverage differences are
+// measured against the noise of both pixels, a pixel whose neighbours all
+// agree keeps its color
+#define DENOISE_SIGMA_COLOR 8.0
+#define DENOISE_SIGMA_COVERAGE 4.0
+#define DENOISE_SIGMA_NORMAL 0.2
+#define DENOISE_SIGMA_DEPTH 0.05 // of the depth of the center pixel
+
+// guides of the denoiser, the first surface of every sample averaged over
+// the pixel. depth, normal and primitive only count samples that hit
+// something, coverage is the share of inked layers
+class AuxBuffer {
+public:
+  int width, height;
+  std::vector<float> depth, normal; // normal has 3 per pixel
+  std::vector<float> coverage, coverageVariance; // of the pixel mean
+  std::vector<int> primitive; // of the first hit, -1 for background
+  std::vector<float> variance; // of the luminance of the pixel mean
+
+  AuxBuffer(int iwidth, int iheight)
+      : width(iwidth), height(iheight), depth(iwidth * iheight, 0),
+        normal(iwidth * iheight * 3, 0), coverage(iwidth * iheight, 0),
+        coverageVariance(iwidth * iheight, 0), primitive(iwidth * iheight, -1),
+        variance(iwidth * iheight, 0) {}
+};
+
+// same samples and same image as render, keeping the guides of every pixel
+// in aux
+void render_aux(Scene &scene, Camera &camera, Sampler &sampler,
+                Framebuffer &fb, AuxBuffer &aux, int spp = RENDER_SPP,
+                int first = 0) {
+  parallel_for(0, fb.height, [&](int y) {
+    RayBatch batch;
+    double bx[RAY_BATCH_SIZE], by[RAY_BATCH_SIZE];
+    for (int x = 0; x < fb.width; x++) {
+      int index = y * fb.width + x, hitNum = 0;
+      double depth = 0, luminance = 0, square = 0, ink = 0, inkSquare = 0;
+      Vec3 normal;
+      for (int k = first; k < first + spp; k += RAY_BATCH_SIZE) {
+        int n = std::min(RAY_BATCH_SIZE, first + spp - k);
+        for (int i = 0; i < n; i++) {
+          Vec3 jitter = sampler.get_2d(x, y, k + i, 0);
+          bx[i] = x + jitter.a;
+          by[i] = y + jitter.b;
+        }
+        camera.generate_batch(bx, by, n, batch);
+        for (int i = 0; i < n; i++) {
+          Ray r = batch.get_ray(i);
+          Surface surface;
+          Vec4 color = cal_color(scene, r, &surface);
+          fb.add(index, color);
+          double l = 0.2126 * color.a + 0.7152 * color.b + 0.0722 * color.c;
+          luminance += l;
+          square += l * l;
+          if (surface.primitive < 0) {
+            continue;
+          }
+          if (hitNum == 0) {
+            aux.primitive[index] = surface.primitive;
+          }
+          Vec3 n = scene.primitive_normal(surface.primitive);
+          n.normalize();
+          normal = normal + (dot(n, r.direction) > 0 ? n * -1 : n);
+          depth += surface.t;
+          double share = (double)__builtin_popcount(surface.layerKey) /
+                         surface.layerNum;
+          ink += share;
+          inkSquare += share * share;
+          hitNum++;
+        }
+      }
+      fb.sampleNum[index] += spp;
+      if (hitNum > 0) {
+        aux.depth[index] = depth / hitNum;
+        aux.normal[index * 3] = normal.a / hitNum;
+        aux.normal[index * 3 + 1] = normal.b / hitNum;
+        aux.normal[index * 3 + 2] = normal.c / hitNum;
+      }
+      luminance /= spp;
+      aux.variance[index] = std::max(square / spp - luminance * luminance,
+                                     0.0) / spp;
+      ink /= spp;
+      aux.coverage[index] = ink;
+      aux.coverageVariance[index] =
+          std::max(inkSquare / spp - ink * ink, 0.0) / spp;
+    }
+  });
+}
+
+// color channel k of pixel (x, y), clamped to the image
+inline float denoise_at(const std::vector<float> &color, int width, int height,
+                        int x, int y, int k) {
+  x = std::min(std::max(x, 0), width - 1);
+  y = std::min(std::max(y, 0), height - 1);
+  return color[(y * width + x) * 4 + k];
+}
+
+// rgba at (x, y) between pixel centers, the rgb distance to center is put
+// in distance
+inline void denoise_bilinear(const std::vector<float> &color, int width,
+                             int height, float x, float y, const float *center,
+                             float *v, float &distance) {
+  int x0 = (int)floorf(x), y0 = (int)floorf(y);
+  int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+  float tx = x - x0, ty = y - y0;
+  const float *p[4] = {
+      &color[(y0 * width + x0) * 4], &color[(y0 * width + x1) * 4],
+      &color[(y1 * width + x0) * 4], &color[(y1 * width + x1) * 4]};
+#ifdef __SSE2__
+  __m128 ux = _mm_set1_ps(tx), uy = _mm_set1_ps(ty);
+  __m128 top = _mm_loadu_ps(p[0]), bottom = _mm_loadu_ps(p[2]);
+  top = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(p[1]), top), ux));
+  bottom = _mm_add_ps(
+      bottom, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(p[3]), bottom), ux));
+  __m128 c = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), uy));
+  _mm_storeu_ps(v, c);
+  __m128 d = _mm_sub_ps(c, _mm_loadu_ps(center));
+  d = _mm_mul_ps(d, d);
+  d = _mm_add_ss(_mm_add_ss(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 1, 1, 1))),
+                 _mm_movehl_ps(d, d));
+  distance = _mm_cvtss_f32(d);
+#else
+  distance = 0;
+  for (int k = 0; k < 4; k++) {
+    float top = p[0][k] + (p[1][k] - p[0][k]) * tx;
+    float bottom = p[2][k] + (p[3][k] - p[2][k]) * tx;
+    v[k] = top + (bottom - top) * ty;
+    distance += k < 3 ? (v[k] - center[k]) * (v[k] - center[k]) : 0;
+  }
+#endif
+}
+
+// the structure tensor of every pixel, gradients of r, g and b summed and
+// smoothed by a separable gaussian. 3 floats per pixel, xx, xy and yy
+std::vector<float> structure_tensor(const std::vector<float> &color, int width,
+                                    int height) {
+  std::vector<float> gradient(width * height * 3), temp(width * height * 3);
+  parallel_for(0, height, [&](int y) {
+    for (int x = 0; x < width; x++) {
+      float *g = &gradient[(y * width + x) * 3];
+      g[0] = g[1] = g[2] = 0;
+      for (int k = 0; k < 3; k++) {
+        float gx = (denoise_at(color, width, height, x + 1, y, k) -
+                    denoise_at(color, width, height, x - 1, y, k)) /
+                   2;
+        float gy = (denoise_at(color, width, height, x, y + 1, k) -
+                    denoise_at(color, width, height, x, y - 1, k)) /
+                   2;
+        g[0] += gx * gx;
+        g[1] += gx * gy;
+        g[2] += gy * gy;
+      }
+    }
+  });
+  float kernel[DENOISE_TENSOR_RADIUS * 2 + 1];
+  for (int i = -DENOISE_TENSOR_RADIUS; i <= DENOISE_TENSOR_RADIUS; i++) {
+    kernel[i + DENOISE_TENSOR_RADIUS] =
+        exp(-i * i / (2 * DENOISE_TENSOR_SIGMA * DENOISE_TENSOR_SIGMA));
+  }
+  // rows into temp, then columns back, pixels outside do not count
+  for (int pass = 0; pass < 2; pass++) {
+    const std::vector<float> &in = pass == 0 ? gradient : temp;
+    std::vector<float> &out = pass == 0 ? temp : gradient;
+    parallel_for(0, height, [&](int y) {
+      for (int x = 0; x < width; x++) {
+        float sum[3] = {0, 0, 0}, total = 0;
+        for (int i = -DENOISE_TENSOR_RADIUS; i <= DENOISE_TENSOR_RADIUS; i++) {
+          int qx = pass == 0 ? x + i : x, qy = pass == 0 ? y : y + i;
+          if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+            continue;
+          }
+          float w = kernel[i + DENOISE_TENSOR_RADIUS];
+          for (int k = 0; k < 3; k++) {
+            sum[k] += in[(qy * width + qx) * 3 + k] * w;
+          }
+          total += w;
+        }
+        for (int k = 0; k < 3; k++) {
+          out[(y * width + x) * 3 + k] = sum[k] / total;
+        }
+      }
+    });
+  }
+  return gradient;
+}
+
+// one pixel of the filter. the taps lie on the line through the center
+// along the edge, where the true color is about the same, and are read
+// bilinearly, which is exact across an edge blurred linearly by the pixel.
+// coherence fades the taps out where there is no single edge direction
+void filter_pixel(AuxBuffer &aux, const std::vector<float> &color,
+                  const float *tensor, const float *variance, float *out,
+                  int x, int y) {
+  int width = aux.width, height = aux.height, p = y * width + x;
+  float a = tensor[0], b = tensor[1], d = tensor[2];
+  float mean = (a + d) / 2;
+  float spread = sqrtf(std::max(mean * mean - (a * d - b * b), 0.0f));
+  float large = mean + spread, small = mean - spread;
+  // eigenvector of the small eigenvalue, along the edge
+  float ex = 0, ey = 0;
+  if (fabsf(b) > 1e-12f) {
+    ex = small - d;
+    ey = b;
+  } else {
+    ex = a < d ? 1 : 0;
+    ey = a < d ? 0 : 1;
+  }
+  float length = sqrtf(ex * ex + ey * ey);
+  if (large < 1e-8f || length == 0) {
+    memcpy(out, &color[p * 4], 4 * sizeof(float));
+    return;
+  }
+  ex /= length;
+  ey /= length;
+  float coherence = (large - small) / (large + small);
+
+  const float *np = &aux.normal[p * 3];
+  float depthScale = DENOISE_SIGMA_DEPTH * std::max(aux.depth[p], 1e-3f);
+  float sum[4] = {0, 0, 0, 0}, total = 0;
+  for (int k = -DENOISE_TAP_NUM; k <= DENOISE_TAP_NUM; k++) {
+    float fx = x + k * ex, fy = y + k * ey;
+    if (fx < 0 || fy < 0 || fx > width - 1 || fy > height - 1) {
+      continue;
+    }
+    // the guides of the nearest pixel, taps stay on the primitive of the
+    // center or on the background
+    int q = (int)lroundf(fy) * width + (int)lroundf(fx);
+    if (aux.primitive[p] != aux.primitive[q]) {
+      continue;
+    }
+    float v[4], dc;
+    denoise_bilinear(color, width, height, fx, fy, &color[p * 4], v, dc);
+    const float *nq = &aux.normal[q * 3];
+    float dn = (np[0] - nq[0]) * (np[0] - nq[0]) +
+               (np[1] - nq[1]) * (np[1] - nq[1]) +
+               (np[2] - nq[2]) * (np[2] - nq[2]);
+    float dz = fabsf(aux.depth[p] - aux.depth[q]) / depthScale;
+    float di = aux.coverage[p] - aux.coverage[q];
+    float e = dc / (DENOISE_SIGMA_COLOR * (variance[p] + variance[q]) +
+                    1e-6f) +
+              di * di / (DENOISE_SIGMA_COVERAGE * (aux.coverageVariance[p] +
+                                                   aux.coverageVariance[q]) +
+                         1e-6f) +
+              dn / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL) + dz +
+              k * k / (2 * DENOISE_TAP_SIGMA * DENOISE_TAP_SIGMA);
+    float w = expf(-e) * (k == 0 ? 1 : coherence);
+    for (int c = 0; c < 4; c++) {
+      sum[c] += v[c] * w;
+    }
+    total += w;
+  }
+  // the center always counts, total is never 0
+  for (int c = 0; c < 4; c++) {
+    out[c] = sum[c] / total;
+  }
+}
+
+// averages every pixel with its neighbours along the edge through it. at
+// low spp the noise of this renderer is the coverage of glyph and face
+// edges, which blurring across the edge only trades for bias. the edge
+// direction comes from the structure tensor, the taps stop at another
+// primitive, at normal and depth changes and at colors and coverage far
+// from the noise of both pixels. the luminance variance is smoothed over
+// 3x3 first. tiles run on the thread pool, fb ends with one sample per
+// pixel
+void denoise(Framebuffer &fb, AuxBuffer &aux) {
+  int width = fb.width, height = fb.height;
+  std::vector<float> color(width * height * 4), out(width * height * 4);
+  for (int i = 0; i < width * height; i++) {
+    Vec4 c = fb.get_color(i);
+    float *p = &color[i * 4];
+    p[0] = c.a;
+    p[1] = c.b;
+    p[2] = c.c;
+    p[3] = c.d;
+  }
+  std::vector<float> tensor = structure_tensor(color, width, height);
+  std::vector<float> variance(width * height);
+  parallel_for(0, height, [&](int y) {
+    for (int x = 0; x < width; x++) {
+      float sum = 0, total = 0;
+      for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+          int qx = x + i, qy = y + j;
+          if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+            continue;
+          }
+          float w = (i == 0 ? 1 : 0.5f) * (j == 0 ? 1 : 0.5f);
+          sum += aux.variance[qy * width + qx] * w;
+          total += w;
+        }
+      }
+      variance[y * width + x] = sum / total;
+    }
+  });
+
+  int tileX = (width + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+  int tileY = (height + DENOISE_TILE_SIZE - 1) / DENOISE_TILE_SIZE;
+  parallel_for(0, tileX * tileY, [&](int tile) {
+    int x0 = tile % tileX * DENOISE_TILE_SIZE;
+    int y0 = tile / tileX * DENOISE_TILE_SIZE;
+    for (int y = y0; y < std::min(y0 + DENOISE_TILE_SIZE, height); y++) {
+      for (int x = x0; x < std::min(x0 + DENOISE_TILE_SIZE, width); x++) {
+        int p = y * width + x;
+        filter_pixel(aux, color, &tensor[p * 3], &variance[0], &out[p * 4],
+                     x, y);
+      }
+    }
+  });
+
+  for (int i = 0; i < width * height; i++) {
+    float *p = &out[i * 4];
+    fb.set(i, Vec4(p[0], p[1], p[2], p[3]), 1);
+  }
+}
+
+// mean squared error of the rgb of a against b, colors clamped to [0, 1]
+// like the written image
+double squared_error(Framebuffer &a, Framebuffer &b) {
+  double error = 0;
+  for (int i = 0; i < a.width * a.height; i++) {
+    Vec4 x = a.get_color(i), y = b.get_color(i);
+    double u[3] = {x.a, x.b, x.c}, v[3] = {y.a, y.b, y.c};
+    for (int k = 0; k < 3; k++) {
+      double d = std::min(std::max(u[k], 0.0), 1.0) -
+                 std::min(std::max(v[k], 0.0), 1.0);
+      error += d * d;
+    }
+  }
+  return error / (a.width * a.height * 3);
+}
+
+// peak signal to noise ratio of a against b in db
+double psnr(Framebuffer &a, Framebuffer &b) {
+  double error = squared_error(a, b);
+  return error == 0 ? 99 : 10 * log10(1 / error);
+}
+
+#endif
@@ -0,0 +1,359 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "render.h"
+#include "sampler.h"
+#include "serialize.h"
+#include "socket.h"
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <poll.h>
+#include <sys/wait.h>
+
+#define DISTRIBUTED_TILE_SIZE 64
+// jobs sent ahead to each worker, hides the round trip
+#define DISTRIBUTED_JOBS_IN_FLIGHT 2
+// seconds without any worker before the coordinator renders by itself
+#define DISTRIBUTED_IDLE_TIMEOUT 10
+// seconds a worker with jobs in flight may go without sending a result
+// before it counts as hung and is dropped
+#define DISTRIBUTED_JOB_TIMEOUT 30
+
+enum MessageType {
+  MESSAGE_SETUP = 1,
+  MESSAGE_JOB,
+  MESSAGE_RESULT,
+  MESSAGE_EXIT
+};
+
+// one tile of one image
+class DistributedJob {
+public:
+  int id, image;
+  char glyph;
+  int x, y, width, height;
+};
+
+// scene and camera in one file, workers load it once on start
+bool write_scene_cache(const std::string &path, Scene &scene,
+                       Camera &camera) {
+  ByteWriter writer;
+  write_scene(writer, scene);
+  write_camera(writer, camera);
+  return write_file(path, writer.data);
+}
+
+// worker side, connects to the coordinator and renders jobs until told to
+// exit or the connection drops
+int run_worker(const std::string &address, const std::string &cachePath) {
+  std::vector<char> data;
+  if (!read_file(cachePath, data)) {
+    std::cout << "fail to read " << cachePath << std::endl;
+    return 1;
+  }
+  Scene scene;
+  ByteReader reader(data);
+  read_scene(reader, scene);
+  Camera camera = read_camera(reader);
+  if (!reader.ok) {
+    std::cout << "broken scene cache " << cachePath << std::endl;
+    return 1;
+  }
+  scene.build();
+
+  int fd = connect_socket(address);
+  if (fd < 0) {
+    std::cout << "fail to connect " << address << std::endl;
+    return 1;
+  }
+
+  Sampler *sampler = nullptr;
+  int spp = 0, first = 0;
+  int type;
+  std::vector<char> payload;
+  while (read_message(fd, type, payload)) {
+    ByteReader message(payload);
+    if (type == MESSAGE_SETUP) {
+      SamplerType samplerType = (SamplerType)message.get<int>();
+      unsigned seed = message.get<unsigned>();
+      spp = message.get<int>();
+      first = message.get<int>();
+      delete sampler;
+      sampler = create_sampler(samplerType, seed, spp);
+    } else if (type == MESSAGE_JOB && sampler != nullptr) {
+      DistributedJob job = message.get<DistributedJob>();
+      scene.glyph = job.glyph;
+      Framebuffer fb(job.width, job.height);
+      render_region(scene, camera, *sampler, fb, job.x, job.y, spp, first);
+
+      ByteWriter result;
+      result.put(job.id);
+      result.put(&fb.sum[0], fb.sum.size() * sizeof(float));
+      result.put(&fb.sampleNum[0], fb.sampleNum.size() * sizeof(int));
+      if (!write_message(fd, MESSAGE_RESULT, result.data)) {
+        break;
+      }
+    } else {
+      break;
+    }
+  }
+  close(fd);
+  delete sampler;
+  return 0;
+}
+
+// a connected worker, its jobs in flight and when the next result is due
+class DistributedWorker {
+public:
+  std::vector<DistributedJob> jobs;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+// splits images into tile jobs and hands them to whichever workers are
+// connected, jobs of a worker that disconnects or misses its deadline go
+// back to the queue
+class Coordinator {
+public:
+  int workerDeathNum, lateWorkerNum, localJobNum;
+
+  Coordinator(const std::string &iaddress,
+              double ijobTimeout = DISTRIBUTED_JOB_TIMEOUT)
+      : workerDeathNum(0), lateWorkerNum(0), localJobNum(0),
+        address(iaddress), listenFd(listen_socket(iaddress)),
+        jobTimeout(ijobTimeout) {}
+
+  ~Coordinator() {
+    if (listenFd >= 0) {
+      close(listenFd);
+    }
+    if (address.compare(0, 5, "unix:") == 0) {
+      unlink(address.substr(5).c_str());
+    }
+    // every job is done, a child still running was dropped as hung
+    for (pid_t pid : children) {
+      if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+      }
+    }
+  }
+
+  bool ok() { return listenFd >= 0; }
+
+  // forked after the socket listens, so workers can connect right away
+  void start_local_workers(int n, const std::string &cachePath) {
+    for (int i = 0; i < n; i++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(listenFd);
+        _exit(run_worker(address, cachePath));
+      }
+      if (pid > 0) {
+        children.push_back(pid);
+      }
+    }
+  }
+
+  // images[i] shows glyphs[i], scene and camera are used to render the jobs
+  // left when no worker is around
+  void render(Scene &scene, Camera &camera, Sampler &sampler, int spp,
+              int first, std::vector<char> &glyphs,
+              std::vector<Framebuffer *> &images) {
+    std::deque<DistributedJob> pending;
+    for (int i = 0; i < (int)images.size(); i++) {
+      for (int y = 0; y < images[i]->height; y += DISTRIBUTED_TILE_SIZE) {
+        for (int x = 0; x < images[i]->width; x += DISTRIBUTED_TILE_SIZE) {
+          DistributedJob job;
+          job.id = pending.size();
+          job.image = i;
+          job.glyph = glyphs[i];
+          job.x = x;
+          job.y = y;
+          job.width = std::min(DISTRIBUTED_TILE_SIZE, images[i]->width - x);
+          job.height = std::min(DISTRIBUTED_TILE_SIZE, images[i]->height - y);
+          pending.push_back(job);
+        }
+      }
+    }
+
+    ByteWriter setup;
+    setup.put((int)sampler.type).put(sampler.seed).put(spp).put(first);
+
+    int jobNum = pending.size(), doneNum = 0;
+    time_t idleSince = time(NULL);
+    while (doneNum < jobNum) {
+      if (workers.empty() &&
+          (time(NULL) - idleSince >= DISTRIBUTED_IDLE_TIMEOUT ||
+           (!children.empty() && live_children() == 0))) {
+        // nobody left to help
+        while (!pending.empty()) {
+          DistributedJob job = pending.front();
+          pending.pop_front();
+          scene.glyph = job.glyph;
+          Framebuffer fb(job.width, job.height);
+          render_region(scene, camera, sampler, fb, job.x, job.y, spp, first);
+          merge(job, fb.sum.data(), fb.sampleNum.data(), images);
+          localJobNum++;
+          doneNum++;
+        }
+        break;
+      }
+
+      std::vector<pollfd> fds(1);
+      fds[0].fd = listenFd;
+      fds[0].events = POLLIN;
+      for (auto &worker : workers) {
+        pollfd p;
+        p.fd = worker.first;
+        p.events = POLLIN;
+        fds.push_back(p);
+      }
+      if (poll(&fds[0], fds.size(), 1000) < 0) {
+        continue;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd >= 0) {
+          workers[fd] = DistributedWorker();
+          if (!write_message(fd, MESSAGE_SETUP, setup.data)) {
+            drop(fd, pending);
+          }
+        }
+      }
+
+      for (int i = 1; i < (int)fds.size(); i++) {
+        if (fds[i].revents == 0) {
+          continue;
+        }
+        int fd = fds[i].fd;
+        int type;
+        std::vector<char> payload;
+        if (!read_message(fd, type, payload) || type != MESSAGE_RESULT ||
+            !receive(fd, payload, images)) {
+          drop(fd, pending);
+          continue;
+        }
+        doneNum++;
+      }
+
+      // a hung worker still holds its connection, only its deadline tells
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = workers.begin(); it != workers.end();) {
+        int fd = it->first;
+        bool late = !it->second.jobs.empty() && now > it->second.deadline;
+        ++it;
+        if (late) {
+          lateWorkerNum++;
+          drop(fd, pending);
+        }
+      }
+
+      // keep every worker busy
+      for (auto it = workers.begin(); it != workers.end();) {
+        int fd = it->first;
+        bool ok = true;
+        while (ok && it->second.jobs.size() < DISTRIBUTED_JOBS_IN_FLIGHT &&
+               !pending.empty()) {
+          DistributedJob job = pending.front();
+          pending.pop_front();
+          if (it->second.jobs.empty()) {
+            it->second.deadline = now + timeout();
+          }
+          it->second.jobs.push_back(job);
+          ByteWriter message;
+          message.put(job);
+          ok = write_message(fd, MESSAGE_JOB, message.data);
+        }
+        ++it;
+        if (!ok) {
+          drop(fd, pending);
+        }
+      }
+      if (!workers.empty()) {
+        idleSince = time(NULL);
+      }
+    }
+
+    for (auto &worker : workers) {
+      write_message(worker.first, MESSAGE_EXIT, std::vector<char>());
+      close(worker.first);
+    }
+    workers.clear();
+  }
+
+private:
+  std::string address;
+  int listenFd;
+  double jobTimeout;
+  std::vector<pid_t> children;
+  std::map<int, DistributedWorker> workers;
+
+  std::chrono::steady_clock::duration timeout() {
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(jobTimeout));
+  }
+
+  int live_children() {
+    int n = 0;
+    for (pid_t &pid : children) {
+      if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) {
+        pid = -pid; // reaped, keep the slot
+      }
+      n += pid > 0;
+    }
+    return n;
+  }
+
+  void drop(int fd, std::deque<DistributedJob> &pending) {
+    std::vector<DistributedJob> &jobs = workers[fd].jobs;
+    for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
+      pending.push_front(*it);
+    }
+    close(fd);
+    workers.erase(fd);
+    workerDeathNum++;
+  }
+
+  bool receive(int fd, std::vector<char> &payload,
+               std::vector<Framebuffer *> &images) {
+    ByteReader reader(payload);
+    int id = reader.get<int>();
+    DistributedWorker &worker = workers[fd];
+    std::vector<DistributedJob> &jobs = worker.jobs;
+    for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+      if (it->id != id) {
+        continue;
+      }
+      int pixelNum = it->width * it->height;
+      if (payload.size() !=
+          sizeof(int) + pixelNum * (4 * sizeof(float) + sizeof(int))) {
+        return false;
+      }
+      const float *sum = (const float *)&payload[sizeof(int)];
+      const int *sampleNum = (const int *)(sum + pixelNum * 4);
+      merge(*it, sum, sampleNum, images);
+      jobs.erase(it);
+      worker.deadline = std::chrono::steady_clock::now() + timeout();
+      return true;
+    }
+    return false;
+  }
+
+  void merge(DistributedJob &job, const float *sum, const int *sampleNum,
+             std::vector<Framebuffer *> &images) {
+    Framebuffer &image = *images[job.image];
+    for (int j = 0; j < job.height; j++) {
+      int index = (job.y + j) * image.width + job.x;
+      memcpy(&image.sum[index * 4], sum + j * job.width * 4,
+             job.width * 4 * sizeof(float));
+      memcpy(&image.sampleNum[index], sampleNum + j * job.width,
+             job.width * sizeof(int));
+    }
+  }
+};
+
+#endif
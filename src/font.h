@@ -13,7 +13,7 @@ public:
     return fonts;
   }
 
-  Font &get_font(char c) { return *fonts[c]; }
+  Font &get_font(char c) { return *fonts[(unsigned char)c]; }
 
 private:
   Font *fonts[256];
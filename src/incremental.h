@@ -0,0 +1,232 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "parallel.h"
+#include "render.h"
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <vector>
+
+// projected bounds are widened by this many pixels, samples on the border
+// of a primitive are still inside
+#define INCREMENTAL_SLACK 1e-3
+
+// renders one view of a scene again and again, only the tiles whose pixels
+// may see a changed primitive get new samples, the rest of the framebuffer
+// is kept. samples only depend on the pixel, so a kept tile has the sums a
+// full render would give and updates show no seams
+class IncrementalRenderer {
+public:
+  int spp;
+  long renderedTileNum, reusedTileNum;
+
+  IncrementalRenderer(Scene &iscene, Sampler &isampler, int ispp = RENDER_SPP)
+      : spp(ispp), renderedTileNum(0), reusedTileNum(0), scene(iscene),
+        sampler(isampler), last(nullptr), triangles(), rects(), glyph(0),
+        palette(), shading(), tileX(0), tileY(0), dirty() {}
+
+  ~IncrementalRenderer() { delete last; }
+
+  // fb must hold the image of the last call. the scene must be built for
+  // its current primitives, a refit is enough. changes of the camera, size,
+  // palette or shading, or of the primitive count, render everything
+  void render(Camera &camera, Framebuffer &fb) {
+    tileX = (fb.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    tileY = (fb.height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    std::vector<Triangle> nowTriangles = scene.triangles;
+    std::vector<Rect> nowRects = scene.rects;
+    std::sort(nowTriangles.begin(), nowTriangles.end(), less_triangle);
+    std::sort(nowRects.begin(), nowRects.end(), less_rect);
+    if (!mark_changes(camera, fb, nowTriangles, nowRects)) {
+      dirty.assign(tileX * tileY, true);
+    }
+
+    std::vector<int> tiles;
+    for (int i = 0; i < tileX * tileY; i++) {
+      if (dirty[i]) {
+        tiles.push_back(i);
+      }
+    }
+    renderedTileNum += tiles.size();
+    reusedTileNum += tileX * tileY - tiles.size();
+
+    parallel_for(0, tiles.size(), [&](int i) {
+      int pixels[RENDER_TILE_SIZE * RENDER_TILE_SIZE], n = 0;
+      int x0 = tiles[i] % tileX * RENDER_TILE_SIZE;
+      int y0 = tiles[i] / tileX * RENDER_TILE_SIZE;
+      for (int y = y0; y < std::min(y0 + RENDER_TILE_SIZE, fb.height); y++) {
+        for (int x = x0; x < std::min(x0 + RENDER_TILE_SIZE, fb.width); x++) {
+          pixels[n] = y * fb.width + x;
+          fb.set(pixels[n++], Vec4(), 0);
+        }
+      }
+      render_batch(scene, camera, sampler, fb, pixels, n, 0, 0, spp, 0);
+    });
+
+    delete last;
+    last = new Camera(camera);
+    triangles.swap(nowTriangles);
+    rects.swap(nowRects);
+    glyph = scene.glyph;
+    palette = scene.palette;
+    shading = scene.shading;
+  }
+
+private:
+  Scene &scene;
+  Sampler &sampler;
+  // what the framebuffer shows, primitives sorted
+  Camera *last;
+  std::vector<Triangle> triangles;
+  std::vector<Rect> rects;
+  char glyph;
+  Palette palette;
+  Shading shading;
+  int tileX, tileY;
+  std::vector<bool> dirty;
+
+  static bool same(const Vec3 &a, const Vec3 &b) {
+    return a.a == b.a && a.b == b.b && a.c == b.c;
+  }
+
+  static bool same(const Vec4 &a, const Vec4 &b) {
+    return a.a == b.a && a.b == b.b && a.c == b.c && a.d == b.d;
+  }
+
+  // lexicographic over every field, any order that puts equal primitives
+  // next to each other
+  static bool less(const Vec3 &a, const Vec3 &b) {
+    return a.a != b.a ? a.a < b.a : a.b != b.b ? a.b < b.b : a.c < b.c;
+  }
+
+  static bool less_triangle(const Triangle &a, const Triangle &b) {
+    const Vec3 *p[6] = {&a.v0, &a.v1, &a.v2, &a.t_v0, &a.t_v1, &a.t_v2};
+    const Vec3 *q[6] = {&b.v0, &b.v1, &b.v2, &b.t_v0, &b.t_v1, &b.t_v2};
+    for (int i = 0; i < 6; i++) {
+      if (!same(*p[i], *q[i])) {
+        return less(*p[i], *q[i]);
+      }
+    }
+    return false;
+  }
+
+  static bool less_rect(const Rect &a, const Rect &b) {
+    double p[6] = {(double)a.axis, a.plane, a.min[0], a.min[1], a.max[0],
+                   a.max[1]};
+    double q[6] = {(double)b.axis, b.plane, b.min[0], b.min[1], b.max[0],
+                   b.max[1]};
+    for (int i = 0; i < 6; i++) {
+      if (p[i] != q[i]) {
+        return p[i] < q[i];
+      }
+    }
+    return !same(a.t_min, b.t_min) ? less(a.t_min, b.t_min)
+                                   : less(a.t_max, b.t_max);
+  }
+
+  bool same_view(Camera &camera, Framebuffer &fb) {
+    return last != nullptr && fb.width == camera.width &&
+           fb.height == camera.height && same(camera.pos, last->pos) &&
+           same(camera.corner, last->corner) &&
+           same(camera.right, last->right) && same(camera.down, last->down) &&
+           camera.width == last->width && camera.height == last->height &&
+           same(scene.palette.background, palette.background) &&
+           same(scene.palette.ink, palette.ink) &&
+           same(scene.palette.paper, palette.paper) &&
+           !scene.shading.enabled() && !shading.enabled();
+  }
+
+  // the tiles the projection of points may cover, false when a point is not
+  // in front of the camera
+  bool mark(Camera &camera, const Vec3 *points, int n) {
+    double xMin = DBL_MAX, yMin = DBL_MAX, xMax = -DBL_MAX, yMax = -DBL_MAX;
+    for (int i = 0; i < n; i++) {
+      double x, y;
+      if (!camera.project(points[i], x, y)) {
+        return false;
+      }
+      xMin = std::min(xMin, x);
+      yMin = std::min(yMin, y);
+      xMax = std::max(xMax, x);
+      yMax = std::max(yMax, y);
+    }
+    // pixel x takes samples from [x, x + 1)
+    int x0 = std::max((int)floor(xMin - INCREMENTAL_SLACK), 0);
+    int y0 = std::max((int)floor(yMin - INCREMENTAL_SLACK), 0);
+    int x1 = std::min((int)floor(xMax + INCREMENTAL_SLACK), camera.width - 1);
+    int y1 = std::min((int)floor(yMax + INCREMENTAL_SLACK), camera.height - 1);
+    if (x0 > x1 || y0 > y1) {
+      return true;
+    }
+    for (int ty = y0 / RENDER_TILE_SIZE; ty <= y1 / RENDER_TILE_SIZE; ty++) {
+      for (int tx = x0 / RENDER_TILE_SIZE; tx <= x1 / RENDER_TILE_SIZE;
+           tx++) {
+        dirty[ty * tileX + tx] = true;
+      }
+    }
+    return true;
+  }
+
+  bool mark(Camera &camera, Triangle &t) {
+    Vec3 points[3] = {t.v0, t.v1, t.v2};
+    return mark(camera, points, 3);
+  }
+
+  bool mark(Camera &camera, Rect &q) {
+    Vec3 points[4] = {
+        q.corner(q.min[0], q.min[1]), q.corner(q.max[0], q.min[1]),
+        q.corner(q.min[0], q.max[1]), q.corner(q.max[0], q.max[1])};
+    return mark(camera, points, 4);
+  }
+
+  // marks the old bounds of every primitive that is gone and the new bounds
+  // of every one that is new, a new glyph changes the texture of all of
+  // them. building the tree reorders the primitives, so both sides are
+  // compared sorted. false when everything has to be rendered
+  bool mark_changes(Camera &camera, Framebuffer &fb,
+                    std::vector<Triangle> &nowTriangles,
+                    std::vector<Rect> &nowRects) {
+    if (!same_view(camera, fb) ||
+        nowTriangles.size() != triangles.size() ||
+        nowRects.size() != rects.size()) {
+      return false;
+    }
+    dirty.assign(tileX * tileY, false);
+    bool all = scene.glyph != glyph;
+    std::vector<Triangle> changedTriangles;
+    std::vector<Rect> changedRects;
+    for (int k = 0; k < 2; k++) {
+      // what is only in the last frame, then what is only in this one
+      std::vector<Triangle> &a = k == 0 ? triangles : nowTriangles;
+      std::vector<Triangle> &b = k == 0 ? nowTriangles : triangles;
+      std::vector<Rect> &c = k == 0 ? rects : nowRects;
+      std::vector<Rect> &d = k == 0 ? nowRects : rects;
+      changedTriangles.clear();
+      changedRects.clear();
+      if (all) {
+        changedTriangles = a;
+        changedRects = c;
+      } else {
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                            std::back_inserter(changedTriangles),
+                            less_triangle);
+        std::set_difference(c.begin(), c.end(), d.begin(), d.end(),
+                            std::back_inserter(changedRects), less_rect);
+      }
+      for (Triangle &t : changedTriangles) {
+        if (!mark(camera, t)) {
+          return false;
+        }
+      }
+      for (Rect &q : changedRects) {
+        if (!mark(camera, q)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include "myavatar.h"
+#include "avatar.h"
+#include "parallel.h"
+#include "render.h"
+#include "sampler.h"
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+
+#define MYAVATAR_MAX_SIZE 16384
+#define MYAVATAR_MAX_SPP 4096
+
+// a built copy of the avatar scene, used by one render at a time. glyph
+// and palette belong to the render, the tree is built once per transform
+class PooledScene {
+public:
+  Scene scene;
+  long generation;
+
+  PooledScene(Mat4x4 &transform, long igeneration) : generation(igeneration) {
+    generate_avatar_cube(scene.triangles, transform);
+    scene.build();
+  }
+};
+
+// renders never share a PooledScene, so they never write to the same one.
+// the pool grows to the number of concurrent renders and is dropped as a
+// whole when the transform changes. samplers only read their seed and are
+// shared by every render of the same spp
+struct myavatar_scene {
+  unsigned seed;
+  std::mutex mutex;
+  Mat4x4 transform;
+  long generation;
+  std::vector<PooledScene *> idle;
+  std::map<int, Sampler *> samplers;
+
+  myavatar_scene(unsigned iseed)
+      : seed(iseed), transform(avatar_transform()), generation(0) {}
+
+  ~myavatar_scene() {
+    for (PooledScene *p : idle) {
+      delete p;
+    }
+    for (auto &sampler : samplers) {
+      delete sampler.second;
+    }
+  }
+
+  PooledScene *acquire() {
+    Mat4x4 current;
+    long g;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!idle.empty()) {
+        PooledScene *p = idle.back();
+        idle.pop_back();
+        return p;
+      }
+      current = transform;
+      g = generation;
+    }
+    // built outside the lock, other renders go on meanwhile
+    return new PooledScene(current, g);
+  }
+
+  void release(PooledScene *p) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (p->generation == generation) {
+        idle.push_back(p);
+        return;
+      }
+    }
+    delete p;
+  }
+
+  Sampler &sampler(int spp) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Sampler *&s = samplers[spp];
+    if (s == nullptr) {
+      s = create_sampler(SAMPLER_SOBOL, seed, spp);
+    }
+    return *s;
+  }
+
+  void set_transform(const Mat4x4 &mat) {
+    std::vector<PooledScene *> stale;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      transform = mat;
+      generation++;
+      stale.swap(idle);
+    }
+    for (PooledScene *p : stale) {
+      delete p;
+    }
+  }
+};
+
+static int pixel_bytes(int format) {
+  return format == MYAVATAR_RGB8 ? 3 : format == MYAVATAR_RGBA8 ? 4 : 16;
+}
+
+static bool valid_image(const myavatar_image *image) {
+  // only letters have a font
+  return image != nullptr && image->pixels != nullptr &&
+         isalpha((unsigned char)image->glyph) && image->size > 0 &&
+         image->size <= MYAVATAR_MAX_SIZE && image->spp > 0 &&
+         image->spp <= MYAVATAR_MAX_SPP && image->format >= MYAVATAR_RGB8 &&
+         image->format <= MYAVATAR_RGBA32F &&
+         (image->stride == 0 ||
+          image->stride >= (size_t)image->size * pixel_bytes(image->format));
+}
+
+// the mean of every pixel straight into the rows of the caller, bytes are
+// the ones encode_ppm writes
+static void resolve(Framebuffer &fb, const myavatar_image *image) {
+  size_t stride = image->stride != 0
+                      ? image->stride
+                      : (size_t)image->size * pixel_bytes(image->format);
+  if (image->format != MYAVATAR_RGBA32F) {
+    ResolveOptions options;
+    options.alpha = image->format == MYAVATAR_RGBA8;
+    fb.resolve((unsigned char *)image->pixels, stride, options);
+    return;
+  }
+  parallel_for(0, fb.height, [&](int y) {
+    unsigned char *row = (unsigned char *)image->pixels + y * stride;
+    for (int x = 0; x < fb.width; x++) {
+      Vec4 c = fb.get_color(x, y);
+      float v[4] = {(float)c.a, (float)c.b, (float)c.c, (float)c.d};
+      memcpy(row + x * 16, v, sizeof(v));
+    }
+  });
+}
+
+static int render_image(myavatar_scene *scene, const myavatar_image *image) {
+  if (scene == nullptr || !valid_image(image)) {
+    return MYAVATAR_INVALID_ARGUMENT;
+  }
+  try {
+    Sampler &sampler = scene->sampler(image->spp);
+    PooledScene *p = scene->acquire();
+    p->scene.glyph = image->glyph;
+    p->scene.palette = Palette();
+    if (image->palette != nullptr) {
+      const float *c = image->palette;
+      p->scene.palette.background = Vec4(c[0], c[1], c[2], c[3]);
+      p->scene.palette.ink = Vec4(c[4], c[5], c[6], c[7]);
+      p->scene.palette.paper = Vec4(c[8], c[9], c[10], c[11]);
+    }
+    Camera camera = avatar_camera(image->size);
+    Framebuffer fb(image->size, image->size);
+    try {
+      render(p->scene, camera, sampler, fb, image->spp);
+    } catch (...) {
+      delete p;
+      throw;
+    }
+    scene->release(p);
+    resolve(fb, image);
+    return MYAVATAR_OK;
+  } catch (std::bad_alloc &) {
+    return MYAVATAR_OUT_OF_MEMORY;
+  } catch (...) {
+    return MYAVATAR_FAILED;
+  }
+}
+
+extern "C" {
+
+int myavatar_api_version(void) { return MYAVATAR_API_VERSION; }
+
+const char *myavatar_status_string(int status) {
+  switch (status) {
+  case MYAVATAR_OK:
+    return "ok";
+  case MYAVATAR_INVALID_ARGUMENT:
+    return "invalid argument";
+  case MYAVATAR_OUT_OF_MEMORY:
+    return "out of memory";
+  default:
+    return "render failed";
+  }
+}
+
+myavatar_scene *myavatar_scene_create(unsigned seed) {
+  try {
+    Fonts::get_instance();
+    ThreadPool::get_instance();
+    return new myavatar_scene(seed);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void myavatar_scene_destroy(myavatar_scene *scene) { delete scene; }
+
+int myavatar_scene_set_transform(myavatar_scene *scene,
+                                 const double *matrix) {
+  if (scene == nullptr || matrix == nullptr) {
+    return MYAVATAR_INVALID_ARGUMENT;
+  }
+  Mat4x4 mat;
+  for (int i = 0; i < 16; i++) {
+    mat.value[i / 4][i % 4] = matrix[i];
+  }
+  try {
+    scene->set_transform(mat);
+  } catch (...) {
+    return MYAVATAR_OUT_OF_MEMORY;
+  }
+  return MYAVATAR_OK;
+}
+
+void myavatar_avatar_transform(double spin, double *matrix) {
+  Mat4x4 mat = avatar_transform(spin);
+  for (int i = 0; i < 16; i++) {
+    matrix[i] = mat.value[i / 4][i % 4];
+  }
+}
+
+size_t myavatar_image_bytes(int size, int format) {
+  if (size <= 0 || format < MYAVATAR_RGB8 || format > MYAVATAR_RGBA32F) {
+    return 0;
+  }
+  return (size_t)size * size * pixel_bytes(format);
+}
+
+int myavatar_render(myavatar_scene *scene, const myavatar_image *image) {
+  return render_image(scene, image);
+}
+
+int myavatar_render_batch(myavatar_scene *scene, const myavatar_image *images,
+                          int imageNum) {
+  if (scene == nullptr || images == nullptr || imageNum < 0) {
+    return MYAVATAR_INVALID_ARGUMENT;
+  }
+  // small images keep the pool busy side by side, large ones split rows
+  std::vector<int> status(imageNum, MYAVATAR_OK);
+  parallel_for(0, imageNum,
+               [&](int i) { status[i] = render_image(scene, &images[i]); });
+  for (int s : status) {
+    if (s != MYAVATAR_OK) {
+      return s;
+    }
+  }
+  return MYAVATAR_OK;
+}
+}
@@ -0,0 +1,88 @@
+#ifndef MYAVATAR_H
+#define MYAVATAR_H
+
+// c interface of libmyavatar.so. a scene is the avatar cube under one
+// transform, any number of threads may render from it at once, and images
+// land in memory owned by the caller. new fields and functions are only
+// ever added at the end, MYAVATAR_API_VERSION counts them
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MYAVATAR_API_VERSION 1
+
+#if defined(__GNUC__)
+#define MYAVATAR_EXPORT __attribute__((visibility("default")))
+#else
+#define MYAVATAR_EXPORT
+#endif
+
+enum myavatar_status {
+  MYAVATAR_OK = 0,
+  MYAVATAR_INVALID_ARGUMENT = -1,
+  MYAVATAR_OUT_OF_MEMORY = -2,
+  MYAVATAR_FAILED = -3
+};
+
+enum myavatar_format {
+  MYAVATAR_RGB8 = 0,   // 3 bytes per pixel, like the ppm files
+  MYAVATAR_RGBA8 = 1,  // 4 bytes per pixel, alpha is the mean layer alpha
+  MYAVATAR_RGBA32F = 2 // 4 floats per pixel, not clamped
+};
+
+typedef struct myavatar_scene myavatar_scene;
+
+// one image to render. glyph is an ascii letter, anything else is an
+// invalid argument. pixels holds size rows of stride bytes each, stride
+// 0 means rows are packed. palette is 12 floats, rgba of background, ink
+// and paper, or null for the default colors
+typedef struct myavatar_image {
+  char glyph;
+  int size;
+  int spp;
+  int format;
+  size_t stride;
+  void *pixels;
+  const float *palette;
+} myavatar_image;
+
+MYAVATAR_EXPORT int myavatar_api_version(void);
+
+MYAVATAR_EXPORT const char *myavatar_status_string(int status);
+
+// samples of every render come from a sobol sampler seeded with seed, the
+// same inputs always give the same bytes. null when out of memory
+MYAVATAR_EXPORT myavatar_scene *myavatar_scene_create(unsigned seed);
+
+// no render may still be running on the scene
+MYAVATAR_EXPORT void myavatar_scene_destroy(myavatar_scene *scene);
+
+// 16 doubles, row major, from the unit cube to the world. renders already
+// running finish with the old transform
+MYAVATAR_EXPORT int myavatar_scene_set_transform(myavatar_scene *scene,
+                                                 const double *matrix);
+
+// the transform of the avatar cube turned by spin radians around its own y
+// axis, the default one for spin 0
+MYAVATAR_EXPORT void myavatar_avatar_transform(double spin, double *matrix);
+
+// bytes pixels needs for a packed image
+MYAVATAR_EXPORT size_t myavatar_image_bytes(int size, int format);
+
+MYAVATAR_EXPORT int myavatar_render(myavatar_scene *scene,
+                                    const myavatar_image *image);
+
+// imageNum images at once on the shared thread pool. every image is tried,
+// the status of the first one that failed is returned
+MYAVATAR_EXPORT int myavatar_render_batch(myavatar_scene *scene,
+                                          const myavatar_image *images,
+                                          int imageNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int thread_num() {
+  int n = (int)std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+// one parallel_for call, indices are handed out one at a time so uneven
+// items (subtrees, tiles) still balance
+class ParallelJob {
+public:
+  std::atomic<int> next;
+  int end;
+  int helperNum; // pool threads inside run_one, guarded by the pool mutex
+  std::function<void(int)> f;
+
+  ParallelJob(int begin, int iend, const std::function<void(int)> &iF)
+      : next(begin), end(iend), helperNum(0), f(iF) {}
+
+  // false once every index is taken
+  bool run_one() {
+    int i = next++;
+    if (i >= end) {
+      return false;
+    }
+    f(i);
+    return true;
+  }
+};
+
+// threads live for the whole process and help whichever job is queued. the
+// caller of parallel_for always works on its own job too, so nested calls,
+// and a forked process that has no pool threads, still finish
+class ThreadPool {
+public:
+  // never destroyed, waiting threads would block the destructor at exit
+  static ThreadPool &get_instance() {
+    static ThreadPool *pool = new ThreadPool();
+    return *pool;
+  }
+
+  void run(ParallelJob &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(&job);
+    }
+    wake.notify_all();
+
+    while (job.run_one()) {
+    }
+
+    // no helper may touch the job once this returns
+    std::unique_lock<std::mutex> lock(mutex);
+    remove(&job);
+    finish.wait(lock, [&job]() { return job.helperNum == 0; });
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable wake, finish;
+  std::deque<ParallelJob *> jobs;
+
+  ThreadPool() {
+    for (int i = 1; i < thread_num(); i++) {
+      std::thread([this]() { work(); }).detach();
+    }
+  }
+
+  void remove(ParallelJob *job) {
+    auto it = std::find(jobs.begin(), jobs.end(), job);
+    if (it != jobs.end()) {
+      jobs.erase(it);
+    }
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this]() { return !jobs.empty(); });
+      ParallelJob *job = jobs.front();
+      job->helperNum++;
+      lock.unlock();
+
+      while (job->run_one()) {
+      }
+
+      lock.lock();
+      // every index is taken, nobody else needs to pick it up
+      remove(job);
+      job->helperNum--;
+      finish.notify_all();
+    }
+  }
+};
+
+// call f(i) for every i in [begin, end) on the shared pool
+template <typename F> void parallel_for(int begin, int end, F f) {
+  if (end - begin <= 1 || thread_num() == 1) {
+    for (int i = begin; i < end; i++) {
+      f(i);
+    }
+    return;
+  }
+  ParallelJob job(begin, end, f);
+  ThreadPool::get_instance().run(job);
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "cache.h"
+#include "render.h"
+#include "sampler.h"
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC 0x5641594d // "MYAV"
+#define CHECKPOINT_VERSION 2
+
+// samplers are counter based, type, seed and the next pass are their state.
+// key is the render_key of scene, camera, sampler and total spp, the sums
+// of another letter or view never get resumed into this one
+class CheckpointHeader {
+public:
+  unsigned magic, version;
+  int width, height;
+  int samplerType;
+  unsigned seed;
+  int passSpp, passDone;
+  char key[17];
+
+  CheckpointHeader()
+      : magic(CHECKPOINT_MAGIC), version(CHECKPOINT_VERSION), width(0),
+        height(0), samplerType(0), seed(0), passSpp(0), passDone(0), key() {}
+
+  bool match(const CheckpointHeader &h) {
+    return magic == h.magic && version == h.version && width == h.width &&
+           height == h.height && samplerType == h.samplerType &&
+           seed == h.seed && passSpp == h.passSpp &&
+           strncmp(key, h.key, sizeof(key)) == 0;
+  }
+};
+
+// written to path.tmp and renamed, a crash never leaves half a checkpoint
+bool write_checkpoint(const std::string &path, CheckpointHeader &header,
+                      Framebuffer &fb) {
+  std::string tmpPath = path + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(&fb.sum[0], sizeof(float), fb.sum.size(), file) ==
+                fb.sum.size() &&
+            fwrite(&fb.sampleNum[0], sizeof(int), fb.sampleNum.size(),
+                   file) == fb.sampleNum.size();
+  ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+  fclose(file);
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// false if there is no checkpoint or it belongs to another render
+bool read_checkpoint(const std::string &path, CheckpointHeader &header,
+                     Framebuffer &fb) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  CheckpointHeader saved;
+  bool ok = fread(&saved, sizeof(saved), 1, file) == 1 && header.match(saved);
+  ok = ok &&
+       fread(&fb.sum[0], sizeof(float), fb.sum.size(), file) ==
+           fb.sum.size() &&
+       fread(&fb.sampleNum[0], sizeof(int), fb.sampleNum.size(), file) ==
+           fb.sampleNum.size();
+  fclose(file);
+  if (!ok) {
+    fb.clear();
+    return false;
+  }
+  header.passDone = saved.passDone;
+  return true;
+}
+
+volatile sig_atomic_t progressiveStop = 0;
+
+// on SIGTERM the running pass is finished and checkpointed
+void progressive_stop_handler(int) { progressiveStop = 1; }
+
+// renders passNum passes of passSpp samples, pass i takes sample indices
+// [i * passSpp, (i + 1) * passSpp) so a resumed render adds exactly the
+// samples a straight one would have
+class ProgressiveRenderer {
+public:
+  int passSpp, passNum;
+  int previewInterval, checkpointInterval; // in passes, 0 to disable
+  std::string previewPath, checkpointPath;
+  int passDone;
+
+  ProgressiveRenderer(Scene &iscene, Camera &icamera, Sampler &isampler,
+                      int ipassSpp, int ipassNum)
+      : passSpp(ipassSpp), passNum(ipassNum), previewInterval(0),
+        checkpointInterval(1), previewPath(), checkpointPath(), passDone(0),
+        scene(iscene), camera(icamera), sampler(isampler) {}
+
+  // false if stopped before the last pass
+  bool render(Framebuffer &fb) {
+    CheckpointHeader header;
+    header.width = fb.width;
+    header.height = fb.height;
+    header.samplerType = sampler.type;
+    header.seed = sampler.seed;
+    header.passSpp = passSpp;
+    std::string key = render_key(scene, camera, sampler, passSpp * passNum,
+                                 true);
+    snprintf(header.key, sizeof(header.key), "%s", key.c_str());
+
+    fb.clear();
+    passDone = 0;
+    if (!checkpointPath.empty() &&
+        read_checkpoint(checkpointPath, header, fb)) {
+      passDone = header.passDone;
+      std::cout << "resume from pass " << passDone << std::endl;
+    }
+
+    while (passDone < passNum) {
+      ::render(scene, camera, sampler, fb, passSpp, passDone * passSpp);
+      passDone++;
+
+      bool last = passDone == passNum;
+      if (!previewPath.empty() && previewInterval > 0 &&
+          passDone % previewInterval == 0 && !last) {
+        fb.write_ppm(previewPath);
+      }
+      if (!checkpointPath.empty() &&
+          ((checkpointInterval > 0 && passDone % checkpointInterval == 0) ||
+           progressiveStop)) {
+        header.passDone = passDone;
+        if (!write_checkpoint(checkpointPath, header, fb)) {
+          std::cout << "fail to write " << checkpointPath << std::endl;
+        }
+      }
+      if (progressiveStop && !last) {
+        return false;
+      }
+    }
+    // also when a finished checkpoint was resumed and no pass ran
+    if (!previewPath.empty() && previewInterval > 0) {
+      fb.write_ppm(previewPath);
+    }
+    return true;
+  }
+
+private:
+  Scene &scene;
+  Camera &camera;
+  Sampler &sampler;
+};
+
+#endif
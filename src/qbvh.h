@@ -0,0 +1,344 @@
+#ifndef QBVH_H
+#define QBVH_H
+
+#include "base.h"
+#include "render.h"
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// traversal stacks up to this depth live on the stack, deeper trees get one
+// on the heap
+#define QBVH_STACK_SIZE 64
+// decoded bounds are padded by this much of the scene size, covers the float
+// rounding of decoding and of the slab test
+#define QBVH_PADDING 1e-5
+
+// four float lanes, the last one is ignored by every box operation
+#ifdef __SSE2__
+typedef __m128 Float4;
+
+inline Float4 f4_set(float a, float b, float c) {
+  return _mm_set_ps(0, c, b, a);
+}
+inline Float4 f4_add(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+inline Float4 f4_sub(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+inline Float4 f4_mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+inline Float4 f4_min(Float4 a, Float4 b) { return _mm_min_ps(a, b); }
+inline Float4 f4_max(Float4 a, Float4 b) { return _mm_max_ps(a, b); }
+inline float f4_get(Float4 a, int i) {
+  float v[4];
+  _mm_storeu_ps(v, a);
+  return v[i];
+}
+
+inline float f4_max3(Float4 a) {
+  Float4 b = _mm_max_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 1)));
+  return _mm_cvtss_f32(_mm_max_ss(b, _mm_movehl_ps(a, a)));
+}
+
+inline float f4_min3(Float4 a) {
+  Float4 b = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 1)));
+  return _mm_cvtss_f32(_mm_min_ss(b, _mm_movehl_ps(a, a)));
+}
+
+// three quantized values to floats, one load and a widening unpack. reads
+// one value past the third, nodes keep something after every bound
+inline Float4 f4_load(const unsigned char *q) {
+  int v;
+  memcpy(&v, q, sizeof(v));
+  __m128i zero = _mm_setzero_si128();
+  __m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+}
+
+inline Float4 f4_load(const unsigned short *q) {
+  __m128i x = _mm_loadl_epi64((const __m128i *)q);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, _mm_setzero_si128()));
+}
+#else
+class Float4 {
+public:
+  float v[4];
+};
+
+inline Float4 f4_set(float a, float b, float c) {
+  Float4 r = {{a, b, c, 0}};
+  return r;
+}
+#define FLOAT4_OP(name, expr)                                                  \
+  inline Float4 name(Float4 a, Float4 b) {                                     \
+    Float4 r;                                                                  \
+    for (int i = 0; i < 4; i++) {                                              \
+      float x = a.v[i], y = b.v[i];                                            \
+      r.v[i] = expr;                                                           \
+    }                                                                          \
+    return r;                                                                  \
+  }
+FLOAT4_OP(f4_add, x + y)
+FLOAT4_OP(f4_sub, x - y)
+FLOAT4_OP(f4_mul, x * y)
+FLOAT4_OP(f4_min, x < y ? x : y)
+FLOAT4_OP(f4_max, x > y ? x : y)
+#undef FLOAT4_OP
+inline float f4_get(Float4 a, int i) { return a.v[i]; }
+inline float f4_max3(Float4 a) {
+  return std::max(a.v[0], std::max(a.v[1], a.v[2]));
+}
+inline float f4_min3(Float4 a) {
+  return std::min(a.v[0], std::min(a.v[1], a.v[2]));
+}
+template <typename T> inline Float4 f4_load(const T *q) {
+  return f4_set(q[0], q[1], q[2]);
+}
+#endif
+
+// bounds of both children relative to the bounds of the node, rounded
+// outward. child >= 0 is a node, otherwise ~child is the first primitive of
+// a leaf, its list ends at a -1. a primitive p >= 0 is a triangle, below -1
+// it is rect -2 - p
+template <typename T> class QuantizedNode {
+public:
+  T lo[2][3], hi[2][3];
+  int child[2];
+};
+
+// read only copy of a Box tree in QuantizedNode layout. every node is decoded
+// with the bounds decoded for it by its parent, so nothing but the root box
+// is stored in floats. lazy boxes are expanded while copying.
+// a memory experiment, no render path uses it and it traces no faster than
+// the box tree
+template <typename T> class QuantizedBvh {
+public:
+  std::vector<QuantizedNode<T>> nodes;
+  // leaf lists, each ends at a -1. the first one is the empty list
+  std::vector<int> primitives;
+  int depth;
+
+  QuantizedBvh(Box *root, Triangle *ibase, Rect *irectBase = nullptr)
+      : nodes(), primitives(1, -1), depth(0), base(ibase),
+        rectBase(irectBase) {
+    expand_box(root);
+    Vec3 d = root->max - root->min;
+    double size = std::max(std::max(d.a, d.b), d.c);
+    Vec3 far = help_max(Vec3(fabs(root->min.a), fabs(root->min.b),
+                             fabs(root->min.c)),
+                        Vec3(fabs(root->max.a), fabs(root->max.b),
+                             fabs(root->max.c)));
+    size = std::max(size, std::max(std::max(far.a, far.b), far.c));
+    float pad = size * QBVH_PADDING;
+    padding = f4_set(pad, pad, pad);
+    invLevels = f4_set(1.0f / levels(), 1.0f / levels(), 1.0f / levels());
+
+    // the root frame is found the way traversal derives every other frame
+    rootMin = f4_sub(f4_set(root->min.a, root->min.b, root->min.c), padding);
+    Float4 rootMax =
+        f4_add(f4_set(root->max.a, root->max.b, root->max.c), padding);
+    rootScale = f4_mul(f4_sub(rootMax, rootMin), invLevels);
+    build(root, rootMin, rootScale, 1);
+  }
+
+  static int levels() { return std::numeric_limits<T>::max(); }
+
+  size_t memory() {
+    return sizeof(*this) + nodes.size() * sizeof(QuantizedNode<T>) +
+           primitives.size() * sizeof(int);
+  }
+
+  // visit(Triangle *) for every triangle and visitRect(Rect *) for every
+  // rect of every leaf the ray reaches
+  template <typename F, typename G>
+  void traverse(const Ray &r, F visit, G visitRect) {
+    Float4 origin = f4_set(r.origin.a, r.origin.b, r.origin.c);
+    Float4 inv = f4_set(inverse(r.direction.a), inverse(r.direction.b),
+                        inverse(r.direction.c));
+
+    // a node pops one entry and pushes at most two, depth + 1 is enough
+    Frame local[QBVH_STACK_SIZE];
+    std::vector<Frame> heap;
+    Frame *stack = local;
+    if (depth + 1 > QBVH_STACK_SIZE) {
+      heap.resize(depth + 1);
+      stack = &heap[0];
+    }
+    stack[0].node = 0;
+    stack[0].min = rootMin;
+    stack[0].scale = rootScale;
+    int top = 1;
+    while (top > 0) {
+      top--;
+      QuantizedNode<T> &node = nodes[stack[top].node];
+      Float4 fmin = stack[top].min, fscale = stack[top].scale;
+      for (int c = 0; c < 2; c++) {
+        int child = node.child[c];
+        if (child < 0 && primitives[~child] == -1) {
+          continue;
+        }
+        Float4 lo, hi;
+        decode(node.lo[c], node.hi[c], fmin, fscale, lo, hi);
+        Float4 t0 = f4_mul(f4_sub(lo, origin), inv);
+        Float4 t1 = f4_mul(f4_sub(hi, origin), inv);
+        float tNear = std::max(f4_max3(f4_min(t0, t1)), 0.0f);
+        float tFar = f4_min3(f4_max(t0, t1));
+        if (tNear > tFar) {
+          continue;
+        }
+        if (child < 0) {
+          for (int i = ~child; primitives[i] != -1; i++) {
+            int p = primitives[i];
+            if (p >= 0) {
+              visit(base + p);
+            } else {
+              visitRect(rectBase + (-2 - p));
+            }
+          }
+        } else {
+          stack[top].node = child;
+          stack[top].min = lo;
+          stack[top].scale = f4_mul(f4_sub(hi, lo), invLevels);
+          top++;
+        }
+      }
+    }
+  }
+
+private:
+  // a node to visit and the frame its bounds decode in
+  class Frame {
+  public:
+    int node;
+    Float4 min, scale;
+  };
+
+  Triangle *base;
+  Rect *rectBase;
+  Float4 rootMin, rootScale, padding, invLevels;
+
+  // a zero direction is nudged, the slab test then never sees 0 * inf
+  static float inverse(double d) {
+    if (fabs(d) < 1e-30) {
+      d = d < 0 ? -1e-30 : 1e-30;
+    }
+    return (float)(1 / d);
+  }
+
+  void decode(const T *qlo, const T *qhi, Float4 fmin, Float4 fscale,
+              Float4 &lo, Float4 &hi) {
+    lo = f4_sub(f4_add(fmin, f4_mul(f4_load(qlo), fscale)), padding);
+    hi = f4_add(f4_add(fmin, f4_mul(f4_load(qhi), fscale)), padding);
+  }
+
+  // smallest range whose decoded box holds [min, max], checked with the
+  // decoder itself so traversal can never miss
+  void quantize(const Vec3 &min, const Vec3 &max, Float4 fmin, Float4 fscale,
+                T *qlo, T *qhi) {
+    double vmin[3] = {min.a, min.b, min.c}, vmax[3] = {max.a, max.b, max.c};
+    T tlo[4], thi[4]; // room for the load past the third value
+    for (int i = 0; i < 3; i++) {
+      double s = f4_get(fscale, i), f = f4_get(fmin, i);
+      double a = s > 0 ? floor((vmin[i] - f) / s) : 0;
+      double b = s > 0 ? ceil((vmax[i] - f) / s) : levels();
+      tlo[i] = (T)std::min(std::max(a, 0.0), (double)levels());
+      thi[i] = (T)std::min(std::max(b, 0.0), (double)levels());
+    }
+    tlo[3] = thi[3] = 0;
+    while (true) {
+      Float4 lo, hi;
+      decode(tlo, thi, fmin, fscale, lo, hi);
+      bool done = true;
+      for (int i = 0; i < 3; i++) {
+        if (f4_get(lo, i) > vmin[i] && tlo[i] > 0) {
+          tlo[i]--;
+          done = false;
+        }
+        if (f4_get(hi, i) < vmax[i] && thi[i] < levels()) {
+          thi[i]++;
+          done = false;
+        }
+      }
+      if (done) {
+        break;
+      }
+    }
+    memcpy(qlo, tlo, 3 * sizeof(T));
+    memcpy(qhi, thi, 3 * sizeof(T));
+  }
+
+  int leaf(Box *box) {
+    int first = primitives.size();
+    for (Triangle *t : box->leaf) {
+      primitives.push_back(t - base);
+    }
+    // the rects of a tree need the array they point into
+    assert(box->rects.empty() || rectBase != nullptr);
+    for (Rect *q : box->rects) {
+      primitives.push_back(-2 - (int)(q - rectBase));
+    }
+    primitives.push_back(-1);
+    return ~first;
+  }
+
+  // box is decoded as fmin, fscale by whoever points at it, level is the
+  // depth of the node made for it
+  int build(Box *box, Float4 fmin, Float4 fscale, int level) {
+    depth = std::max(depth, level);
+    int index = nodes.size();
+    nodes.push_back(QuantizedNode<T>());
+    Box *children[2] = {box->lChild, box->rChild};
+    if (box->is_leaf()) {
+      // a lone leaf root, the second slot stays empty
+      children[0] = box;
+      children[1] = nullptr;
+    }
+    for (int c = 0; c < 2; c++) {
+      QuantizedNode<T> node = nodes[index];
+      if (children[c] == nullptr) {
+        memset(node.lo[c], 0, sizeof(node.lo[c]));
+        memset(node.hi[c], 0, sizeof(node.hi[c]));
+        node.child[c] = ~0; // the empty list
+        nodes[index] = node;
+        continue;
+      }
+      Box *child = children[c];
+      expand_box(child);
+      quantize(child->min, child->max, fmin, fscale, node.lo[c], node.hi[c]);
+      nodes[index] = node;
+      if (child->is_leaf()) {
+        nodes[index].child[c] = leaf(child);
+        continue;
+      }
+      Float4 lo, hi;
+      decode(node.lo[c], node.hi[c], fmin, fscale, lo, hi);
+      int childIndex =
+          build(child, lo, f4_mul(f4_sub(hi, lo), invLevels), level + 1);
+      nodes[index].child[c] = childIndex;
+    }
+    return index;
+  }
+};
+
+// memory of a Box tree, nodes and leaf lists
+size_t box_memory(Box *box) {
+  if (box == nullptr) {
+    return 0;
+  }
+  return sizeof(Box) + box->leaf.capacity() * sizeof(Triangle *) +
+         box->rects.capacity() * sizeof(Rect *) + box_memory(box->lChild) +
+         box_memory(box->rChild);
+}
+
+template <typename T>
+Vec4 cal_color(Scene &scene, QuantizedBvh<T> &bvh, Ray &r,
+               Surface *surface = nullptr) {
+  std::vector<TransparentColor> colors;
+  bvh.traverse(
+      r, [&](Triangle *p) { collect_triangle(scene, p, r, colors, surface); },
+      [&](Rect *q) { collect_rect(scene, q, r, colors, surface); });
+  return composite(scene, colors, surface);
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "render.h"
+#include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// samples tested together by one coverage mask
+#define RASTER_LANES 4
+// edges are pushed out by this many pixels, the exact ray test on every
+// covered sample decides, so the rasterizer only has to be conservative
+#define RASTER_SLACK 1e-3
+
+// a triangle or a rect on the image, the other pointer is null. edge i is
+// inside where a[i] * x + b[i] * y + c[i] >= -RASTER_SLACK, in pixels. a
+// triangle has a fourth edge that is 0 everywhere
+class RasterPrimitive {
+public:
+  float a[4], b[4], c[4];
+  Triangle *triangle;
+  Rect *rect;
+};
+
+// lanes whose sample (x[i], y[i]) may be inside t, one bit each
+int raster_coverage(const RasterPrimitive &t, const float *x,
+                    const float *y) {
+#ifdef __SSE2__
+  __m128 vx = _mm_loadu_ps(x), vy = _mm_loadu_ps(y);
+  __m128 slack = _mm_set1_ps(-RASTER_SLACK);
+  __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+  for (int i = 0; i < 4; i++) {
+    __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.a[i]), vx),
+                                     _mm_mul_ps(_mm_set1_ps(t.b[i]), vy)),
+                          _mm_set1_ps(t.c[i]));
+    inside = _mm_and_ps(inside, _mm_cmpge_ps(e, slack));
+  }
+  return _mm_movemask_ps(inside);
+#else
+  int mask = 0;
+  for (int k = 0; k < RASTER_LANES; k++) {
+    bool inside = true;
+    for (int i = 0; i < 4; i++) {
+      inside = inside && t.a[i] * x[k] + t.b[i] * y[k] + t.c[i] >=
+                             (float)-RASTER_SLACK;
+    }
+    mask |= inside << k;
+  }
+  return mask;
+#endif
+}
+
+// edges of the convex polygon v of n = 3 or 4 corners in order, false when
+// a corner does not project, the primitive is then left to rays
+bool setup_raster_polygon(Camera &camera, const Vec3 *v, int n,
+                          RasterPrimitive &t, double bounds[4]) {
+  double x[4], y[4];
+  for (int i = 0; i < n; i++) {
+    if (!camera.project(v[i], x[i], y[i])) {
+      return false;
+    }
+  }
+  double area = 0;
+  for (int i = 0; i < n; i++) {
+    int j = (i + 1) % n;
+    area += x[i] * y[j] - x[j] * y[i];
+  }
+  double sign = area < 0 ? -1 : 1;
+  for (int i = 0; i < n; i++) {
+    int j = (i + 1) % n;
+    double a = -(y[j] - y[i]) * sign, b = (x[j] - x[i]) * sign;
+    double length = sqrt(a * a + b * b);
+    if (length == 0) {
+      a = b = 0;
+      length = 1;
+    }
+    t.a[i] = a / length;
+    t.b[i] = b / length;
+    t.c[i] = -(a * x[i] + b * y[i]) / length;
+  }
+  for (int i = n; i < 4; i++) {
+    t.a[i] = t.b[i] = t.c[i] = 0;
+  }
+  bounds[0] = *std::min_element(x, x + n);
+  bounds[1] = *std::min_element(y, y + n);
+  bounds[2] = *std::max_element(x, x + n);
+  bounds[3] = *std::max_element(y, y + n);
+  return true;
+}
+
+bool setup_raster_triangle(Camera &camera, Triangle &triangle,
+                           RasterPrimitive &t, double bounds[4]) {
+  Vec3 v[3] = {triangle.v0, triangle.v1, triangle.v2};
+  t.triangle = &triangle;
+  t.rect = nullptr;
+  return setup_raster_polygon(camera, v, 3, t, bounds);
+}
+
+bool setup_raster_rect(Camera &camera, Rect &rect, RasterPrimitive &t,
+                       double bounds[4]) {
+  Vec3 v[4] = {rect.corner(rect.min[0], rect.min[1]),
+               rect.corner(rect.max[0], rect.min[1]),
+               rect.corner(rect.max[0], rect.max[1]),
+               rect.corner(rect.min[0], rect.max[1])};
+  t.triangle = nullptr;
+  t.rect = &rect;
+  return setup_raster_polygon(camera, v, 4, t, bounds);
+}
+
+// the exact ray test of a covered sample
+void collect_raster(Scene &scene, RasterPrimitive &t, Ray &r,
+                    std::vector<TransparentColor> &fragments) {
+  if (t.rect != nullptr) {
+    collect_rect(scene, t.rect, r, fragments, nullptr);
+  } else {
+    collect_triangle(scene, t.triangle, r, fragments, nullptr);
+  }
+}
+
+// primary visibility by rasterizing, same samples and same image as
+// render_region. triangles and rects are binned to tiles by their screen
+// bounds, each pixel tests RASTER_LANES samples per coverage mask and keeps
+// the fragments of a sample in its own list, which composite sorts like the
+// ray tracer. covered samples get the exact ray test, so shading and the
+// edges of the image match, primitives crossing the camera plane are tested
+// everywhere
+void rasterize_region(Scene &scene, Camera &camera, Sampler &sampler,
+                      Framebuffer &fb, int x0, int y0, int spp, int first) {
+  int tileX = (fb.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+  int tileY = (fb.height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+  std::vector<std::vector<RasterPrimitive>> tiles(tileX * tileY);
+  std::vector<RasterPrimitive> unprojected;
+  int triangleNum = scene.triangles.size();
+  for (int i = 0; i < triangleNum + (int)scene.rects.size(); i++) {
+    RasterPrimitive t;
+    double bounds[4];
+    bool projected =
+        i < triangleNum
+            ? setup_raster_triangle(camera, scene.triangles[i], t, bounds)
+            : setup_raster_rect(camera, scene.rects[i - triangleNum], t,
+                                bounds);
+    if (!projected) {
+      unprojected.push_back(t);
+      continue;
+    }
+    // samples of pixel x lie in [x, x + 1), one pixel of margin each side
+    int left = (int)floor(bounds[0]) - 1 - x0;
+    int top = (int)floor(bounds[1]) - 1 - y0;
+    int right = (int)floor(bounds[2]) + 1 - x0;
+    int bottom = (int)floor(bounds[3]) + 1 - y0;
+    if (right < 0 || bottom < 0 || left >= fb.width || top >= fb.height) {
+      continue;
+    }
+    left = std::max(left, 0) / RENDER_TILE_SIZE;
+    top = std::max(top, 0) / RENDER_TILE_SIZE;
+    right = std::min(right, fb.width - 1) / RENDER_TILE_SIZE;
+    bottom = std::min(bottom, fb.height - 1) / RENDER_TILE_SIZE;
+    for (int ty = top; ty <= bottom; ty++) {
+      for (int tx = left; tx <= right; tx++) {
+        tiles[ty * tileX + tx].push_back(t);
+      }
+    }
+  }
+
+  parallel_for(0, tileX * tileY, [&](int tile) {
+    std::vector<RasterPrimitive> &candidates = tiles[tile];
+    std::vector<TransparentColor> fragments[RASTER_LANES];
+    RayBatch batch;
+    double x[RASTER_LANES], y[RASTER_LANES];
+    float fx[RASTER_LANES], fy[RASTER_LANES];
+    int left = tile % tileX * RENDER_TILE_SIZE;
+    int top = tile / tileX * RENDER_TILE_SIZE;
+    int right = std::min(left + RENDER_TILE_SIZE, fb.width);
+    int bottom = std::min(top + RENDER_TILE_SIZE, fb.height);
+
+    for (int py = top; py < bottom; py++) {
+      for (int px = left; px < right; px++) {
+        int index = py * fb.width + px;
+        for (int k = first; k < first + spp; k += RASTER_LANES) {
+          int n = std::min(RASTER_LANES, first + spp - k);
+          for (int i = 0; i < RASTER_LANES; i++) {
+            // spare lanes repeat the last sample and are ignored
+            int sample = k + std::min(i, n - 1);
+            Vec3 jitter = sampler.get_2d(x0 + px, y0 + py, sample, 0);
+            x[i] = x0 + px + jitter.a;
+            y[i] = y0 + py + jitter.b;
+            fx[i] = x[i];
+            fy[i] = y[i];
+            fragments[i].clear();
+          }
+          camera.generate_batch(x, y, n, batch);
+
+          for (RasterPrimitive &t : candidates) {
+            int mask = raster_coverage(t, fx, fy) & ((1 << n) - 1);
+            for (int i = 0; mask != 0; i++, mask >>= 1) {
+              if (mask & 1) {
+                Ray r = batch.get_ray(i);
+                collect_raster(scene, t, r, fragments[i]);
+              }
+            }
+          }
+          for (int i = 0; i < n; i++) {
+            Ray r = batch.get_ray(i);
+            for (RasterPrimitive &t : unprojected) {
+              collect_raster(scene, t, r, fragments[i]);
+            }
+            fb.add(index, composite(scene, fragments[i], nullptr));
+          }
+        }
+        fb.sampleNum[index] += spp;
+      }
+    }
+  });
+}
+
+void rasterize(Scene &scene, Camera &camera, Sampler &sampler,
+               Framebuffer &fb, int spp = RENDER_SPP, int first = 0) {
+  rasterize_region(scene, camera, sampler, fb, 0, 0, spp, first);
+}
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef REFIT_H
+#define REFIT_H
+
+#include "base.h"
+#include "cpu.h"
+#include "parallel.h"
+#include <cstring>
+
+// subtrees below this depth are refit by separate threads
+#define BOX_REFIT_PARALLEL_DEPTH 3
+// rebuild once sah cost grows past this ratio of the cost after build
+#define BOX_REBUILD_RATIO 1.3
+
+#define SAH_TRAVERSAL_COST 1.0
+#define SAH_INTERSECT_COST 1.0
+
+#ifdef CPU_DISPATCH
+// Triangle::transform of n triangles, a vertex per register or two with the
+// rows of mat in the lanes. sums go in the order of operator*, so the
+// vertices are the same as on the scalar path
+CPU_TARGET("sse2")
+void transform_triangles_sse2(Triangle *triangles, int n, Mat4x4 &mat) {
+  __m128d rows01[4], rows2[4];
+  for (int j = 0; j < 4; j++) {
+    rows01[j] = _mm_setr_pd(mat.value[0][j], mat.value[1][j]);
+    rows2[j] = _mm_set_sd(mat.value[2][j]);
+  }
+  for (int i = 0; i < n; i++) {
+    Triangle &t = triangles[i];
+    Vec3 *vertexs[3] = {&t.v0, &t.v1, &t.v2};
+    for (Vec3 *v : vertexs) {
+      __m128d a = _mm_set1_pd(v->a), b = _mm_set1_pd(v->b);
+      __m128d c = _mm_set1_pd(v->c);
+      __m128d p = _mm_add_pd(
+          _mm_add_pd(_mm_add_pd(_mm_mul_pd(rows01[0], a),
+                                _mm_mul_pd(rows01[1], b)),
+                     _mm_mul_pd(rows01[2], c)),
+          rows01[3]);
+      __m128d q = _mm_add_sd(
+          _mm_add_sd(
+              _mm_add_sd(_mm_mul_sd(rows2[0], a), _mm_mul_sd(rows2[1], b)),
+              _mm_mul_sd(rows2[2], c)),
+          rows2[3]);
+      _mm_storeu_pd(&v->a, p);
+      _mm_store_sd(&v->c, q);
+    }
+    t.n = cross(t.v1 - t.v0, t.v2 - t.v0);
+    t.offset = dot(t.v0, t.n);
+  }
+}
+
+CPU_TARGET("avx2")
+void transform_triangles_avx2(Triangle *triangles, int n, Mat4x4 &mat) {
+  __m256d cols[4];
+  for (int j = 0; j < 4; j++) {
+    cols[j] = _mm256_setr_pd(mat.value[0][j], mat.value[1][j],
+                             mat.value[2][j], 0);
+  }
+  for (int i = 0; i < n; i++) {
+    Triangle &t = triangles[i];
+    Vec3 *vertexs[3] = {&t.v0, &t.v1, &t.v2};
+    for (Vec3 *v : vertexs) {
+      __m256d p = _mm256_add_pd(
+          _mm256_add_pd(
+              _mm256_add_pd(_mm256_mul_pd(cols[0], _mm256_set1_pd(v->a)),
+                            _mm256_mul_pd(cols[1], _mm256_set1_pd(v->b))),
+              _mm256_mul_pd(cols[2], _mm256_set1_pd(v->c))),
+          cols[3]);
+      _mm_storeu_pd(&v->a, _mm256_castpd256_pd128(p));
+      _mm_store_sd(&v->c, _mm256_extractf128_pd(p, 1));
+    }
+    t.n = cross(t.v1 - t.v0, t.v2 - t.v0);
+    t.offset = dot(t.v0, t.n);
+  }
+}
+#endif
+
+// moves every triangle by mat, chunks are spread over threads and run the
+// kernel of the cpu level. avx512 hosts run the avx2 kernel, a vertex fills
+// only 3 lanes
+void transform_triangles(std::vector<Triangle> &triangles, Mat4x4 &mat) {
+  int chunk = 1024;
+  int chunkNum = ((int)triangles.size() + chunk - 1) / chunk;
+  parallel_for(0, chunkNum, [&](int i) {
+    int end = (i + 1) * chunk;
+    end = end < (int)triangles.size() ? end : (int)triangles.size();
+#ifdef CPU_DISPATCH
+    if (cpu_level() >= CPU_AVX2) {
+      transform_triangles_avx2(&triangles[i * chunk], end - i * chunk, mat);
+      return;
+    }
+    if (cpu_level() == CPU_SSE2) {
+      transform_triangles_sse2(&triangles[i * chunk], end - i * chunk, mat);
+      return;
+    }
+#endif
+    for (int j = i * chunk; j < end; j++) {
+      triangles[j].transform(mat);
+    }
+  });
+}
+
+void refit_box(Box *box) {
+  // bottom-up, topology is untouched
+  box->min = Vec3(DBL_MAX, DBL_MAX, DBL_MAX);
+  box->max = Vec3(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  if (box->is_leaf()) {
+    for (Triangle *t : box->leaf) {
+      box->min = help_min(box->min, help_min(t->v0, t->v1, t->v2));
+      box->max = help_max(box->max, help_max(t->v0, t->v1, t->v2));
+    }
+  } else {
+    refit_box(box->lChild);
+    refit_box(box->rChild);
+    box->min = help_min(box->lChild->min, box->rChild->min);
+    box->max = help_max(box->lChild->max, box->rChild->max);
+  }
+}
+
+void collect_subtrees(Box *box, int depth, std::vector<Box *> &subtrees) {
+  if (depth == 0 || box->is_leaf()) {
+    subtrees.push_back(box);
+  } else {
+    collect_subtrees(box->lChild, depth - 1, subtrees);
+    collect_subtrees(box->rChild, depth - 1, subtrees);
+  }
+}
+
+// refit nodes above depth, subtrees below are expected to be up to date
+void refit_top(Box *box, int depth) {
+  if (depth == 0 || box->is_leaf()) {
+    return;
+  }
+  refit_top(box->lChild, depth - 1);
+  refit_top(box->rChild, depth - 1);
+  box->min = help_min(box->lChild->min, box->rChild->min);
+  box->max = help_max(box->lChild->max, box->rChild->max);
+}
+
+void refit_box_parallel(Box *box) {
+  std::vector<Box *> subtrees;
+  collect_subtrees(box, BOX_REFIT_PARALLEL_DEPTH, subtrees);
+  parallel_for(0, subtrees.size(), [&](int i) { refit_box(subtrees[i]); });
+  refit_top(box, BOX_REFIT_PARALLEL_DEPTH);
+}
+
+double sah_cost_help(Box *box) {
+  if (box->is_leaf()) {
+    return box->surface_area() * box->primitive_num() * SAH_INTERSECT_COST;
+  }
+  return box->surface_area() * SAH_TRAVERSAL_COST +
+         sah_cost_help(box->lChild) + sah_cost_help(box->rChild);
+}
+
+// sah cost normalized by the root area, so a rigid motion of a good tree
+// keeps roughly the same cost
+double box_sah_cost(Box *box) {
+  double area = box->surface_area();
+  if (area <= 0) {
+    return 0;
+  }
+  return sah_cost_help(box) / area;
+}
+
+// triangles of a subtree are a continuous range, build_box only sorts inside
+// the range it splits
+void box_triangle_range(Box *box, Triangle *&first, Triangle *&last) {
+  if (box->is_leaf()) {
+    for (Triangle *t : box->leaf) {
+      first = first == nullptr || t < first ? t : first;
+      last = last == nullptr || t > last ? t : last;
+    }
+  } else {
+    box_triangle_range(box->lChild, first, last);
+    box_triangle_range(box->rChild, first, last);
+  }
+}
+
+bool vertex_comp(const Triangle &a, const Triangle &b) {
+  return memcmp(&a.v0, &b.v0, 3 * sizeof(Vec3)) < 0;
+}
+
+// the split axes come from a generator seeded with seed, so rebuilds on
+// separate threads do not share rand() and give the same tree every run.
+// rest, when given, is kept in the order build_box sorts triangles into
+void rebuild_box(std::vector<Triangle> &triangles, Box *box, unsigned seed,
+                 std::vector<Triangle> *rest = nullptr) {
+  Triangle *first = nullptr, *last = nullptr;
+  box_triangle_range(box, first, last);
+  delete box->lChild;
+  delete box->rChild;
+  box->lChild = nullptr;
+  box->rChild = nullptr;
+  box->leaf.clear();
+  box->min = Vec3(DBL_MAX, DBL_MAX, DBL_MAX);
+  box->max = Vec3(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  if (first == nullptr) {
+    return;
+  }
+
+  std::vector<Triangle>::iterator start =
+      triangles.begin() + (first - &triangles[0]);
+  std::vector<Triangle>::iterator end =
+      triangles.begin() + (last - &triangles[0]) + 1;
+  std::vector<Triangle> before;
+  if (rest != nullptr) {
+    before.assign(start, end);
+  }
+  std::minstd_rand random(seed);
+  build_box(start, end, end - start, box, &random);
+  if (rest == nullptr) {
+    return;
+  }
+
+  // find where every triangle went by its vertices. triangles with the same
+  // vertices came from the same rest ones, the motion is invertible
+  int offset = start - triangles.begin();
+  std::vector<int> order(before.size());
+  for (int i = 0; i < (int)order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return vertex_comp(before[a], before[b]);
+  });
+  std::vector<Triangle> after;
+  after.reserve(before.size());
+  for (std::vector<Triangle>::iterator it = start; it != end; it++) {
+    std::vector<int>::iterator found = std::lower_bound(
+        order.begin(), order.end(), *it, [&](int a, const Triangle &t) {
+          return vertex_comp(before[a], t);
+        });
+    after.push_back((*rest)[offset + *found]);
+  }
+  std::copy(after.begin(), after.end(), rest->begin() + offset);
+}
+
+class BoxRefitter {
+public:
+  int refitNum, partialRebuildNum, fullRebuildNum;
+
+  BoxRefitter(std::vector<Triangle> &itriangles, Box *iroot,
+              double irebuildRatio = BOX_REBUILD_RATIO)
+      : refitNum(0), partialRebuildNum(0), fullRebuildNum(0),
+        triangles(itriangles), root(iroot), rebuildRatio(irebuildRatio) {
+    record_cost();
+  }
+
+  // move every vertex by mat and bring the tree up to date
+  void update(Mat4x4 &mat) {
+    transform_triangles(triangles, mat);
+    refit();
+  }
+
+  // the vertices now are the rest pose place starts from, a copy is kept in
+  // the order rebuilds sort the triangles into
+  void keep_rest() { rest = triangles; }
+
+  // put every vertex at mat times its rest pose and bring the tree up to
+  // date. a long animation given by absolute matrices does not pile up the
+  // rounding of one update per frame
+  void place(Mat4x4 &mat) {
+    std::copy(rest.begin(), rest.end(), triangles.begin());
+    update(mat);
+  }
+
+  // bring the tree up to date after the caller moved the vertices, planes
+  // included. any motion, not only one matrix for all
+  void refit() {
+    refit_box_parallel(root);
+    refitNum++;
+
+    if (box_sah_cost(root) > rootCost * rebuildRatio) {
+      rebuild_box(triangles, root, refitNum, rest.empty() ? nullptr : &rest);
+      record_cost();
+      fullRebuildNum++;
+      return;
+    }
+
+    // only the subtrees that degraded are rebuilt, they own disjoint ranges
+    std::vector<int> degraded;
+    for (int i = 0; i < (int)subtrees.size(); i++) {
+      if (box_sah_cost(subtrees[i]) > subtreeCosts[i] * rebuildRatio) {
+        degraded.push_back(i);
+      }
+    }
+    if (degraded.empty()) {
+      return;
+    }
+    parallel_for(0, degraded.size(), [&](int i) {
+      int index = degraded[i];
+      rebuild_box(triangles, subtrees[index],
+                  refitNum * subtrees.size() + index,
+                  rest.empty() ? nullptr : &rest);
+      subtreeCosts[index] = box_sah_cost(subtrees[index]);
+    });
+    refit_top(root, BOX_REFIT_PARALLEL_DEPTH);
+    partialRebuildNum += degraded.size();
+  }
+
+private:
+  std::vector<Triangle> &triangles;
+  Box *root;
+  double rebuildRatio;
+  double rootCost;
+  std::vector<Box *> subtrees;
+  std::vector<double> subtreeCosts;
+  std::vector<Triangle> rest;
+
+  void record_cost() {
+    rootCost = box_sah_cost(root);
+    subtrees.clear();
+    subtreeCosts.clear();
+    collect_subtrees(root, BOX_REFIT_PARALLEL_DEPTH, subtrees);
+    for (Box *box : subtrees) {
+      subtreeCosts.push_back(box_sah_cost(box));
+    }
+  }
+};
+
+#endif
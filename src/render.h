@@ -0,0 +1,603 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "base.h"
+#include "camera.h"
+#include "font.h"
+#include "parallel.h"
+#include "resolve.h"
+#include "sampler.h"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#define RENDER_SPP 40
+// bump whenever the same inputs give different pixels, a kernel of any cpu
+// level included, cached images of an older version are never used
+#define RENDER_VERSION 2
+// one tile fills one ray batch
+#define RENDER_TILE_SIZE 8
+// tile frustums are widened by this many pixels, rays on the border of a
+// tile are still inside
+#define RENDER_FRUSTUM_SLACK 1e-3
+// rays test every node of the cut of their tile, a larger cut goes back to
+// the last level that fit
+#define RENDER_CUT_MAX_NODES 64
+// secondary rays start this far off the surface
+#define SHADE_OFFSET 1e-6
+
+class Palette {
+public:
+  Vec4 background, ink, paper;
+
+  Palette()
+      : background(60.0 / 255.0, 240.0 / 255.0, 165.0 / 255.0, 0.1),
+        ink(0, 0, 0, 0.6), paper(1, 1, 1, 0.3) {}
+};
+
+// optional lighting of every layer. shadow rays go to a point light, ao
+// casts aoRayNum cosine weighted rays per hit, both off by default
+class Shading {
+public:
+  bool shadow;
+  Vec3 light;
+  int aoRayNum;
+  double aoDistance, ambient;
+
+  Shading()
+      : shadow(false), light(0, 3, 6), aoRayNum(0), aoDistance(1),
+        ambient(0.3) {}
+
+  bool enabled() { return shadow || aoRayNum > 0; }
+};
+
+// first surface seen through a pixel, used to match pixels across frames
+class Surface {
+public:
+  double t;
+  int primitive; // -1 for background
+  int layerNum;
+  unsigned layerKey; // ink of every layer, front to back, one bit each
+  bool inked;
+  Vec3 point;
+
+  Surface()
+      : t(DBL_MAX), primitive(-1), layerNum(0), layerKey(0), inked(false),
+        point() {}
+};
+
+// rects are traced by every backend but refit, which only moves triangles
+class Scene {
+public:
+  std::vector<Triangle> triangles;
+  std::vector<Rect> rects;
+  Box *root;
+  char glyph;
+  Palette palette;
+  Shading shading;
+
+  Scene()
+      : triangles(), rects(), root(new Box()), glyph('a'), palette(),
+        shading() {}
+
+  ~Scene() { delete root; }
+
+  // lazy only builds the root, render splits the nodes its rays reach
+  void build(bool lazy = false) {
+    delete root;
+    root = new Box();
+    if (lazy) {
+      build_lazy_box(triangles, rects, root);
+    } else if (rects.empty()) {
+      build_box(triangles.begin(), triangles.end(), triangles.size(), root);
+    } else {
+      build_box(triangles, rects, root);
+    }
+  }
+
+  // primitives count the triangles first, then the rects
+  Vec3 primitive_normal(int primitive) {
+    int n = triangles.size();
+    return primitive < n ? triangles[primitive].n
+                         : rects[primitive - n].normal();
+  }
+};
+
+// float rgba sums, 4 per pixel, and the sample count of every pixel
+class Framebuffer {
+public:
+  int width, height;
+  std::vector<float> sum;
+  std::vector<int> sampleNum;
+
+  Framebuffer(int iwidth, int iheight)
+      : width(iwidth), height(iheight), sum(iwidth * iheight * 4, 0),
+        sampleNum(iwidth * iheight, 0) {}
+
+  void clear() {
+    std::fill(sum.begin(), sum.end(), 0);
+    std::fill(sampleNum.begin(), sampleNum.end(), 0);
+  }
+
+  void add(int index, const Vec4 &color) {
+    float *p = &sum[index * 4];
+    p[0] += color.a;
+    p[1] += color.b;
+    p[2] += color.c;
+    p[3] += color.d;
+  }
+
+  Vec4 get_sum(int index) {
+    float *p = &sum[index * 4];
+    return Vec4(p[0], p[1], p[2], p[3]);
+  }
+
+  void set(int index, const Vec4 &color, int num) {
+    float *p = &sum[index * 4];
+    p[0] = color.a;
+    p[1] = color.b;
+    p[2] = color.c;
+    p[3] = color.d;
+    sampleNum[index] = num;
+  }
+
+  Vec4 get_color(int index) {
+    return sampleNum[index] == 0 ? Vec4() : get_sum(index) / sampleNum[index];
+  }
+
+  Vec4 get_color(int x, int y) { return get_color(y * width + x); }
+
+  // every pixel as bytes into out, rows stride bytes apart
+  void resolve(unsigned char *out, size_t stride,
+               const ResolveOptions &options = ResolveOptions()) {
+    resolve_image(&sum[0], &sampleNum[0], width, height, out, stride,
+                  options);
+  }
+
+  void write_ppm(const std::string &path,
+                 const ResolveOptions &options = ResolveOptions()) {
+    std::vector<char> data = encode_ppm(false, options);
+    std::ofstream file;
+    file.open(path, std::fstream::out | std::fstream::trunc);
+    file.write(&data[0], data.size());
+    file.close();
+  }
+
+  // text P3 as written by write_ppm, or binary P6 as sent by the server.
+  // both are made from the resolved bytes
+  std::vector<char> encode_ppm(bool binary = true,
+                               const ResolveOptions &options =
+                                   ResolveOptions()) {
+    std::string header = std::string(binary ? "P6" : "P3") + "\n" +
+                         std::to_string(width) + " " +
+                         std::to_string(height) + "\n255\n";
+    ResolveOptions rgb = options;
+    rgb.alpha = false;
+    std::vector<char> data(header.begin(), header.end());
+    if (binary) {
+      data.resize(header.size() + (size_t)width * height * 3);
+      resolve((unsigned char *)&data[header.size()], width * 3, rgb);
+      return data;
+    }
+    std::vector<unsigned char> bytes((size_t)width * height * 3);
+    resolve(&bytes[0], width * 3, rgb);
+    data.reserve(header.size() + bytes.size() * 4);
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+      for (int k = 0; k < 3; k++) {
+        char text[4];
+        int n = snprintf(text, sizeof(text), "%d", bytes[i + k]);
+        data.insert(data.end(), text, text + n);
+        data.push_back(k < 2 ? ' ' : '\n');
+      }
+    }
+    return data;
+  }
+};
+
+class TransparentColor {
+public:
+  Vec4 color;
+  double t;
+  bool inked;
+
+  TransparentColor(const Vec4 &nc, const double nt, bool ninked = false)
+      : color(nc), t(nt), inked(ninked) {}
+
+  static bool transparnet_color_comp(const TransparentColor &a,
+                                     const TransparentColor &b) {
+    return a.t > b.t;
+  }
+};
+
+bool glyph_inked(Vec3 textCoor, char glyph) {
+  double x = textCoor.a - trunc(textCoor.a);
+  double y = textCoor.b - trunc(textCoor.b);
+
+  if (x > 1)
+    x = x - 1;
+  if (y > 1)
+    y = y - 1;
+
+  int ix = (int)ceil(x * FONT_SIZE);
+  int iy = (int)ceil(y * FONT_SIZE);
+
+  if (ix == FONT_SIZE)
+    ix = FONT_SIZE - 1;
+  if (iy == FONT_SIZE)
+    iy = FONT_SIZE - 1;
+
+  return need_draw(Fonts::get_instance().get_font(glyph), ix, iy);
+}
+
+// light reaching point on a surface of normal n as seen along r, in
+// [0, 1]. the random numbers come from the ray itself, so a sample shades
+// the same in every process
+double shade(Scene &scene, Vec3 n, Ray &r, Vec3 &point) {
+  Shading &shading = scene.shading;
+  n.normalize();
+  if (dot(n, r.direction) > 0) {
+    n = n * -1;
+  }
+  Vec3 origin = point + n * SHADE_OFFSET;
+
+  double light = 1;
+  if (shading.shadow) {
+    Ray shadowRay(origin, shading.light - origin);
+    double direct = 0;
+    if (!occluded(scene.root, shadowRay, 1)) {
+      Vec3 l = shadowRay.direction;
+      direct = std::max(dot(n, l.normalize()), 0.0);
+    }
+    light = shading.ambient + (1 - shading.ambient) * direct;
+  }
+
+  if (shading.aoRayNum > 0) {
+    double key[3] = {r.direction.a, r.direction.b, r.direction.c};
+    unsigned seed = 0;
+    for (double k : key) {
+      unsigned long long bits;
+      memcpy(&bits, &k, sizeof(bits));
+      seed = hash_combine(seed, (unsigned)(bits ^ bits >> 32));
+    }
+    Vec3 u = cross(fabs(n.a) > 0.9 ? Vec3(0, 1, 0) : Vec3(1, 0, 0), n);
+    u.normalize();
+    Vec3 v = cross(n, u);
+    int open = 0;
+    for (int k = 0; k < shading.aoRayNum; k++) {
+      unsigned h = hash_combine(seed, k);
+      double r2 = to_unit(h), phi = 2 * M_PI * to_unit(hash_u32(h));
+      double s = sqrt(r2);
+      Vec3 d = u * (s * cos(phi)) + v * (s * sin(phi)) + n * sqrt(1 - r2);
+      Ray aoRay(origin, d);
+      open += !occluded(scene.root, aoRay, shading.aoDistance);
+    }
+    light *= (double)open / shading.aoRayNum;
+  }
+  return light;
+}
+
+// color of a surface with normal n where r hits it at point
+Vec4 surface_color(Scene &scene, Vec3 textureCoor, const Vec3 &n, Ray &r,
+                   Vec3 &point, bool &inked) {
+  inked = glyph_inked(textureCoor, scene.glyph);
+  Vec4 color = inked ? scene.palette.ink : scene.palette.paper;
+  if (scene.shading.enabled()) {
+    double light = shade(scene, n, r, point);
+    color =
+        Vec4(color.a * light, color.b * light, color.c * light, color.d);
+  }
+  return color;
+}
+
+// color of triangle p where r hits it at point
+Vec4 surface_color(Scene &scene, Triangle *p, Ray &r, Vec3 &point,
+                   bool &inked) {
+  return surface_color(scene, p->get_texture_coor(point), p->n, r, point,
+                       inked);
+}
+
+// color of rect q where r hits it at point
+Vec4 surface_color(Scene &scene, Rect *q, Ray &r, Vec3 &point, bool &inked) {
+  return surface_color(scene, q->get_texture_coor(point), q->normal(), r,
+                       point, inked);
+}
+
+// adds the color of triangle p, which the ray hits at t
+void add_triangle(Scene &scene, Triangle *p, Ray &r, double t,
+                  std::vector<TransparentColor> &colors, Surface *surface) {
+  Vec3 temp = r.origin + r.direction * t;
+  bool inked;
+  Vec4 color = surface_color(scene, p, r, temp, inked);
+  colors.push_back(TransparentColor(color, t, inked));
+  if (surface != nullptr && t < surface->t) {
+    surface->t = t;
+    surface->primitive = p - &scene.triangles[0];
+    surface->inked = inked;
+    surface->point = temp;
+  }
+}
+
+// adds the color of triangle p if the ray hits it
+void collect_triangle(Scene &scene, Triangle *p, Ray &r,
+                      std::vector<TransparentColor> &colors,
+                      Surface *surface) {
+  double t;
+  if (p->interset(r, t) && t > 0) {
+    Vec3 temp = r.origin + r.direction * t;
+    if (p->contain(temp)) {
+      add_triangle(scene, p, r, t, colors, surface);
+    }
+  }
+}
+
+// adds the color of rect q if the ray hits it
+void collect_rect(Scene &scene, Rect *q, Ray &r,
+                  std::vector<TransparentColor> &colors, Surface *surface) {
+  double t;
+  if (q->interset(r, t) && t > 0) {
+    Vec3 point = r.origin + r.direction * t;
+    bool inked;
+    Vec4 color = surface_color(scene, q, r, point, inked);
+    colors.push_back(TransparentColor(color, t, inked));
+    if (surface != nullptr && t < surface->t) {
+      surface->t = t;
+      surface->primitive = scene.triangles.size() + (q - &scene.rects[0]);
+      surface->inked = inked;
+      surface->point = point;
+    }
+  }
+}
+
+void collect_colors(Scene &scene, Box *box, Ray &r,
+                    std::vector<TransparentColor> &colors, Surface *surface);
+
+// the layers below a box r is known to hit
+void collect_box(Scene &scene, Box *box, Ray &r,
+                 std::vector<TransparentColor> &colors, Surface *surface) {
+  expand_box(box);
+  if (!box->is_leaf()) {
+    collect_colors(scene, box->lChild, r, colors, surface);
+    collect_colors(scene, box->rChild, r, colors, surface);
+    return;
+  }
+
+  int size = box->leaf.size();
+  for (int i = 0; i < size; i += TRIANGLE_LANE_NUM) {
+    int num = std::min(size - i, TRIANGLE_LANE_NUM);
+    double t[TRIANGLE_LANE_NUM];
+    int mask = hit_triangles(&box->leaf[i], num, r, t);
+    for (int j = 0; j < num; j++) {
+      if (mask >> j & 1) {
+        add_triangle(scene, box->leaf[i + j], r, t[j], colors, surface);
+      }
+    }
+  }
+  for (Rect *q : box->rects) {
+    collect_rect(scene, q, r, colors, surface);
+  }
+}
+
+void collect_colors(Scene &scene, Box *box, Ray &r,
+                    std::vector<TransparentColor> &colors, Surface *surface) {
+  if (box->hit(r)) {
+    collect_box(scene, box, r, colors, surface);
+  }
+}
+
+// blends the collected layers far to near over the background
+Vec4 composite(Scene &scene, std::vector<TransparentColor> &colors,
+               Surface *surface) {
+  sort(colors.begin(), colors.end(), TransparentColor::transparnet_color_comp);
+
+  Vec4 color = scene.palette.background;
+
+  for (auto c = colors.begin(); c != colors.end(); c++) {
+    color = (1 - c->color.d) * color + c->color.d * c->color;
+    if (surface != nullptr) {
+      surface->layerKey = surface->layerKey << 1 | c->inked;
+    }
+  }
+  if (surface != nullptr) {
+    surface->layerNum = colors.size();
+  }
+  return color;
+}
+
+Vec4 cal_color(Scene &scene, Ray &r, Surface *surface = nullptr) {
+  std::vector<TransparentColor> colors;
+  collect_colors(scene, scene.root, r, colors, surface);
+  return composite(scene, colors, surface);
+}
+
+// same layers as cal_color with rays that start below the nodes of cut, a
+// cut of the tree made by collect_cut and packed into bounds. the ray is
+// tested against every node at once
+Vec4 cal_color(Scene &scene, BoxBounds &cut, Ray &r,
+               Surface *surface = nullptr) {
+  std::vector<TransparentColor> colors;
+  cut.hit(r);
+  for (int i = 0; i < cut.size; i++) {
+    if (cut.hits[i]) {
+      collect_box(scene, cut.boxes[i], r, colors, surface);
+    }
+  }
+  return composite(scene, colors, surface);
+}
+
+// the four side planes of the pyramid from the camera through the pixels
+// [x0, x1] x [y0, y1] of the image, normals point inside
+class Frustum {
+public:
+  Vec3 origin;
+  Vec3 n[4];
+
+  Frustum(Camera &camera, double x0, double y0, double x1, double y1)
+      : origin(camera.pos) {
+    double x[4] = {x0, x1, x1, x0}, y[4] = {y0, y0, y1, y1};
+    Vec3 d[4];
+    for (int i = 0; i < 4; i++) {
+      d[i] = camera.corner + camera.right * (x[i] / camera.width) +
+             camera.down * (y[i] / camera.height) - camera.pos;
+    }
+    Vec3 center = d[0] + d[2];
+    for (int i = 0; i < 4; i++) {
+      n[i] = cross(d[i], d[(i + 1) % 4]);
+      if (dot(n[i], center) < 0) {
+        n[i] = n[i] * -1;
+      }
+    }
+  }
+
+  // 0 when the box is outside, 2 when it is inside, 1 when not sure
+  int classify(Box *box) {
+    Vec3 lo = box->min - origin, hi = box->max - origin;
+    int inside = 2;
+    for (Vec3 &m : n) {
+      // farthest and nearest corners along m
+      double far = m.a * (m.a > 0 ? hi.a : lo.a) +
+                   m.b * (m.b > 0 ? hi.b : lo.b) +
+                   m.c * (m.c > 0 ? hi.c : lo.c);
+      double near = m.a * (m.a > 0 ? lo.a : hi.a) +
+                    m.b * (m.b > 0 ? lo.b : hi.b) +
+                    m.c * (m.c > 0 ? lo.c : hi.c);
+      if (far < 0) {
+        return 0;
+      }
+      if (near < 0) {
+        inside = 1;
+      }
+    }
+    return inside;
+  }
+};
+
+// nodes of the tree that may hold a hit of a ray in frustum, in the order
+// collect_colors visits them, so the layers keep their order. the cut
+// starts at the root and goes one level deeper at a time while it stays
+// within maxNodes, subtrees wholly inside are kept whole. lazy nodes on the
+// way are split
+void collect_cut(Box *root, Frustum &frustum, std::vector<Box *> &cut,
+                 int maxNodes = RENDER_CUT_MAX_NODES) {
+  cut.clear();
+  if (frustum.classify(root) != 0) {
+    cut.push_back(root);
+  }
+  std::vector<Box *> next;
+  bool deeper = true;
+  while (deeper) {
+    deeper = false;
+    next.clear();
+    for (Box *box : cut) {
+      expand_box(box);
+      if (box->is_leaf() || frustum.classify(box) == 2) {
+        next.push_back(box);
+        continue;
+      }
+      Box *children[2] = {box->lChild, box->rChild};
+      for (Box *child : children) {
+        if (frustum.classify(child) != 0) {
+          next.push_back(child);
+        }
+      }
+      deeper = true;
+    }
+    if ((int)next.size() > maxNodes) {
+      return;
+    }
+    cut.swap(next);
+  }
+}
+
+// samples [first, first + spp) of pixel (x, y), added to the framebuffer
+void render_pixel(Scene &scene, Camera &camera, Sampler &sampler,
+                  Framebuffer &fb, int x, int y, int first, int spp) {
+  int index = y * fb.width + x;
+  for (int k = first; k < first + spp; k++) {
+    Vec3 jitter = sampler.get_2d(x, y, k, 0);
+    Ray r = camera.generate_ray(x + jitter.a, y + jitter.b);
+    fb.add(index, cal_color(scene, r));
+  }
+  fb.sampleNum[index] += spp;
+}
+
+// samples [first, first + spp) of the n pixels of fb, at most one ray batch,
+// fb covers the region of the image starting at (x0, y0). every sample of
+// the batch lies in its pixel rectangle, rays start from the part of the
+// tree the rectangle sees. the sums do not depend on how pixels are batched
+void render_batch(Scene &scene, Camera &camera, Sampler &sampler,
+                  Framebuffer &fb, const int *pixels, int n, int x0, int y0,
+                  int spp, int first) {
+  RayBatch batch;
+  double x[RAY_BATCH_SIZE], y[RAY_BATCH_SIZE];
+  int xMin = INT_MAX, yMin = INT_MAX, xMax = INT_MIN, yMax = INT_MIN;
+  for (int i = 0; i < n; i++) {
+    int px = x0 + pixels[i] % fb.width;
+    int py = y0 + pixels[i] / fb.width;
+    xMin = std::min(xMin, px);
+    yMin = std::min(yMin, py);
+    xMax = std::max(xMax, px + 1);
+    yMax = std::max(yMax, py + 1);
+  }
+  Frustum frustum(camera, xMin - RENDER_FRUSTUM_SLACK,
+                  yMin - RENDER_FRUSTUM_SLACK, xMax + RENDER_FRUSTUM_SLACK,
+                  yMax + RENDER_FRUSTUM_SLACK);
+  std::vector<Box *> nodes;
+  collect_cut(scene.root, frustum, nodes);
+  BoxBounds cut(nodes);
+
+  for (int k = first; k < first + spp; k++) {
+    for (int i = 0; i < n; i++) {
+      int px = x0 + pixels[i] % fb.width;
+      int py = y0 + pixels[i] / fb.width;
+      Vec3 jitter = sampler.get_2d(px, py, k, 0);
+      x[i] = px + jitter.a;
+      y[i] = py + jitter.b;
+    }
+    camera.generate_batch(x, y, n, batch);
+    for (int i = 0; i < n; i++) {
+      Ray r = batch.get_ray(i);
+      fb.add(pixels[i], cal_color(scene, cut, r));
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    fb.sampleNum[pixels[i]] += spp;
+  }
+}
+
+// samples [first, first + spp) of every pixel of the region of the image
+// starting at (x0, y0), fb only covers the region. pixels go tile by tile in
+// z-order, one batch per tile and sample index, tiles are spread over threads
+void render_region(Scene &scene, Camera &camera, Sampler &sampler,
+                   Framebuffer &fb, int x0, int y0, int spp, int first) {
+  std::vector<int> order =
+      tile_morton_order(fb.width, fb.height, RENDER_TILE_SIZE);
+  // tiles cut by the right or bottom edge hold fewer pixels, so split the
+  // order where the tile changes instead of every RAY_BATCH_SIZE entries,
+  // a batch spanning two tiles would get a frustum around both
+  int tileX = (fb.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+  std::vector<int> starts;
+  int lastTile = -1;
+  for (int i = 0; i < (int)order.size(); i++) {
+    int x = order[i] % fb.width, y = order[i] / fb.width;
+    int tile = y / RENDER_TILE_SIZE * tileX + x / RENDER_TILE_SIZE;
+    if (tile != lastTile || i - starts.back() == RAY_BATCH_SIZE) {
+      starts.push_back(i);
+      lastTile = tile;
+    }
+  }
+  starts.push_back(order.size());
+
+  parallel_for(0, (int)starts.size() - 1, [&](int b) {
+    render_batch(scene, camera, sampler, fb, &order[starts[b]],
+                 starts[b + 1] - starts[b], x0, y0, spp, first);
+  });
+}
+
+void render(Scene &scene, Camera &camera, Sampler &sampler, Framebuffer &fb,
+            int spp = RENDER_SPP, int first = 0) {
+  render_region(scene, camera, sampler, fb, 0, 0, spp, first);
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "parallel.h"
+#include "render.h"
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum ResampleFilter { FILTER_BOX, FILTER_MITCHELL, FILTER_LANCZOS };
+
+ResampleFilter get_resample_filter(const std::string &name) {
+  if (name == "box") {
+    return FILTER_BOX;
+  }
+  if (name == "lanczos") {
+    return FILTER_LANCZOS;
+  }
+  return FILTER_MITCHELL;
+}
+
+double filter_radius(ResampleFilter filter) {
+  return filter == FILTER_BOX ? 0.5 : filter == FILTER_MITCHELL ? 2 : 3;
+}
+
+double filter_weight(ResampleFilter filter, double x) {
+  x = fabs(x);
+  if (filter == FILTER_BOX) {
+    return x < 0.5 ? 1 : 0;
+  }
+  if (filter == FILTER_MITCHELL) {
+    // b = c = 1 / 3
+    if (x < 1) {
+      return (7 * x * x * x - 12 * x * x + 16.0 / 3) / 6;
+    }
+    if (x < 2) {
+      return (-7.0 / 3 * x * x * x + 12 * x * x - 20 * x + 32.0 / 3) / 6;
+    }
+    return 0;
+  }
+  if (x < 1e-8) {
+    return 1;
+  }
+  if (x >= 3) {
+    return 0;
+  }
+  double px = M_PI * x;
+  return 3 * sin(px) * sin(px / 3) / (px * px);
+}
+
+// 4 floats per pixel, rgb in linear light and alpha
+class LinearImage {
+public:
+  int width, height;
+  std::vector<float> data;
+
+  LinearImage() : width(0), height(0), data() {}
+
+  void resize(int iwidth, int iheight) {
+    width = iwidth;
+    height = iheight;
+    data.resize(width * height * 4);
+  }
+
+  float *row(int y) { return &data[y * width * 4]; }
+};
+
+// the framebuffer holds display values, filtering them directly would
+// darken every edge
+void to_linear(Framebuffer &fb, LinearImage &image) {
+  image.resize(fb.width, fb.height);
+  parallel_for(0, fb.height, [&](int y) {
+    for (int x = 0; x < fb.width; x++) {
+      Vec4 c = fb.get_color(x, y);
+      float *p = image.row(y) + x * 4;
+      p[0] = srgb_to_linear(c.a);
+      p[1] = srgb_to_linear(c.b);
+      p[2] = srgb_to_linear(c.c);
+      p[3] = c.d;
+    }
+  });
+}
+
+// the taps of every output pixel, taps past the border are folded onto the
+// edge pixel so each output reads one contiguous run of input
+class ResampleWeights {
+public:
+  std::vector<int> first, num, offset;
+  std::vector<float> weight;
+
+  ResampleWeights(ResampleFilter filter, int src, int dst) {
+    double scale = (double)src / dst;
+    double support = filter_radius(filter) * std::max(scale, 1.0);
+    double step = 1 / std::max(scale, 1.0);
+    for (int i = 0; i < dst; i++) {
+      double center = (i + 0.5) * scale - 0.5;
+      int lo = (int)ceil(center - support), hi = (int)floor(center + support);
+      int a = std::max(lo, 0), b = std::min(hi, src - 1);
+      std::vector<double> w(b - a + 1, 0);
+      double total = 0;
+      for (int j = lo; j <= hi; j++) {
+        double v = filter_weight(filter, (j - center) * step);
+        w[std::min(std::max(j, a), b) - a] += v;
+        total += v;
+      }
+      first.push_back(a);
+      num.push_back(w.size());
+      offset.push_back(weight.size());
+      for (double v : w) {
+        weight.push_back(total != 0 ? v / total : 0);
+      }
+    }
+  }
+};
+
+// out += w * in for n pixels, four lanes per pixel
+inline void accumulate(float *out, const float *in, float w, int n) {
+#ifdef __SSE2__
+  __m128 vw = _mm_set1_ps(w);
+  for (int i = 0; i < n; i++) {
+    __m128 o = _mm_loadu_ps(out + i * 4);
+    __m128 v = _mm_loadu_ps(in + i * 4);
+    _mm_storeu_ps(out + i * 4, _mm_add_ps(o, _mm_mul_ps(v, vw)));
+  }
+#else
+  for (int i = 0; i < n * 4; i++) {
+    out[i] += w * in[i];
+  }
+#endif
+}
+
+// separable filter, rows first into temp then columns into dst. temp is
+// kept by the caller so a whole size ladder reuses one buffer
+void resample(LinearImage &src, LinearImage &dst, ResampleFilter filter,
+              LinearImage &temp) {
+  ResampleWeights horizontal(filter, src.width, dst.width);
+  ResampleWeights vertical(filter, src.height, dst.height);
+  temp.resize(dst.width, src.height);
+
+  parallel_for(0, src.height, [&](int y) {
+    float *in = src.row(y), *out = temp.row(y);
+    memset(out, 0, dst.width * 4 * sizeof(float));
+    for (int x = 0; x < dst.width; x++) {
+      for (int k = 0; k < horizontal.num[x]; k++) {
+        accumulate(out + x * 4, in + (horizontal.first[x] + k) * 4,
+                   horizontal.weight[horizontal.offset[x] + k], 1);
+      }
+    }
+  });
+  parallel_for(0, dst.height, [&](int y) {
+    float *out = dst.row(y);
+    memset(out, 0, dst.width * 4 * sizeof(float));
+    for (int k = 0; k < vertical.num[y]; k++) {
+      accumulate(out, temp.row(vertical.first[y] + k),
+                 vertical.weight[vertical.offset[y] + k], dst.width);
+    }
+  });
+}
+
+// back to display values, one sample per pixel
+void to_framebuffer(LinearImage &image, Framebuffer &fb) {
+  for (int i = 0; i < image.width * image.height; i++) {
+    float *p = &image.data[i * 4];
+    fb.set(i,
+           Vec4(linear_to_srgb(p[0]), linear_to_srgb(p[1]),
+                linear_to_srgb(p[2]), p[3]),
+           1);
+  }
+}
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "cpu.h"
+#include "parallel.h"
+#include "sampler.h"
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// intervals of the linear to srgb table, a step is far below half a byte
+#define RESOLVE_SRGB_TABLE_SIZE 4096
+#define RESOLVE_BAYER_SIZE 8
+
+double srgb_to_linear(double c) {
+  return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+double linear_to_srgb(double c) {
+  c = c < 0 ? 0 : c > 1 ? 1 : c;
+  return c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1 / 2.4) - 0.055;
+}
+
+enum DitherType { DITHER_NONE, DITHER_ORDERED, DITHER_BLUE_NOISE };
+
+DitherType get_dither_type(const std::string &name) {
+  if (name == "ordered") {
+    return DITHER_ORDERED;
+  }
+  if (name == "blue_noise") {
+    return DITHER_BLUE_NOISE;
+  }
+  return DITHER_NONE;
+}
+
+// how float sums become bytes. the defaults give the bytes the ppm files
+// always had, the framebuffer already holds display values
+class ResolveOptions {
+public:
+  bool srgb; // encode linear rgb, alpha stays linear
+  DitherType dither;
+  bool alpha; // 4 bytes per pixel instead of 3
+
+  ResolveOptions() : srgb(false), dither(DITHER_NONE), alpha(false) {}
+};
+
+// linear to srgb by linear interpolation, the pow of every channel would
+// cost more than the rest of the resolve
+class SrgbTable {
+public:
+  static SrgbTable &get_instance() {
+    static SrgbTable table;
+    return table;
+  }
+
+  double encode(double c) {
+    c = c < 0 ? 0 : c > 1 ? 1 : c;
+    double f = c * RESOLVE_SRGB_TABLE_SIZE;
+    int i = (int)f;
+    if (i >= RESOLVE_SRGB_TABLE_SIZE) {
+      return value[RESOLVE_SRGB_TABLE_SIZE];
+    }
+    return value[i] + (value[i + 1] - value[i]) * (f - i);
+  }
+
+private:
+  std::vector<double> value;
+
+  SrgbTable() : value(RESOLVE_SRGB_TABLE_SIZE + 1) {
+    for (int i = 0; i <= RESOLVE_SRGB_TABLE_SIZE; i++) {
+      value[i] = linear_to_srgb((double)i / RESOLVE_SRGB_TABLE_SIZE);
+    }
+  }
+};
+
+// offsets in bytes added before rounding, one per pixel and shared by r, g
+// and b, between -0.5 and 0.5
+class DitherMask {
+public:
+  static DitherMask &get_instance(DitherType type) {
+    static DitherMask ordered(DITHER_ORDERED), blueNoise(DITHER_BLUE_NOISE);
+    return type == DITHER_ORDERED ? ordered : blueNoise;
+  }
+
+  // size entries, the row y repeats every size pixels
+  const double *row(int y) { return &value[(y & (size - 1)) * size]; }
+
+  int size;
+
+private:
+  std::vector<double> value;
+
+  DitherMask(DitherType type) {
+    size = type == DITHER_ORDERED ? RESOLVE_BAYER_SIZE : BLUE_NOISE_SIZE;
+    value.resize(size * size);
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        double t;
+        if (type == DITHER_ORDERED) {
+          // bayer index, low bits of x ^ y and y are the high bits of it
+          int v = 0;
+          for (int b = 0; b < 3; b++) {
+            v |= (((x ^ y) >> b) & 1) << (2 * (2 - b) + 1);
+            v |= ((y >> b) & 1) << (2 * (2 - b));
+          }
+          t = (v + 0.5) / (size * size);
+        } else {
+          t = BlueNoiseMask::get_instance().get(x, y);
+        }
+        value[y * size + x] = t - 0.5;
+      }
+    }
+  }
+};
+
+// one byte of a value already scaled to 0..255, ties away from zero like
+// round()
+inline unsigned char resolve_byte(double v) {
+  v = v < 0 ? 0 : v > 255 ? 255 : v;
+  int i = (int)v;
+  return (unsigned char)(v - i >= 0.5 ? i + 1 : i);
+}
+
+// one row of width pixels. sum holds 4 floats and sampleNum one count per
+// pixel, a pixel without samples is black and transparent. dither is null
+// or the offsets of the row, ditherMask wraps x into them. all the math is
+// in doubles like get_color, so every level gives the same bytes
+void resolve_row_scalar(const float *sum, const int *sampleNum, int width,
+                        unsigned char *out, int channelNum, bool srgb,
+                        const double *dither, int ditherMask) {
+  SrgbTable &table = SrgbTable::get_instance();
+  for (int x = 0; x < width; x++) {
+    double c[4] = {0, 0, 0, 0};
+    for (int k = 0; k < 4 && sampleNum[x] != 0; k++) {
+      c[k] = (double)sum[x * 4 + k] / sampleNum[x];
+    }
+    double d = dither == nullptr ? 0 : dither[x & ditherMask];
+    unsigned char *p = out + x * channelNum;
+    for (int k = 0; k < channelNum; k++) {
+      double v = srgb && k < 3 ? table.encode(c[k]) : c[k];
+      p[k] = resolve_byte(v * 255 + (k < 3 ? d : 0));
+    }
+  }
+}
+
+#ifdef CPU_DISPATCH
+// one pixel per two registers, rg and ba
+CPU_TARGET("sse2")
+void resolve_row_sse2(const float *sum, const int *sampleNum, int width,
+                      unsigned char *out, int channelNum, bool srgb,
+                      const double *dither, int ditherMask) {
+  SrgbTable &table = SrgbTable::get_instance();
+  const __m128d half = _mm_set1_pd(0.5), one = _mm_set1_pd(1);
+  const __m128d scale = _mm_set1_pd(255);
+  const __m128d zero = _mm_setzero_pd();
+  for (int x = 0; x < width; x++) {
+    __m128d c[2] = {zero, zero};
+    if (sampleNum[x] != 0) {
+      __m128 s = _mm_loadu_ps(sum + x * 4);
+      __m128d n = _mm_set1_pd(sampleNum[x]);
+      c[0] = _mm_div_pd(_mm_cvtps_pd(s), n);
+      c[1] = _mm_div_pd(_mm_cvtps_pd(_mm_movehl_ps(s, s)), n);
+    }
+    if (srgb) {
+      double v[4];
+      _mm_storeu_pd(v, c[0]);
+      _mm_storeu_pd(v + 2, c[1]);
+      c[0] = _mm_setr_pd(table.encode(v[0]), table.encode(v[1]));
+      c[1] = _mm_setr_pd(table.encode(v[2]), v[3]);
+    }
+    double d = dither == nullptr ? 0 : dither[x & ditherMask];
+    __m128d offset[2] = {_mm_set1_pd(d), _mm_setr_pd(d, 0)};
+    __m128i i[2];
+    for (int k = 0; k < 2; k++) {
+      __m128d v = _mm_add_pd(_mm_mul_pd(c[k], scale), offset[k]);
+      v = _mm_min_pd(_mm_max_pd(v, zero), scale);
+      __m128d t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(v));
+      t = _mm_add_pd(t, _mm_and_pd(_mm_cmpge_pd(_mm_sub_pd(v, t), half), one));
+      i[k] = _mm_cvttpd_epi32(t);
+    }
+    __m128i rgba = _mm_unpacklo_epi64(i[0], i[1]);
+    rgba = _mm_packus_epi16(_mm_packs_epi32(rgba, rgba), rgba);
+    int packed = _mm_cvtsi128_si32(rgba);
+    unsigned char *p = out + x * channelNum;
+    if (channelNum == 4 || x + 1 < width) {
+      // the 4th byte of rgb is written over by the next pixel
+      memcpy(p, &packed, 4);
+    } else {
+      memcpy(p, &packed, 3);
+    }
+  }
+}
+
+// one pixel per register, 4 doubles
+CPU_TARGET("avx2")
+void resolve_row_avx2(const float *sum, const int *sampleNum, int width,
+                      unsigned char *out, int channelNum, bool srgb,
+                      const double *dither, int ditherMask) {
+  SrgbTable &table = SrgbTable::get_instance();
+  const __m256d half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1);
+  const __m256d scale = _mm256_set1_pd(255);
+  const __m256d zero = _mm256_setzero_pd();
+  for (int x = 0; x < width; x++) {
+    __m256d c = zero;
+    if (sampleNum[x] != 0) {
+      c = _mm256_div_pd(_mm256_cvtps_pd(_mm_loadu_ps(sum + x * 4)),
+                        _mm256_set1_pd(sampleNum[x]));
+    }
+    if (srgb) {
+      double v[4];
+      _mm256_storeu_pd(v, c);
+      c = _mm256_setr_pd(table.encode(v[0]), table.encode(v[1]),
+                         table.encode(v[2]), v[3]);
+    }
+    c = _mm256_mul_pd(c, scale);
+    if (dither != nullptr) {
+      double d = dither[x & ditherMask];
+      c = _mm256_add_pd(c, _mm256_setr_pd(d, d, d, 0));
+    }
+    c = _mm256_min_pd(_mm256_max_pd(c, zero), scale);
+    __m256d t = _mm256_round_pd(c, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    t = _mm256_add_pd(
+        t, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(c, t), half, _CMP_GE_OQ),
+                         one));
+    __m128i i = _mm256_cvttpd_epi32(t);
+    i = _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+    int packed = _mm_cvtsi128_si32(i);
+    unsigned char *p = out + x * channelNum;
+    if (channelNum == 4 || x + 1 < width) {
+      memcpy(p, &packed, 4);
+    } else {
+      memcpy(p, &packed, 3);
+    }
+  }
+}
+#endif
+
+// row y of an image, by the kernel of the cpu level. avx512 hosts run the
+// avx2 kernel, a pixel fills only 4 lanes
+void resolve_row(const float *sum, const int *sampleNum, int width, int y,
+                 unsigned char *out, const ResolveOptions &options) {
+  int channelNum = options.alpha ? 4 : 3;
+  const double *dither = nullptr;
+  int ditherMask = 0;
+  if (options.dither != DITHER_NONE) {
+    DitherMask &mask = DitherMask::get_instance(options.dither);
+    dither = mask.row(y);
+    ditherMask = mask.size - 1;
+  }
+#ifdef CPU_DISPATCH
+  if (cpu_level() >= CPU_AVX2) {
+    resolve_row_avx2(sum, sampleNum, width, out, channelNum, options.srgb,
+                     dither, ditherMask);
+    return;
+  }
+  if (cpu_level() == CPU_SSE2) {
+    resolve_row_sse2(sum, sampleNum, width, out, channelNum, options.srgb,
+                     dither, ditherMask);
+    return;
+  }
+#endif
+  resolve_row_scalar(sum, sampleNum, width, out, channelNum, options.srgb,
+                     dither, ditherMask);
+}
+
+// every row of a width by height image into out, rows stride bytes apart
+void resolve_image(const float *sum, const int *sampleNum, int width,
+                   int height, unsigned char *out, size_t stride,
+                   const ResolveOptions &options) {
+  parallel_for(0, height, [&](int y) {
+    resolve_row(sum + (size_t)y * width * 4, sampleNum + (size_t)y * width,
+                width, y, out + y * stride, options);
+  });
+}
+
+#endif
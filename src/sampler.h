@@ -0,0 +1,315 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "vec.h"
+#include <string>
+#include <vector>
+
+// side of the tiled blue noise mask
+#define BLUE_NOISE_SIZE 64
+
+enum SamplerType {
+  SAMPLER_STRATIFIED,
+  SAMPLER_HALTON,
+  SAMPLER_SOBOL,
+  SAMPLER_BLUE_NOISE
+};
+
+inline unsigned hash_u32(unsigned x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+inline unsigned hash_combine(unsigned seed, unsigned v) {
+  return hash_u32(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+inline double to_unit(unsigned x) {
+  // 2^-32, never reaches 1
+  return x * (1.0 / 4294967296.0);
+}
+
+inline double fract(double x) { return x - floor(x); }
+
+// every value is a pure function of (seed, pixel, sample index, dimension),
+// no state is shared, so any thread can draw any sample in any order and the
+// image does not depend on the schedule
+class Sampler {
+public:
+  SamplerType type;
+  unsigned seed;
+
+  Sampler(SamplerType itype, unsigned iseed) : type(itype), seed(iseed) {}
+
+  virtual ~Sampler() {}
+
+  // point in [0, 1)^2, dimension selects an independent pair
+  virtual Vec3 get_2d(int x, int y, int index, int dimension) = 0;
+
+  // strata per pixel, 0 when the points do not depend on the spp the
+  // sampler was made for. with type and seed it decides every point
+  virtual int strata() { return 0; }
+
+protected:
+  unsigned pixel_seed(int x, int y, int dimension) {
+    return hash_combine(hash_combine(hash_combine(seed, x), y), dimension);
+  }
+};
+
+// jittered n x n grid, strata are visited in a per pixel order
+class StratifiedSampler : public Sampler {
+public:
+  StratifiedSampler(unsigned iseed, int spp)
+      : Sampler(SAMPLER_STRATIFIED, iseed) {
+    n = (int)sqrt((double)spp);
+    n = n > 0 ? n : 1;
+  }
+
+  Vec3 get_2d(int x, int y, int index, int dimension) {
+    unsigned s = pixel_seed(x, y, dimension);
+    int stratum = (index + s) % (n * n);
+    unsigned h = hash_combine(s, index);
+    return Vec3((stratum % n + to_unit(h)) / n,
+                (stratum / n + to_unit(hash_u32(h))) / n, 0);
+  }
+
+  int strata() { return n * n; }
+
+private:
+  int n;
+};
+
+// halton with a per pixel toroidal shift
+class HaltonSampler : public Sampler {
+public:
+  HaltonSampler(unsigned iseed) : Sampler(SAMPLER_HALTON, iseed) {}
+
+  Vec3 get_2d(int x, int y, int index, int dimension) {
+    static const int primes[] = {2,  3,  5,  7,  11, 13, 17, 19,
+                                 23, 29, 31, 37, 41, 43, 47, 53};
+    int d = dimension % 8;
+    unsigned s = pixel_seed(x, y, dimension);
+    return Vec3(fract(radical_inverse(primes[2 * d], index) + to_unit(s)),
+                fract(radical_inverse(primes[2 * d + 1], index) +
+                      to_unit(hash_u32(s))),
+                0);
+  }
+
+private:
+  static double radical_inverse(int base, unsigned index) {
+    double inv = 1.0 / base, f = inv, res = 0;
+    while (index > 0) {
+      res += (index % base) * f;
+      index /= base;
+      f *= inv;
+    }
+    return res;
+  }
+};
+
+// first two sobol dimensions with hash based owen scrambling, the index is
+// shuffled per pixel and each pair takes its own scramble
+class SobolSampler : public Sampler {
+public:
+  SobolSampler(unsigned iseed) : Sampler(SAMPLER_SOBOL, iseed) {}
+
+  Vec3 get_2d(int x, int y, int index, int dimension) {
+    unsigned s = pixel_seed(x, y, dimension);
+    unsigned i = nested_uniform_scramble(index, s);
+    return Vec3(to_unit(nested_uniform_scramble(reverse_bits(i),
+                                                hash_combine(s, 0))),
+                to_unit(nested_uniform_scramble(sobol_1(i),
+                                                hash_combine(s, 1))),
+                0);
+  }
+
+private:
+  static unsigned reverse_bits(unsigned x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  static unsigned sobol_1(unsigned index) {
+    unsigned res = 0;
+    for (unsigned v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+      if (index & 1) {
+        res ^= v;
+      }
+    }
+    return res;
+  }
+
+  static unsigned laine_karras_permutation(unsigned x, unsigned seed) {
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return x;
+  }
+
+  static unsigned nested_uniform_scramble(unsigned x, unsigned seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+  }
+};
+
+// ranks of a void and cluster mask, values are (rank + 0.5) / size^2
+class BlueNoiseMask {
+public:
+  static BlueNoiseMask &get_instance() {
+    static BlueNoiseMask mask;
+    return mask;
+  }
+
+  double get(int x, int y) {
+    return value[(y & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE +
+                 (x & (BLUE_NOISE_SIZE - 1))];
+  }
+
+private:
+  std::vector<double> value;
+  std::vector<double> energy;
+  std::vector<double> kernel;
+  std::vector<bool> pattern;
+
+  BlueNoiseMask() {
+    int n = BLUE_NOISE_SIZE, num = n * n;
+    value.assign(num, 0);
+    energy.assign(num, 0);
+    pattern.assign(num, false);
+
+    // toroidal gaussian, sigma 1.5
+    kernel.assign(num, 0);
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < n; j++) {
+        int dx = j < n / 2 ? j : n - j;
+        int dy = i < n / 2 ? i : n - i;
+        kernel[i * n + j] = exp(-(dx * dx + dy * dy) / (2 * 1.5 * 1.5));
+      }
+    }
+
+    // initial pattern, then move points from clusters to voids until stable
+    int ones = num / 10;
+    for (int i = 0, placed = 0; placed < ones; i++) {
+      int p = hash_u32(i) % num;
+      if (!pattern[p]) {
+        toggle(p);
+        placed++;
+      }
+    }
+    while (true) {
+      int cluster = find(true, true);
+      toggle(cluster);
+      int hole = find(false, false);
+      if (hole == cluster) {
+        toggle(cluster);
+        break;
+      }
+      toggle(hole);
+    }
+    std::vector<bool> initial = pattern;
+    std::vector<double> initialEnergy = energy;
+
+    // ranks below the initial pattern take its points out cluster first
+    for (int rank = ones - 1; rank >= 0; rank--) {
+      int cluster = find(true, true);
+      toggle(cluster);
+      value[cluster] = rank;
+    }
+
+    // the rest are filled in void first
+    pattern = initial;
+    energy = initialEnergy;
+    for (int rank = ones; rank < num; rank++) {
+      int hole = find(false, false);
+      toggle(hole);
+      value[hole] = rank;
+    }
+
+    for (int i = 0; i < num; i++) {
+      value[i] = (value[i] + 0.5) / num;
+    }
+  }
+
+  void toggle(int p) {
+    int n = BLUE_NOISE_SIZE;
+    double sign = pattern[p] ? -1 : 1;
+    pattern[p] = !pattern[p];
+    int px = p % n, py = p / n;
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < n; j++) {
+        int k = ((i - py + n) % n) * n + (j - px + n) % n;
+        energy[i * n + j] += sign * kernel[k];
+      }
+    }
+  }
+
+  // highest energy point that is set, or lowest energy point that is not
+  int find(bool set, bool highest) {
+    int res = -1;
+    for (int i = 0; i < (int)energy.size(); i++) {
+      if (pattern[i] != set) {
+        continue;
+      }
+      if (res < 0 || (highest ? energy[i] > energy[res]
+                              : energy[i] < energy[res])) {
+        res = i;
+      }
+    }
+    return res;
+  }
+};
+
+// r2 sequence shifted by the blue noise mask, the error between neighbor
+// pixels is decorrelated at high frequencies only
+class BlueNoiseSampler : public Sampler {
+public:
+  BlueNoiseSampler(unsigned iseed) : Sampler(SAMPLER_BLUE_NOISE, iseed) {}
+
+  Vec3 get_2d(int x, int y, int index, int dimension) {
+    BlueNoiseMask &mask = BlueNoiseMask::get_instance();
+    // each pair reads the mask at another toroidal offset
+    unsigned s = hash_combine(seed, dimension);
+    int ox = s % BLUE_NOISE_SIZE, oy = (s >> 8) % BLUE_NOISE_SIZE;
+    double a = mask.get(x + ox, y + oy);
+    double b = mask.get(x + ox + BLUE_NOISE_SIZE / 2, y + oy);
+    return Vec3(fract(a + 0.7548776662466927 * index),
+                fract(b + 0.5698402909980532 * index), 0);
+  }
+};
+
+Sampler *create_sampler(SamplerType type, unsigned seed, int spp) {
+  switch (type) {
+  case SAMPLER_STRATIFIED:
+    return new StratifiedSampler(seed, spp);
+  case SAMPLER_HALTON:
+    return new HaltonSampler(seed);
+  case SAMPLER_BLUE_NOISE:
+    return new BlueNoiseSampler(seed);
+  default:
+    return new SobolSampler(seed);
+  }
+}
+
+// stratified, halton, sobol or blue_noise, sobol for anything else
+SamplerType get_sampler_type(const std::string &name) {
+  if (name == "stratified") {
+    return SAMPLER_STRATIFIED;
+  }
+  if (name == "halton") {
+    return SAMPLER_HALTON;
+  }
+  if (name == "blue_noise") {
+    return SAMPLER_BLUE_NOISE;
+  }
+  return SAMPLER_SOBOL;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "refit.h"
+#include "render.h"
+
+// new samples for a pixel whose history survived reprojection
+#define SEQUENCE_REUSE_SPP 4
+// relative depth difference still treated as the same surface
+#define SEQUENCE_DEPTH_TOLERANCE 0.01
+// history further than this from the center sample of the pixel or of a
+// neighbor is a partly covered pixel, typically a glyph edge that moved
+#define SEQUENCE_COLOR_TOLERANCE 0.05
+
+class SequenceFrame {
+public:
+  Mat4x4 model;
+  Camera camera;
+  char glyph;
+
+  SequenceFrame(const Mat4x4 &imodel, const Camera &icamera, char iglyph)
+      : model(imodel), camera(icamera), glyph(iglyph) {}
+};
+
+// renders consecutive frames of one scene, pixels that still see the same
+// surface as in the previous frame keep its samples and only add a few
+class SequenceRenderer {
+public:
+  int spp, reuseSpp, maxHistory;
+  long reusedNum, rejectedNum;
+
+  // scene triangles must be in model space and already built
+  SequenceRenderer(Scene &iscene, Sampler &isampler, int ispp = RENDER_SPP)
+      : spp(ispp), reuseSpp(SEQUENCE_REUSE_SPP), maxHistory(ispp),
+        reusedNum(0), rejectedNum(0), scene(iscene), sampler(isampler),
+        refitter(iscene.triangles, iscene.root), frameNum(0),
+        last(nullptr), history(0, 0), historySurface() {
+    refitter.keep_rest();
+  }
+
+  ~SequenceRenderer() { delete last; }
+
+  void render_frame(SequenceFrame &frame, Framebuffer &fb) {
+    // the mesh goes from model space to this model every frame, refit is
+    // enough and no rounding carries over from earlier frames
+    refitter.place(frame.model);
+    Mat4x4 toObject = inverse_mat(frame.model);
+    scene.glyph = frame.glyph;
+
+    // a new glyph changes every textured surface
+    bool canReuse = last != nullptr && last->glyph == frame.glyph &&
+                    history.width == fb.width && history.height == fb.height;
+
+    fb.clear();
+    std::vector<Surface> surfaces(fb.width * fb.height);
+    std::vector<int> rowReusedNum(fb.height, 0);
+    // new samples of reused pixels must differ from the ones of last frame
+    int reuseFirst = spp + frameNum * reuseSpp;
+
+    std::vector<Vec4> centers(fb.width * fb.height);
+    parallel_for(0, fb.height, [&](int y) {
+      for (int x = 0; x < fb.width; x++) {
+        int index = y * fb.width + x;
+        Surface &surface = surfaces[index];
+        Ray r = frame.camera.generate_ray(x + 0.5, y + 0.5);
+        centers[index] = cal_color(scene, r, &surface);
+        if (surface.primitive >= 0) {
+          surface.point = toObject * surface.point;
+        }
+      }
+    });
+
+    parallel_for(0, fb.height, [&](int y) {
+      for (int x = 0; x < fb.width; x++) {
+        int index = y * fb.width + x;
+        int historyIndex;
+        if (canReuse && reproject(surfaces[index], x, y, historyIndex) &&
+            agree(centers, fb.width, x, y, history.get_color(historyIndex))) {
+          int weight = history.sampleNum[historyIndex] < maxHistory
+                           ? history.sampleNum[historyIndex]
+                           : maxHistory;
+          fb.set(index, history.get_color(historyIndex) * weight, weight);
+          render_pixel(scene, frame.camera, sampler, fb, x, y, reuseFirst,
+                       reuseSpp);
+          rowReusedNum[y]++;
+        } else {
+          render_pixel(scene, frame.camera, sampler, fb, x, y, 0, spp);
+        }
+      }
+    });
+    for (int y = 0; y < fb.height; y++) {
+      reusedNum += rowReusedNum[y];
+      rejectedNum += fb.width - rowReusedNum[y];
+    }
+    frameNum++;
+
+    history = fb;
+    historySurface.swap(surfaces);
+    delete last;
+    last = new SequenceFrame(frame);
+  }
+
+private:
+  Scene &scene;
+  Sampler &sampler;
+  BoxRefitter refitter;
+  int frameNum;
+  SequenceFrame *last;
+  Framebuffer history;
+  std::vector<Surface> historySurface;
+
+  static bool close_color(const Vec4 &c0, const Vec4 &c1) {
+    return fabs(c0.a - c1.a) <= SEQUENCE_COLOR_TOLERANCE &&
+           fabs(c0.b - c1.b) <= SEQUENCE_COLOR_TOLERANCE &&
+           fabs(c0.c - c1.c) <= SEQUENCE_COLOR_TOLERANCE;
+  }
+
+  // the center samples of this frame around (x, y) all close to color, an
+  // edge moving into the pixel shows up in one of them
+  static bool agree(std::vector<Vec4> &centers, int width, int x, int y,
+                    const Vec4 &color) {
+    int height = centers.size() / width;
+    for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1);
+         ny++) {
+      for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1);
+           nx++) {
+        if (!close_color(color, centers[ny * width + nx])) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // find the pixel of the last frame that saw the same surface point
+  bool reproject(Surface &surface, int x, int y, int &historyIndex) {
+    if (surface.primitive < 0) {
+      historyIndex = y * history.width + x;
+      return historySurface[historyIndex].primitive < 0 &&
+             history.sampleNum[historyIndex] > 0;
+    }
+
+    Vec3 world = last->model * surface.point;
+    double px, py;
+    if (!last->camera.project(world, px, py)) {
+      return false;
+    }
+    int ix = (int)floor(px), iy = (int)floor(py);
+    if (ix < 0 || iy < 0 || ix >= history.width || iy >= history.height) {
+      return false;
+    }
+    historyIndex = iy * history.width + ix;
+
+    // disocclusion shows up as another depth, ink changes as another
+    // sequence of layers, either would blend in a wrong color
+    Surface &old = historySurface[historyIndex];
+    double depth = (world - last->camera.pos).length();
+    return old.primitive >= 0 && old.layerNum == surface.layerNum &&
+           old.layerKey == surface.layerKey &&
+           fabs(depth - old.t) <= SEQUENCE_DEPTH_TOLERANCE * old.t &&
+           history.sampleNum[historyIndex] > 0;
+  }
+};
+
+#endif
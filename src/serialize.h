@@ -0,0 +1,227 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include "camera.h"
+#include "render.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// raw little helpers for messages and cache files, both ends are built from
+// the same source so values are stored in host layout
+class ByteWriter {
+public:
+  std::vector<char> data;
+
+  template <typename T> ByteWriter &put(const T &v) {
+    const char *p = (const char *)&v;
+    data.insert(data.end(), p, p + sizeof(T));
+    return *this;
+  }
+
+  ByteWriter &put(const void *p, int size) {
+    data.insert(data.end(), (const char *)p, (const char *)p + size);
+    return *this;
+  }
+
+  ByteWriter &put_vec3(const Vec3 &v) { return put(v.a).put(v.b).put(v.c); }
+
+  ByteWriter &put_vec4(const Vec4 &v) {
+    return put(v.a).put(v.b).put(v.c).put(v.d);
+  }
+
+  ByteWriter &put_string(const std::string &s) {
+    put((int)s.size());
+    return put(s.data(), s.size());
+  }
+};
+
+// reads past the end leave ok false and return zeros
+class ByteReader {
+public:
+  bool ok;
+
+  ByteReader(const char *idata, int isize)
+      : ok(true), data(idata), size(isize), pos(0) {}
+
+  ByteReader(const std::vector<char> &v)
+      : ok(true), data(v.empty() ? nullptr : &v[0]), size(v.size()),
+        pos(0) {}
+
+  template <typename T> T get() {
+    T v = T();
+    get(&v, sizeof(T));
+    return v;
+  }
+
+  void get(void *p, int n) {
+    if (!ok || pos + n > size) {
+      ok = false;
+      memset(p, 0, n);
+      return;
+    }
+    memcpy(p, data + pos, n);
+    pos += n;
+  }
+
+  Vec3 get_vec3() {
+    double a = get<double>(), b = get<double>(), c = get<double>();
+    return Vec3(a, b, c);
+  }
+
+  Vec4 get_vec4() {
+    double a = get<double>(), b = get<double>(), c = get<double>(),
+           d = get<double>();
+    return Vec4(a, b, c, d);
+  }
+
+  std::string get_string() {
+    int n = get<int>();
+    if (!ok || n < 0 || pos + n > size) {
+      ok = false;
+      return std::string();
+    }
+    std::string s(data + pos, n);
+    pos += n;
+    return s;
+  }
+
+  bool end() { return pos == size; }
+
+private:
+  const char *data;
+  int size, pos;
+};
+
+void write_camera(ByteWriter &writer, Camera &camera) {
+  writer.put_vec3(camera.pos).put_vec3(camera.look).put_vec3(camera.up);
+  writer.put(camera.planeDistance).put(camera.planeSize);
+  writer.put(camera.width).put(camera.height);
+}
+
+Camera read_camera(ByteReader &reader) {
+  Vec3 pos = reader.get_vec3();
+  Vec3 look = reader.get_vec3();
+  Vec3 up = reader.get_vec3();
+  double planeDistance = reader.get<double>();
+  double planeSize = reader.get<double>();
+  int width = reader.get<int>();
+  int height = reader.get<int>();
+  return Camera(pos, look, up, planeDistance, planeSize, width, height);
+}
+
+void write_palette(ByteWriter &writer, Palette &palette) {
+  writer.put_vec4(palette.background).put_vec4(palette.ink);
+  writer.put_vec4(palette.paper);
+}
+
+Palette read_palette(ByteReader &reader) {
+  Palette palette;
+  palette.background = reader.get_vec4();
+  palette.ink = reader.get_vec4();
+  palette.paper = reader.get_vec4();
+  return palette;
+}
+
+void write_shading(ByteWriter &writer, Shading &shading) {
+  writer.put(shading.shadow).put_vec3(shading.light).put(shading.aoRayNum);
+  writer.put(shading.aoDistance).put(shading.ambient);
+}
+
+Shading read_shading(ByteReader &reader) {
+  Shading shading;
+  shading.shadow = reader.get<bool>();
+  shading.light = reader.get_vec3();
+  shading.aoRayNum = reader.get<int>();
+  shading.aoDistance = reader.get<double>();
+  shading.ambient = reader.get<double>();
+  return shading;
+}
+
+// triangles, glyph, palette and shading, the tree is rebuilt after reading
+void write_scene(ByteWriter &writer, Scene &scene) {
+  writer.put((int)scene.triangles.size());
+  for (Triangle &t : scene.triangles) {
+    writer.put_vec3(t.v0).put_vec3(t.v1).put_vec3(t.v2);
+    writer.put_vec3(t.t_v0).put_vec3(t.t_v1).put_vec3(t.t_v2);
+  }
+  writer.put((int)scene.rects.size());
+  for (Rect &q : scene.rects) {
+    writer.put(q.axis).put(q.plane).put(q.min[0]).put(q.min[1]);
+    writer.put(q.max[0]).put(q.max[1]).put_vec3(q.t_min).put_vec3(q.t_max);
+  }
+  writer.put(scene.glyph);
+  write_palette(writer, scene.palette);
+  write_shading(writer, scene.shading);
+}
+
+bool read_scene(ByteReader &reader, Scene &scene) {
+  int n = reader.get<int>();
+  scene.triangles.clear();
+  for (int i = 0; i < n && reader.ok; i++) {
+    Vec3 v0 = reader.get_vec3(), v1 = reader.get_vec3(),
+         v2 = reader.get_vec3();
+    Vec3 t0 = reader.get_vec3(), t1 = reader.get_vec3(),
+         t2 = reader.get_vec3();
+    scene.triangles.push_back(
+        Triangle(v0, v1, v2).set_texture_coor(t0, t1, t2));
+  }
+  n = reader.get<int>();
+  scene.rects.clear();
+  for (int i = 0; i < n && reader.ok; i++) {
+    int axis = reader.get<int>();
+    double plane = reader.get<double>();
+    double u0 = reader.get<double>(), v0 = reader.get<double>(),
+           u1 = reader.get<double>(), v1 = reader.get<double>();
+    Vec3 t0 = reader.get_vec3(), t1 = reader.get_vec3();
+    if (axis < 0 || axis > 2) {
+      return false;
+    }
+    scene.rects.push_back(
+        Rect(axis, plane, u0, v0, u1, v1).set_texture_coor(t0, t1));
+  }
+  scene.glyph = reader.get<char>();
+  scene.palette = read_palette(reader);
+  scene.shading = read_shading(reader);
+  return reader.ok;
+}
+
+// written under a name of its own and renamed, readers see the old file or
+// the whole new one even with several writers
+bool write_file(const std::string &path, const std::vector<char> &data) {
+  static std::atomic<int> tmpNum(0);
+  std::string tmpPath = path + ".tmp" + std::to_string((int)getpid()) + "_" +
+                        std::to_string(tmpNum++);
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok =
+      data.empty() || fwrite(&data[0], 1, data.size(), file) == data.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool read_file(const std::string &path, std::vector<char> &data) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  data.clear();
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  return true;
+}
+
+#endif
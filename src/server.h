@@ -0,0 +1,435 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "avatar.h"
+#include "cache.h"
+#include "render.h"
+#include "sampler.h"
+#include "serialize.h"
+#include "socket.h"
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <thread>
+
+#define SERVER_MAX_SIZE 1024
+#define SERVER_MAX_SPP 256
+// size * size * spp of one request, 512 pixels at 256 spp or 1024 at 64
+#define SERVER_MAX_SAMPLES (1 << 26)
+// requests are small, a larger message is a broken client
+#define SERVER_MAX_MESSAGE 1024
+// bytes read from a connection each time poll finds it readable
+#define SERVER_READ_CHUNK 4096
+// seconds a reply may wait on a client that does not read it
+#define SERVER_SEND_TIMEOUT 2
+// latency buckets grow by SERVER_LATENCY_GROWTH from SERVER_LATENCY_FIRST ms
+#define SERVER_LATENCY_BUCKET_NUM 64
+#define SERVER_LATENCY_FIRST 0.1
+#define SERVER_LATENCY_GROWTH 1.2
+
+// kept apart from the distributed message types, both may share a port
+enum ServerMessageType {
+  SERVER_RENDER = 16,
+  SERVER_IMAGE,
+  SERVER_STATS,
+  SERVER_ERROR
+};
+
+class RenderRequest {
+public:
+  char glyph;
+  int size, spp;
+  Palette palette;
+
+  RenderRequest() : glyph('a'), size(128), spp(RENDER_SPP), palette() {}
+
+  bool same(const RenderRequest &r) const {
+    const Vec4 *p[3] = {&palette.background, &palette.ink, &palette.paper};
+    const Vec4 *q[3] = {&r.palette.background, &r.palette.ink,
+                        &r.palette.paper};
+    for (int i = 0; i < 3; i++) {
+      if (p[i]->a != q[i]->a || p[i]->b != q[i]->b || p[i]->c != q[i]->c ||
+          p[i]->d != q[i]->d) {
+        return false;
+      }
+    }
+    return glyph == r.glyph && size == r.size && spp == r.spp;
+  }
+};
+
+void write_render_request(ByteWriter &writer, RenderRequest &request) {
+  writer.put(request.glyph).put(request.size).put(request.spp);
+  write_palette(writer, request.palette);
+}
+
+bool read_render_request(ByteReader &reader, RenderRequest &request) {
+  request.glyph = reader.get<char>();
+  request.size = reader.get<int>();
+  request.spp = reader.get<int>();
+  request.palette = read_palette(reader);
+  // the glyph byte comes from the client, only letters have a font
+  return reader.ok && reader.end() && isalpha((unsigned char)request.glyph) &&
+         request.size > 0 && request.size <= SERVER_MAX_SIZE &&
+         request.spp > 0 && request.spp <= SERVER_MAX_SPP &&
+         (long)request.size * request.size * request.spp <=
+             SERVER_MAX_SAMPLES;
+}
+
+// log spaced buckets, percentiles are reported as the bucket upper bound
+class LatencyHistogram {
+public:
+  long count[SERVER_LATENCY_BUCKET_NUM];
+  long total;
+  double maxMs;
+
+  LatencyHistogram() : total(0), maxMs(0) {
+    std::fill(count, count + SERVER_LATENCY_BUCKET_NUM, 0);
+  }
+
+  static double bound(int i) {
+    return SERVER_LATENCY_FIRST * pow(SERVER_LATENCY_GROWTH, i);
+  }
+
+  void add(double ms) {
+    int i = 0;
+    while (i < SERVER_LATENCY_BUCKET_NUM - 1 && ms > bound(i)) {
+      i++;
+    }
+    count[i]++;
+    total++;
+    maxMs = std::max(maxMs, ms);
+  }
+
+  double percentile(double p) {
+    long rank = (long)ceil(p * total), seen = 0;
+    for (int i = 0; i < SERVER_LATENCY_BUCKET_NUM; i++) {
+      seen += count[i];
+      if (seen >= rank && seen > 0) {
+        return std::min(bound(i), maxMs);
+      }
+    }
+    return 0;
+  }
+
+  std::string report() {
+    std::ostringstream s;
+    s.precision(3);
+    s << std::fixed << "latency ms n " << total << " p50 " << percentile(0.5)
+      << " p90 " << percentile(0.9) << " p99 " << percentile(0.99) << " max "
+      << maxMs << "\n";
+    for (int i = 0; i < SERVER_LATENCY_BUCKET_NUM; i++) {
+      if (count[i] > 0) {
+        s << "<= " << bound(i) << " " << count[i] << "\n";
+      }
+    }
+    return s.str();
+  }
+};
+
+// closed when the last owner lets go, so a reply to a client that has just
+// hung up never lands on a reused descriptor
+class ServerConnection {
+public:
+  int fd;
+  std::mutex writeMutex;
+  std::vector<char> input; // bytes of a message still coming, poll thread
+  std::atomic<bool> broken;
+
+  ServerConnection(int ifd) : fd(ifd), broken(false) {
+    timeval timeout = {SERVER_SEND_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  ~ServerConnection() { close(fd); }
+
+  // a reply that does not go out within the send timeout leaves half a
+  // message behind, the connection is shut down so the poll thread drops
+  // it and later replies do not wait on it again
+  bool write(int type, const std::vector<char> &payload) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    if (broken) {
+      return false;
+    }
+    if (!write_message(fd, type, payload)) {
+      broken = true;
+      shutdown(fd, SHUT_RDWR);
+      return false;
+    }
+    return true;
+  }
+
+  // one chunk of what has arrived, never waits. false once the client has
+  // hung up
+  bool fill() {
+    char data[SERVER_READ_CHUNK];
+    ssize_t n = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+    if (n > 0) {
+      input.insert(input.end(), data, data + n);
+      return true;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+  }
+};
+
+class PendingRequest {
+public:
+  std::shared_ptr<ServerConnection> connection;
+  RenderRequest request;
+  std::chrono::steady_clock::time_point receiveTime;
+};
+
+volatile sig_atomic_t serverStop = 0;
+
+void server_stop_handler(int) { serverStop = 1; }
+
+// keeps the avatar scene, its tree and the fonts loaded between requests.
+// the calling thread does the socket work and only reads what has arrived,
+// one render thread takes every queued request at once and renders
+// identical ones a single time, each render is spread over the shared
+// thread pool. finished images are cached, a request seen before is a
+// lookup. requests still queued when the server stops get an error
+class RenderServer {
+public:
+  long requestNum, renderNum, batchNum;
+
+  RenderServer(const std::string &iaddress, SamplerType isamplerType,
+               unsigned iseed,
+               const std::string &cacheDirectory = std::string())
+      : requestNum(0), renderNum(0), batchNum(0), address(iaddress),
+        listenFd(listen_socket(iaddress)), samplerType(isamplerType),
+        seed(iseed), stopping(false),
+        cache(CACHE_MEMORY_BUDGET, cacheDirectory) {
+    Mat4x4 mat = avatar_transform();
+    generate_avatar_cube(scene.triangles, mat);
+    scene.build();
+    Fonts::get_instance();
+    ThreadPool::get_instance();
+  }
+
+  ~RenderServer() {
+    if (listenFd >= 0) {
+      close(listenFd);
+    }
+    if (address.compare(0, 5, "unix:") == 0) {
+      unlink(address.substr(5).c_str());
+    }
+    for (auto &sampler : samplers) {
+      delete sampler.second;
+    }
+  }
+
+  bool ok() { return listenFd >= 0; }
+
+  // until serverStop is set or stop is called
+  void run() {
+    std::thread renderThread([this]() { render_loop(); });
+    std::map<int, std::shared_ptr<ServerConnection>> connections;
+    while (!serverStop) {
+      std::vector<pollfd> fds(1);
+      fds[0].fd = listenFd;
+      fds[0].events = POLLIN;
+      for (auto &connection : connections) {
+        pollfd p;
+        p.fd = connection.first;
+        p.events = POLLIN;
+        fds.push_back(p);
+      }
+      if (poll(&fds[0], fds.size(), 100) <= 0) {
+        continue;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd >= 0) {
+          connections[fd] = std::make_shared<ServerConnection>(fd);
+        }
+      }
+      for (int i = 1; i < (int)fds.size(); i++) {
+        if (fds[i].revents != 0 && !receive(connections[fds[i].fd])) {
+          connections.erase(fds[i].fd);
+        }
+      }
+    }
+
+    stop();
+    renderThread.join();
+  }
+
+  // run returns soon after, requests the render thread has not taken yet
+  // get an error from it
+  void stop() {
+    serverStop = 1;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+  }
+
+  std::string stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ostringstream s;
+    s << "requests " << requestNum << " renders " << renderNum << " batches "
+      << batchNum << "\n"
+      << cache.stats() << latency.report();
+    return s.str();
+  }
+
+private:
+  std::string address;
+  int listenFd;
+  SamplerType samplerType;
+  unsigned seed;
+  Scene scene;
+  std::map<int, Sampler *> samplers; // by spp, only the render thread
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<PendingRequest> queue;
+  bool stopping;
+  LatencyHistogram latency;
+  RenderCache cache;
+
+  // every whole message that has arrived on connection, a message split
+  // over reads waits in its buffer. false when the client is gone or talks
+  // nonsense
+  bool receive(std::shared_ptr<ServerConnection> &connection) {
+    bool open = connection->fill();
+    int type;
+    std::vector<char> payload;
+    bool broken = false;
+    while (take_message(connection->input, SERVER_MAX_MESSAGE, type, payload,
+                        broken)) {
+      if (!handle(connection, type, payload)) {
+        return false;
+      }
+    }
+    if (broken) {
+      reply_error(connection, "bad request");
+    }
+    return open && !broken && !connection->broken;
+  }
+
+  static void reply_error(std::shared_ptr<ServerConnection> &connection,
+                          const std::string &s) {
+    connection->write(SERVER_ERROR, std::vector<char>(s.begin(), s.end()));
+  }
+
+  bool handle(std::shared_ptr<ServerConnection> &connection, int type,
+              std::vector<char> &payload) {
+    if (type == SERVER_STATS) {
+      std::string s = stats();
+      return connection->write(SERVER_STATS,
+                               std::vector<char>(s.begin(), s.end()));
+    }
+
+    PendingRequest pending;
+    ByteReader reader(payload);
+    if (type != SERVER_RENDER ||
+        !read_render_request(reader, pending.request)) {
+      reply_error(connection, "bad request");
+      return false;
+    }
+    pending.connection = connection;
+    pending.receiveTime = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(pending);
+      requestNum++;
+    }
+    ready.notify_one();
+    return true;
+  }
+
+  void render_loop() {
+    while (true) {
+      std::deque<PendingRequest> batch;
+      bool stop;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+        stop = stopping;
+        batch.swap(queue);
+        batchNum += !stop;
+      }
+      if (stop) {
+        for (PendingRequest &pending : batch) {
+          reply_error(pending.connection, "server stopping");
+        }
+        return;
+      }
+
+      while (!batch.empty()) {
+        RenderRequest request = batch.front().request;
+        std::vector<char> image = render(request);
+        for (auto it = batch.begin(); it != batch.end();) {
+          if (!it->request.same(request)) {
+            ++it;
+            continue;
+          }
+          it->connection->write(SERVER_IMAGE, image);
+          std::chrono::duration<double, std::milli> ms =
+              std::chrono::steady_clock::now() - it->receiveTime;
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            latency.add(ms.count());
+          }
+          it = batch.erase(it);
+        }
+      }
+    }
+  }
+
+  std::vector<char> render(RenderRequest &request) {
+    Sampler *&sampler = samplers[request.spp];
+    if (sampler == nullptr) {
+      sampler = create_sampler(samplerType, seed, request.spp);
+    }
+    scene.glyph = request.glyph;
+    scene.palette = request.palette;
+    Camera camera = avatar_camera(request.size);
+    std::string key = render_key(scene, camera, *sampler, request.spp, true);
+    std::vector<char> image;
+    if (cache.get(key, image)) {
+      return image;
+    }
+
+    Framebuffer fb(request.size, request.size);
+    ::render(scene, camera, *sampler, fb, request.spp);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      renderNum++;
+    }
+    image = fb.encode_ppm();
+    cache.put(key, image);
+    return image;
+  }
+};
+
+// client side, one request and its reply on an open connection
+bool request_render(int fd, RenderRequest &request, std::vector<char> &image) {
+  ByteWriter writer;
+  write_render_request(writer, request);
+  int type;
+  return write_message(fd, SERVER_RENDER, writer.data) &&
+         read_message(fd, type, image) && type == SERVER_IMAGE;
+}
+
+bool request_stats(int fd, std::string &stats) {
+  int type;
+  std::vector<char> payload;
+  if (!write_message(fd, SERVER_STATS, std::vector<char>()) ||
+      !read_message(fd, type, payload) || type != SERVER_STATS) {
+    return false;
+  }
+  stats.assign(payload.begin(), payload.end());
+  return true;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// messages larger than this are treated as a broken peer
+#define MESSAGE_MAX_SIZE (1 << 28)
+
+// address is "unix:/path/to/socket" or "tcp:host:port", -1 on failure
+int open_socket(const std::string &address, bool server) {
+  if (address.compare(0, 5, "unix:") == 0) {
+    std::string path = address.substr(5);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (server) {
+      unlink(path.c_str());
+      if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+          listen(fd, 64) == 0) {
+        return fd;
+      }
+    } else if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (address.compare(0, 4, "tcp:") != 0) {
+    return -1;
+  }
+  std::string hostPort = address.substr(4);
+  size_t colon = hostPort.rfind(':');
+  if (colon == std::string::npos) {
+    return -1;
+  }
+  std::string host = hostPort.substr(0, colon);
+  std::string port = hostPort.substr(colon + 1);
+
+  addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = server ? AI_PASSIVE : 0;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints,
+                  &res) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo *p = res; p != nullptr && fd < 0; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    bool ok;
+    if (server) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      ok = bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, 64) == 0;
+    } else {
+      ok = connect(fd, p->ai_addr, p->ai_addrlen) == 0;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (!ok) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int listen_socket(const std::string &address) {
+  return open_socket(address, true);
+}
+
+int connect_socket(const std::string &address) {
+  return open_socket(address, false);
+}
+
+// a dead peer makes these return false, never raise SIGPIPE
+bool send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool recv_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = recv(fd, data, size, 0);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// a message is a 4 byte type, a 4 byte payload size and the payload
+bool write_message(int fd, int type, const std::vector<char> &payload) {
+  unsigned header[2] = {(unsigned)type, (unsigned)payload.size()};
+  return send_all(fd, (const char *)header, sizeof(header)) &&
+         (payload.empty() || send_all(fd, &payload[0], payload.size()));
+}
+
+bool read_message(int fd, int &type, std::vector<char> &payload) {
+  unsigned header[2];
+  if (!recv_all(fd, (char *)header, sizeof(header)) ||
+      header[1] > MESSAGE_MAX_SIZE) {
+    return false;
+  }
+  type = header[0];
+  payload.resize(header[1]);
+  return header[1] == 0 || recv_all(fd, &payload[0], header[1]);
+}
+
+// for readers that collect bytes as they arrive, takes the first message
+// off the front of buffer. false while it is incomplete, and with broken
+// set when its size is past maxSize
+bool take_message(std::vector<char> &buffer, size_t maxSize, int &type,
+                  std::vector<char> &payload, bool &broken) {
+  unsigned header[2];
+  if (buffer.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(header, &buffer[0], sizeof(header));
+  if (header[1] > maxSize) {
+    broken = true;
+    return false;
+  }
+  size_t end = sizeof(header) + header[1];
+  if (buffer.size() < end) {
+    return false;
+  }
+  type = header[0];
+  payload.assign(buffer.begin() + sizeof(header), buffer.begin() + end);
+  buffer.erase(buffer.begin(), buffer.begin() + end);
+  return true;
+}
+
+#endif
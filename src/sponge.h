@@ -0,0 +1,203 @@
+#ifndef SPONGE_H
+#define SPONGE_H
+
+#include "render.h"
+
+// a surface of the sponge crossed by a ray, normal faces the ray origin and
+// the texture coordinates span each side of the sponge once, like a face of
+// the avatar cube
+class SpongeHit {
+public:
+  double t;
+  Vec3 point, normal, textureCoor;
+};
+
+// the menger sponge in the cube [min, min + size] cut level times, traced
+// without a mesh: a dda walks the 3x3x3 cells of every solid cell the ray
+// goes through, removed cells are stepped over whole. memory does not grow
+// with level. cells smaller than footprint * t, about a pixel when
+// footprint is the pixel size over the plane distance, count as solid
+class MengerSponge {
+public:
+  Vec3 min;
+  double size;
+  int level;
+  double footprint;
+
+  MengerSponge(const Vec3 &imin, double isize, int ilevel,
+               double ifootprint = 0)
+      : min(imin), size(isize), level(ilevel), footprint(ifootprint) {}
+
+  // visit(SpongeHit &) for every entry into or exit out of the solid along
+  // r with t > 0, near to far
+  template <typename F> void trace(const Ray &r, F visit) {
+    Walk walk = {{r.origin.a, r.origin.b, r.origin.c},
+                 {r.direction.a, r.direction.b, r.direction.c},
+                 false};
+    double lo[3] = {min.a, min.b, min.c};
+    double t0 = 0, t1 = DBL_MAX;
+    int entry = -1, exit = -1;
+    for (int i = 0; i < 3; i++) {
+      if (walk.d[i] == 0) {
+        if (walk.o[i] < lo[i] || walk.o[i] > lo[i] + size) {
+          return;
+        }
+        continue;
+      }
+      double a = (lo[i] - walk.o[i]) / walk.d[i];
+      double b = (lo[i] + size - walk.o[i]) / walk.d[i];
+      if (a > b) {
+        std::swap(a, b);
+      }
+      if (a > t0) {
+        t0 = a;
+        entry = i;
+      }
+      if (b < t1) {
+        t1 = b;
+        exit = i;
+      }
+    }
+    if (t0 >= t1) {
+      return;
+    }
+    cell(walk, lo, size, 0, t0, t1, entry, visit);
+    if (walk.inside) {
+      emit(walk, t1, exit, visit);
+    }
+  }
+
+private:
+  struct Walk {
+    double o[3], d[3];
+    bool inside;
+  };
+
+  // the ray is in the cell [lo, lo + cellSize] over [ta, tb], having come
+  // in through a side facing axis, -1 when it starts inside
+  template <typename F>
+  void cell(Walk &walk, double *lo, double cellSize, int depth, double ta,
+            double tb, int axis, F &visit) {
+    if (depth == level || cellSize < footprint * ta) {
+      if (!walk.inside) {
+        emit(walk, ta, axis, visit);
+        walk.inside = true;
+      }
+      return;
+    }
+    double sub = cellSize / 3;
+    int index[3], step[3];
+    double tNext[3];
+    for (int i = 0; i < 3; i++) {
+      double d = walk.d[i];
+      step[i] = d > 0 ? 1 : -1;
+      if (i == axis) {
+        index[i] = d > 0 ? 0 : 2;
+      } else {
+        double p = walk.o[i] + d * ta;
+        index[i] = std::min(std::max((int)floor((p - lo[i]) / sub), 0), 2);
+      }
+      tNext[i] = boundary(walk, lo, sub, index, i);
+    }
+
+    double t = ta;
+    while (true) {
+      int next = tNext[0] < tNext[1] ? 0 : 1;
+      next = tNext[2] < tNext[next] ? 2 : next;
+      double tEnd = std::min(tNext[next], tb);
+      if (tEnd > t) {
+        int centers = (index[0] == 1) + (index[1] == 1) + (index[2] == 1);
+        if (centers >= 2) {
+          // removed, the tunnel through the middle of the cell
+          if (walk.inside) {
+            emit(walk, t, axis, visit);
+            walk.inside = false;
+          }
+        } else {
+          double subLo[3] = {lo[0] + index[0] * sub, lo[1] + index[1] * sub,
+                             lo[2] + index[2] * sub};
+          cell(walk, subLo, sub, depth + 1, t, tEnd, axis, visit);
+        }
+      }
+      if (tNext[next] >= tb) {
+        return;
+      }
+      index[next] += step[next];
+      if (index[next] < 0 || index[next] > 2) {
+        return;
+      }
+      t = std::max(t, tNext[next]);
+      axis = next;
+      tNext[next] = boundary(walk, lo, sub, index, next);
+    }
+  }
+
+  // where the ray leaves cell index along axis i, from the grid itself so
+  // no error builds up over the steps
+  static double boundary(Walk &walk, double *lo, double sub, int *index,
+                         int i) {
+    double d = walk.d[i];
+    if (d == 0) {
+      return DBL_MAX;
+    }
+    double plane = lo[i] + (index[i] + (d > 0 ? 1 : 0)) * sub;
+    return (plane - walk.o[i]) / d;
+  }
+
+  template <typename F>
+  void emit(Walk &walk, double t, int axis, F &visit) {
+    if (t <= 0 || axis < 0) {
+      return;
+    }
+    SpongeHit hit;
+    hit.t = t;
+    double p[3], n[3] = {0, 0, 0}, lo[3] = {min.a, min.b, min.c};
+    for (int i = 0; i < 3; i++) {
+      p[i] = walk.o[i] + walk.d[i] * t;
+    }
+    n[axis] = walk.d[axis] > 0 ? -1 : 1;
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    hit.point = Vec3(p[0], p[1], p[2]);
+    hit.normal = Vec3(n[0], n[1], n[2]);
+    hit.textureCoor =
+        Vec3((p[u] - lo[u]) / size, (p[v] - lo[v]) / size, 0);
+    visit(hit);
+  }
+};
+
+Vec4 cal_color(Scene &scene, MengerSponge &sponge, Ray &r,
+               Surface *surface = nullptr) {
+  std::vector<TransparentColor> colors;
+  sponge.trace(r, [&](SpongeHit &hit) {
+    bool inked = glyph_inked(hit.textureCoor, scene.glyph);
+    colors.push_back(TransparentColor(
+        inked ? scene.palette.ink : scene.palette.paper, hit.t, inked));
+    if (surface != nullptr && hit.t < surface->t) {
+      surface->t = hit.t;
+      surface->primitive = 0;
+      surface->inked = inked;
+      surface->point = hit.point;
+    }
+  });
+  return composite(scene, colors, surface);
+}
+
+// samples [first, first + spp) of every pixel, like render but with the
+// sponge as the only geometry
+void render_sponge(Scene &scene, MengerSponge &sponge, Camera &camera,
+                   Sampler &sampler, Framebuffer &fb, int spp = RENDER_SPP,
+                   int first = 0) {
+  parallel_for(0, fb.height, [&](int y) {
+    for (int x = 0; x < fb.width; x++) {
+      int index = y * fb.width + x;
+      for (int k = first; k < first + spp; k++) {
+        Vec3 jitter = sampler.get_2d(x, y, k, 0);
+        Ray r = camera.generate_ray(x + jitter.a, y + jitter.b);
+        fb.add(index, cal_color(scene, sponge, r));
+      }
+      fb.sampleNum[index] += spp;
+    }
+  });
+}
+
+#endif
@@ -1,13 +1,1277 @@
+#include "avatar.h"
+#include "cache.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "incremental.h"
+#include "myavatar.h"
+#include "progressive.h"
+#include "qbvh.h"
+#include "raster.h"
+#include "refit.h"
+#include "resample.h"
+#include "sequence.h"
+#include "server.h"
+#include "sponge.h"
 #include "test.h"
+#include "treelet.h"
 #include "vec.h"
+#include "wavefront.h"
+#include <chrono>
+#include <cstdlib>
+#include <dlfcn.h>
 #include <iostream>
+#include <thread>
 using namespace std;
 
+// casts a grid of rays at the tree with intersect(ray, count) and returns
+// the number of triangle hits, which every layout of the same geometry must
+// agree on. bench_layout also prints the tree memory and Mrays/s, which go
+// to speed
+template <typename F> long trace_grid(F intersect) {
+  Camera camera(Vec3(2.5, 1.8, 3), Vec3(0.5, 0.5, 0.5), Vec3(0, 1, 0), 1, 1,
+                64, 64);
+  long hitNum = 0;
+  for (int y = 0; y < 64; y++) {
+    for (int x = 0; x < 64; x++) {
+      Ray r = camera.generate_ray(x + 0.5, y + 0.5);
+      intersect(r, hitNum);
+    }
+  }
+  return hitNum;
+}
+
+template <typename F>
+long bench_layout(const char *name, size_t memory, F intersect,
+                  double *speed = nullptr) {
+  auto start = chrono::steady_clock::now();
+  long hitNum = trace_grid(intersect);
+  chrono::duration<double> s = chrono::steady_clock::now() - start;
+  cout << name << " memory " << memory << " Mrays/s "
+       << 64 * 64 / s.count() / 1e6 << " hits " << hitNum << endl;
+  if (speed != nullptr) {
+    *speed = 64 * 64 / s.count() / 1e6;
+  }
+  return hitNum;
+}
+
+void count_hit(Triangle *p, Ray &r, long &hitNum) {
+  double t;
+  if (p->interset(r, t) && t > 0) {
+    Vec3 point = r.origin + r.direction * t;
+    hitNum += p->contain(point);
+  }
+}
+
+void count_hit(Rect *q, Ray &r, long &hitNum) {
+  double t;
+  hitNum += q->interset(r, t) && t > 0;
+}
+
+// every triangle hit in the tree, the work the sah cost models
+void walk_box(Box *box, Ray &r, long &hitNum) {
+  if (!box->hit(r)) {
+    return;
+  }
+  for (Triangle *p : box->leaf) {
+    count_hit(p, r, hitNum);
+  }
+  for (Rect *q : box->rects) {
+    count_hit(q, r, hitNum);
+  }
+  if (!box->is_leaf()) {
+    walk_box(box->lChild, r, hitNum);
+    walk_box(box->rChild, r, hitNum);
+  }
+}
+
+// hits of every triangle and rect in a quantized tree
+template <typename T>
+long bench_quantized(const char *name, QuantizedBvh<T> &bvh) {
+  return bench_layout(name, bvh.memory(), [&](Ray &r, long &hitNum) {
+    bvh.traverse(
+        r, [&](Triangle *p) { count_hit(p, r, hitNum); },
+        [&](Rect *q) { count_hit(q, r, hitNum); });
+  });
+}
+
+// box tree against its 16 and 8 bit quantized copies, returns how many
+// copies miss hits of the box tree
+int bench_compact_bvh(std::vector<Triangle> &triangles, Box *root) {
+  long boxHits =
+      bench_layout("box", box_memory(root),
+                   [&](Ray &r, long &hitNum) { walk_box(root, r, hitNum); });
+  // any hit only, hits counts the rays that are blocked
+  bench_layout("box occluded", box_memory(root), [&](Ray &r, long &hitNum) {
+    hitNum += occluded(root, r, DBL_MAX);
+  });
+
+  QuantizedBvh<unsigned short> bvh16(root, &triangles[0]);
+  QuantizedBvh<unsigned char> bvh8(root, &triangles[0]);
+  long hits16 = bench_quantized("quantized16", bvh16);
+  long hits8 = bench_quantized("quantized8", bvh8);
+  return (hits16 != boxHits) + (hits8 != boxHits);
+}
+
+// pixels of a and b whose colors differ by more than tolerance, summed over
+// the channels. 0 asks for the same bits
+int count_different(Framebuffer &a, Framebuffer &b, double tolerance = 0) {
+  int differentNum = 0;
+  for (int i = 0; i < a.width * a.height; i++) {
+    Vec4 p = a.get_color(i), q = b.get_color(i);
+    differentNum += fabs(p.a - q.a) + fabs(p.b - q.b) + fabs(p.c - q.c) +
+                        fabs(p.d - q.d) >
+                    tolerance;
+  }
+  return differentNum;
+}
+
+// the compare functions print what they measure and return how many
+// pixels, frames or kernels differ, main fails the run on any
+
+// the sponge as two triangles per face against one rect per face. the
+// rects are also rasterized, traced by the wavefront renderer and walked in
+// quantized trees, which must give the image and hits of the box tree
+int compare_sponge_rects() {
+  Scene mesh, rects;
+  test::generate_triangles(mesh.triangles);
+  test::generate_rects(rects.rects);
+  mesh.build();
+  rects.build();
+  Camera camera(Vec3(2.5, 1.8, 3), Vec3(0.5, 0.5, 0.5), Vec3(0, 1, 0), 1, 1,
+                64, 64);
+  SobolSampler sampler(0);
+  Framebuffer a(64, 64), b(64, 64);
+  render(mesh, camera, sampler, a, 4);
+  render(rects, camera, sampler, b, 4);
+  int differentNum = count_different(a, b, 1e-6);
+  double meshSpeed, rectSpeed;
+  long meshHits = bench_layout(
+      "sponge triangles", box_memory(mesh.root),
+      [&](Ray &r, long &hitNum) { walk_box(mesh.root, r, hitNum); },
+      &meshSpeed);
+  long rectHits = bench_layout(
+      "sponge rects", box_memory(rects.root),
+      [&](Ray &r, long &hitNum) { walk_box(rects.root, r, hitNum); },
+      &rectSpeed);
+  differentNum += meshHits != rectHits;
+  Framebuffer raster(64, 64), wavefront(64, 64);
+  rasterize(rects, camera, sampler, raster, 4);
+  render_wavefront(rects, camera, sampler, wavefront, 4);
+  differentNum +=
+      count_different(b, raster) + count_different(b, wavefront);
+  QuantizedBvh<unsigned short> bvh16(rects.root, rects.triangles.data(),
+                                     &rects.rects[0]);
+  QuantizedBvh<unsigned char> bvh8(rects.root, rects.triangles.data(),
+                                   &rects.rects[0]);
+  differentNum += (bench_quantized("rects quantized16", bvh16) != rectHits) +
+                  (bench_quantized("rects quantized8", bvh8) != rectHits);
+  cout << "rect primitives " << mesh.triangles.size() << " -> "
+       << rects.rects.size() << " speedup " << rectSpeed / meshSpeed
+       << " different pixels " << differentNum << endl;
+  return differentNum;
+}
+
+int count_nodes(Box *box) {
+  return box == nullptr ? 0
+                        : 1 + count_nodes(box->lChild) +
+                              count_nodes(box->rChild);
+}
+
+// an 8 x 8 field of sponges seen closely from one corner, built whole and
+// built lazily, then rendered. the lazy tree only splits what rays reach
+int compare_lazy_build() {
+  std::vector<Triangle> sponge;
+  test::generate_triangles(sponge);
+  Scene eager, lazy;
+  for (int i = 0; i < 8 * 8; i++) {
+    Mat4x4 mat;
+    mat.translate(Vec3(i % 8 * 1.5, 0, i / 8 * 1.5));
+    for (Triangle t : sponge) {
+      eager.triangles.push_back(t.transform(mat));
+    }
+  }
+  lazy.triangles = eager.triangles;
+  Camera camera(Vec3(-1, 1.5, -1), Vec3(1, 0.5, 1), Vec3(0, 1, 0), 1, 1, 32,
+                32);
+  SobolSampler sampler(0);
+  Framebuffer a(32, 32), b(32, 32);
+  double seconds[2][2];
+  Scene *scenes[2] = {&eager, &lazy};
+  Framebuffer *fbs[2] = {&a, &b};
+  for (int k = 0; k < 2; k++) {
+    auto start = chrono::steady_clock::now();
+    scenes[k]->build(k == 1);
+    auto built = chrono::steady_clock::now();
+    render(*scenes[k], camera, sampler, *fbs[k], 1);
+    chrono::duration<double> build = built - start,
+                             draw = chrono::steady_clock::now() - built;
+    seconds[k][0] = build.count();
+    seconds[k][1] = draw.count();
+  }
+  int differentNum = count_different(a, b, 1e-6);
+  cout << "lazy triangles " << eager.triangles.size() << " nodes "
+       << count_nodes(eager.root) << " -> " << count_nodes(lazy.root)
+       << " build " << seconds[0][0] << " -> " << seconds[1][0]
+       << " s render " << seconds[0][1] << " -> " << seconds[1][1]
+       << " s different pixels " << differentNum << endl;
+  return differentNum;
+}
+
+// the rasterizer against camera rays over sizes that are and are not a
+// multiple of the tile, spins and glyphs, same bits every time
+int compare_raster() {
+  SobolSampler sampler(0);
+  int differentNum = 0, caseNum = 0;
+  for (int size : {32, 61, 100}) {
+    Camera camera = avatar_camera(size);
+    for (double spin : {0.0, 0.4, 1.2}) {
+      Scene scene;
+      Mat4x4 mat = avatar_transform(spin);
+      generate_avatar_cube(scene.triangles, mat);
+      scene.build();
+      for (char glyph : {'a', 'm', 'z'}) {
+        scene.glyph = glyph;
+        Framebuffer a(size, size), b(size, size);
+        // a full coverage mask and a part of one
+        render(scene, camera, sampler, a, RASTER_LANES + 1);
+        rasterize(scene, camera, sampler, b, RASTER_LANES + 1);
+        differentNum += count_different(a, b);
+        caseNum++;
+      }
+    }
+  }
+  cout << "raster cases " << caseNum << " different pixels " << differentNum
+       << endl;
+  return differentNum;
+}
+
+// the resolve kernel against the per pixel rounding it replaced, on random
+// sums a little past 0 and 1 and pixels without samples. srgb may be off by
+// one byte from the exact curve, dithering keeps the mean
+int compare_resolve() {
+  int size = 1024;
+  Framebuffer fb(size, size);
+  srand(1);
+  for (int i = 0; i < size * size; i++) {
+    int n = rand() % 64;
+    Vec4 c(rand() % 1100 / 1000.0 - 0.05, rand() % 256 / 255.0,
+           (rand() % 510 + 0.5) / 510, rand() % 1000 / 999.0);
+    fb.set(i, c * n, n);
+  }
+  std::vector<unsigned char> expected(size * size * 4), bytes(size * size * 4);
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < size * size; i++) {
+    Vec4 c = fb.get_color(i);
+    double v[4] = {c.a, c.b, c.c, c.d};
+    for (int k = 0; k < 4; k++) {
+      int b = (int)round(v[k] * 255);
+      expected[i * 4 + k] = b < 0 ? 0 : b > 255 ? 255 : b;
+    }
+  }
+  auto scalar = chrono::steady_clock::now();
+  ResolveOptions options;
+  options.alpha = true;
+  fb.resolve(&bytes[0], size * 4, options);
+  chrono::duration<double> a = scalar - start,
+                           b = chrono::steady_clock::now() - scalar;
+  int differentNum = expected != bytes;
+
+  options.srgb = true;
+  fb.resolve(&bytes[0], size * 4, options);
+  int srgbError = 0;
+  for (int i = 0; i < size * size; i++) {
+    Vec4 c = fb.get_color(i);
+    int e = (int)round(linear_to_srgb(c.b) * 255) - bytes[i * 4 + 1];
+    srgbError = max(srgbError, abs(e));
+  }
+
+  double mean[3] = {0, 0, 0};
+  for (int i = 0; i < size * size; i++) {
+    fb.set(i, Vec4(0.3, 0.3, 0.3, 1), 1);
+  }
+  for (int k = 0; k < 3; k++) {
+    options.srgb = false;
+    options.dither = (DitherType)k;
+    fb.resolve(&bytes[0], size * 4, options);
+    for (int i = 0; i < size * size; i++) {
+      mean[k] += bytes[i * 4] / (255.0 * size * size);
+    }
+  }
+  cout << "resolve scalar " << a.count() << " -> " << b.count()
+       << " s different " << differentNum << " srgb error " << srgbError
+       << " 0.3 dithered " << mean[0] << " " << mean[1] << " " << mean[2]
+       << endl;
+  return differentNum + (srgbError > 1);
+}
+
+// a 4 x 4 wall of small cubes, one cube moved a little, then one face of
+// it, then a new glyph. every incremental frame must have the sums of a full
+// render of it
+int compare_incremental() {
+  int size = 128, spp = 4;
+  // edited here, build reorders the triangles of the scene
+  std::vector<Triangle> wall;
+  for (int i = 0; i < 16; i++) {
+    Mat4x4 mat;
+    mat.scale(Vec3(0.3, 0.3, 0.3))
+        .rotate_y(0.5)
+        .translate(Vec3((i % 4 - 1.5) * 0.9, (i / 4 - 1.5) * 0.9, 0));
+    generate_avatar_cube(wall, mat);
+  }
+  Scene scene;
+  scene.triangles = wall;
+  scene.build();
+  Camera camera = avatar_camera(size);
+  SobolSampler sampler(0);
+  IncrementalRenderer incremental(scene, sampler, spp);
+  Framebuffer fb(size, size);
+  incremental.render(camera, fb);
+  incremental.renderedTileNum = incremental.reusedTileNum = 0;
+
+  Mat4x4 move, face;
+  move.translate(Vec3(0.05, 0, 0));
+  face.translate(Vec3(0, 0.05, 0));
+  double seconds[2] = {0, 0};
+  int differentNum = 0;
+  for (int k = 0; k < 3; k++) {
+    // the 12 triangles of cube 5, its first face is 2 of them
+    for (int i = 0; i < (k == 0 ? 12 : 2) && k < 2; i++) {
+      wall[60 + i].transform(k == 0 ? move : face);
+    }
+    if (k == 2) {
+      scene.glyph = 'b';
+    }
+    scene.triangles = wall;
+    scene.build();
+    Framebuffer full(size, size);
+    auto start = chrono::steady_clock::now();
+    incremental.render(camera, fb);
+    auto rendered = chrono::steady_clock::now();
+    render(scene, camera, sampler, full, spp);
+    chrono::duration<double> a = rendered - start,
+                             b = chrono::steady_clock::now() - rendered;
+    seconds[0] += a.count();
+    seconds[1] += b.count();
+    differentNum += fb.sum != full.sum || fb.sampleNum != full.sampleNum;
+  }
+  cout << "incremental tiles " << incremental.renderedTileNum << " of "
+       << incremental.renderedTileNum + incremental.reusedTileNum << " full "
+       << seconds[1] << " -> " << seconds[0] << " s different frames "
+       << differentNum << endl;
+  return differentNum;
+}
+
+// splits every lazy node below box, the bounds of each node go to bounds
+// parent first
+void expand_all(Box *box, std::vector<double> &bounds) {
+  expand_box(box);
+  bounds.insert(bounds.end(), {box->min.a, box->min.b, box->min.c,
+                               box->max.a, box->max.b, box->max.c});
+  if (!box->is_leaf()) {
+    expand_all(box->lChild, bounds);
+    expand_all(box->rChild, bounds);
+  }
+}
+
+// every kernel at every level this host has against the scalar one: ray
+// setup, ray against a cut, triangle transform, ray against triangles, the
+// binned splits of a lazy tree, resolve and a whole render of the sponge
+// must agree bit for bit
+int compare_cpu_levels() {
+  CpuInfo &cpu = CpuInfo::get_instance();
+  CpuLevel detected = cpu.detected;
+  Scene scene;
+  test::generate_triangles(scene.triangles);
+  scene.build();
+  Camera camera(Vec3(2.5, 1.8, 3), Vec3(0.5, 0.5, 0.5), Vec3(0, 1, 0), 1, 1,
+                128, 128);
+  SobolSampler sampler(0);
+  double x[RAY_BATCH_SIZE], y[RAY_BATCH_SIZE];
+  for (int i = 0; i < RAY_BATCH_SIZE; i++) {
+    x[i] = i % 8 * 16 + 0.3;
+    y[i] = i / 8 * 16 + 0.7;
+  }
+  // the whole tree as a cut, and rays along the axes as well
+  std::vector<Box *> nodes;
+  Frustum frustum(camera, 0, 0, 128, 128);
+  collect_cut(scene.root, frustum, nodes);
+  BoxBounds cut(nodes);
+  std::vector<Ray> rays;
+  for (int i = 0; i < 256; i++) {
+    rays.push_back(camera.generate_ray(i % 16 * 8 + 0.5, i / 16 * 8 + 0.5));
+  }
+  rays.push_back(Ray(Vec3(0.5, 0.5, 5), Vec3(0, 0, -1)));
+  rays.push_back(Ray(Vec3(0.2, -3, 0.1), Vec3(0, 1, 0)));
+  Mat4x4 spin;
+  spin.translate(Vec3(-0.5, -0.5, -0.5))
+      .rotate_y(0.3)
+      .translate(Vec3(0.5, 0.5, 0.5));
+
+  std::vector<Triangle *> pointers;
+  for (Triangle &t : scene.triangles) {
+    pointers.push_back(&t);
+  }
+
+  RayBatch batch0;
+  std::vector<unsigned char> hits0, bytes0;
+  std::vector<double> triangleHits0, bounds0;
+  std::vector<Triangle> moved0;
+  Framebuffer fb0(128, 128);
+  int failNum = 0;
+  for (int level = CPU_SCALAR; level <= detected; level++) {
+    cpu.set_level((CpuLevel)level);
+    RayBatch batch;
+    camera.generate_batch(x, y, RAY_BATCH_SIZE, batch);
+    std::vector<unsigned char> hits;
+    for (Ray &r : rays) {
+      cut.hit(r);
+      hits.insert(hits.end(), cut.hits.begin(), cut.hits.begin() + cut.size);
+    }
+    std::vector<Triangle> moved = scene.triangles;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+      transform_triangles(moved, spin);
+    }
+    auto transformed = chrono::steady_clock::now();
+    // every triangle against the rays in groups of one to four lanes
+    std::vector<double> triangleHits;
+    for (int k = 0; k < 10; k++) {
+      triangleHits.clear();
+      for (Ray &r : rays) {
+        for (int i = 0; i < (int)pointers.size();) {
+          int num = std::min(i % 4 + 1, (int)pointers.size() - i);
+          double t[TRIANGLE_LANE_NUM];
+          int mask = hit_triangles(&pointers[i], num, r, t);
+          for (int j = 0; j < num; j++) {
+            triangleHits.push_back(mask >> j & 1 ? t[j] : -1);
+          }
+          i += num;
+        }
+      }
+    }
+    auto intersected = chrono::steady_clock::now();
+    // a lazy tree split all the way down, node bounds in walk order
+    Scene lazy;
+    lazy.triangles = scene.triangles;
+    lazy.build(true);
+    std::vector<double> bounds;
+    expand_all(lazy.root, bounds);
+    auto split = chrono::steady_clock::now();
+    Framebuffer fb(128, 128);
+    render(scene, camera, sampler, fb, 4);
+    auto rendered = chrono::steady_clock::now();
+    std::vector<unsigned char> bytes(128 * 128 * 3);
+    for (int i = 0; i < 100; i++) {
+      fb.resolve(&bytes[0], 128 * 3);
+    }
+    chrono::duration<double> a = transformed - start,
+                             d = intersected - transformed,
+                             e = split - intersected, b = rendered - split,
+                             c = chrono::steady_clock::now() - rendered;
+    if (level == CPU_SCALAR) {
+      batch0 = batch;
+      hits0 = hits;
+      moved0 = moved;
+      triangleHits0 = triangleHits;
+      bounds0 = bounds;
+      bytes0 = bytes;
+      fb0 = fb;
+    }
+    int differentNum =
+        memcmp(&batch0, &batch, sizeof(batch)) != 0 || hits0 != hits ||
+        memcmp(&moved0[0], &moved[0], moved.size() * sizeof(Triangle)) != 0 ||
+        triangleHits0 != triangleHits || bounds0 != bounds ||
+        bytes0 != bytes || fb0.sum != fb.sum;
+    cout << "cpu " << cpu_level_name((CpuLevel)level) << " transform "
+         << a.count() << " triangles " << d.count() << " split " << e.count()
+         << " render " << b.count() << " resolve " << c.count()
+         << " s different " << differentNum << endl;
+    failNum += differentNum;
+  }
+  cpu.set_level(detected);
+  return failNum;
+}
+
+// render keys follow the glyph but not the cpu level, the memory tier drops
+// the least recently used image past its budget and never keeps one larger
+// than it, and a second cache on the same directory finds the first's images
+int compare_cache() {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.build();
+  Camera camera = avatar_camera(32);
+  SobolSampler sampler(0);
+  CpuInfo &cpu = CpuInfo::get_instance();
+  std::string key = render_key(scene, camera, sampler, 4, true);
+  int failNum = 0;
+  for (int level = CPU_SCALAR; level <= cpu.detected; level++) {
+    cpu.set_level((CpuLevel)level);
+    failNum += render_key(scene, camera, sampler, 4, true) != key;
+  }
+  cpu.set_level(cpu.detected);
+  scene.glyph = 'b';
+  failNum += render_key(scene, camera, sampler, 4, true) == key;
+  failNum += render_key(scene, camera, sampler, 8, true) ==
+             render_key(scene, camera, sampler, 4, true);
+
+  std::vector<char> data[4], big(400, 'x'), got;
+  for (int i = 0; i < 4; i++) {
+    data[i].assign(100, 'a' + i);
+  }
+  RenderCache memory(300);
+  for (int i = 0; i < 3; i++) {
+    memory.put("k" + to_string(i), data[i]);
+  }
+  // k0 becomes the most recent, k1 is the one to go
+  failNum += !memory.get("k0", got) || got != data[0];
+  memory.put("k3", data[3]);
+  failNum += memory.get("k1", got);
+  failNum += !memory.get("k2", got) || !memory.get("k3", got) ||
+             !memory.get("k0", got);
+  memory.put("big", big);
+  failNum += memory.get("big", got) || !memory.get("k0", got);
+  failNum += memory.hitNum != 5 || memory.missNum != 2 ||
+             memory.evictionNum != 1;
+
+  char directory[] = "/tmp/myavatar_cache_XXXXXX";
+  failNum += mkdtemp(directory) == nullptr;
+  RenderCache first(1000, directory), second(1000, directory);
+  first.put(key, data[0]);
+  failNum += !second.get(key, got) || got != data[0] ||
+             second.diskHitNum != 1;
+  failNum += !second.get(key, got) || second.hitNum != 1;
+  failNum += second.get("missing", got) || second.missNum != 1;
+  remove((std::string(directory) + "/" + key + ".ppm").c_str());
+  rmdir(directory);
+  cout << "cache failed checks " << failNum << ", " << second.stats();
+  return failNum;
+}
+
+// a render request sent without waiting for its reply
+bool send_render(int fd, char glyph, int size, int spp) {
+  RenderRequest request;
+  request.glyph = glyph;
+  request.size = size;
+  request.spp = spp;
+  ByteWriter writer;
+  write_render_request(writer, request);
+  return write_message(fd, SERVER_RENDER, writer.data);
+}
+
+// the number after name in a stats reply, -1 when it is missing
+long stat_value(const std::string &stats, const std::string &name) {
+  size_t i = stats.find(name + " ");
+  return i == std::string::npos ? -1 : atol(&stats[i + name.size() + 1]);
+}
+
+// a daemon on a unix socket: a round trip gives the image of a local
+// render, the second time from its cache. copies of a request queued behind
+// a long render are rendered once, bad requests get an error and lose the
+// connection, and a request still queued when the server stops gets an
+// error while the one being rendered gets its image
+int compare_server() {
+  char directory[] = "/tmp/myavatar_server_XXXXXX";
+  int failNum = mkdtemp(directory) == nullptr;
+  std::string address = std::string("unix:") + directory + "/socket";
+  std::string stats;
+  {
+    RenderServer server(address, SAMPLER_SOBOL, 0);
+    failNum += !server.ok();
+    serverStop = 0;
+    std::thread daemon([&]() { server.run(); });
+
+    Scene scene;
+    Mat4x4 mat = avatar_transform();
+    generate_avatar_cube(scene.triangles, mat);
+    scene.build();
+    Sampler *sampler = create_sampler(SAMPLER_SOBOL, 0, 4);
+    Camera camera = avatar_camera(32);
+    Framebuffer fb(32, 32);
+    render(scene, camera, *sampler, fb, 4);
+    delete sampler;
+    int fd = connect_socket(address);
+    RenderRequest request;
+    request.size = 32;
+    request.spp = 4;
+    std::vector<char> image;
+    for (int i = 0; i < 2; i++) {
+      failNum += !request_render(fd, request, image) ||
+                 image != fb.encode_ppm();
+    }
+
+    int slow = connect_socket(address), copies[3];
+    failNum += !send_render(slow, 'b', 256, 16);
+    std::vector<char> images[3];
+    for (int &copy : copies) {
+      copy = connect_socket(address);
+      failNum += !send_render(copy, 'c', 32, 4);
+    }
+    int type;
+    failNum += !read_message(slow, type, image) || type != SERVER_IMAGE;
+    for (int i = 0; i < 3; i++) {
+      failNum += !read_message(copies[i], type, images[i]) ||
+                 type != SERVER_IMAGE || images[i] != images[0];
+      close(copies[i]);
+    }
+
+    // no font, past the sample limit, an unknown type, a message too large
+    for (int i = 0; i < 4; i++) {
+      int bad = connect_socket(address);
+      if (i < 2) {
+        send_render(bad, i == 0 ? '1' : 'a', 1024, i == 0 ? 4 : 256);
+      } else {
+        write_message(bad, i == 2 ? 99 : SERVER_RENDER,
+                      std::vector<char>(i == 2 ? 0 : SERVER_MAX_MESSAGE + 1));
+      }
+      failNum += !read_message(bad, type, image) || type != SERVER_ERROR ||
+                 read_message(bad, type, image);
+      close(bad);
+    }
+    failNum += !request_stats(fd, stats) ||
+               stat_value(stats, "requests") != 6 ||
+               stat_value(stats, "renders") != 3 ||
+               stat_value(stats, "cache hit") != 1;
+
+    // d goes out once the render thread has taken e on its own
+    failNum += !send_render(slow, 'e', 256, 16);
+    std::string taken = stats;
+    while (stat_value(taken, "batches") == stat_value(stats, "batches") &&
+           request_stats(fd, taken)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    int last = connect_socket(address);
+    std::string queued;
+    failNum += !send_render(last, 'd', 32, 4) ||
+               !request_stats(last, queued) ||
+               stat_value(queued, "requests") != 8;
+    server.stop();
+    failNum += !read_message(slow, type, image) || type != SERVER_IMAGE;
+    failNum += !read_message(last, type, image) || type != SERVER_ERROR;
+    close(slow);
+    close(last);
+    close(fd);
+    daemon.join();
+    serverStop = 0;
+  }
+  rmdir(directory);
+  cout << "server requests " << stat_value(stats, "requests") << " renders "
+       << stat_value(stats, "renders") << " cache hit "
+       << stat_value(stats, "cache hit") << " failed checks " << failNum
+       << endl;
+  return failNum;
+}
+
+// a worker process that takes the setup and one job on fd, then dies
+// without a result or, when stall is set, sleeps past every deadline
+pid_t fork_bad_worker(int fd, bool stall) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int type;
+    std::vector<char> payload;
+    read_message(fd, type, payload);
+    read_message(fd, type, payload);
+    if (stall) {
+      sleep(60);
+    }
+    _exit(1);
+  }
+  close(fd);
+  return pid;
+}
+
+// tiles of two images over forked workers, one of which dies mid-job and
+// one of which stalls. both are dropped and their jobs requeued, the
+// images match local renders and the coordinator renders nothing itself
+int compare_distributed() {
+  char directory[] = "/tmp/myavatar_distributed_XXXXXX";
+  int failNum = mkdtemp(directory) == nullptr;
+  std::string address = std::string("unix:") + directory + "/socket";
+  std::string cachePath = std::string(directory) + "/scene";
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.build();
+  Camera camera = avatar_camera(128);
+  Sampler *sampler = create_sampler(SAMPLER_SOBOL, 0, 4);
+  failNum += !write_scene_cache(cachePath, scene, camera);
+
+  std::vector<char> glyphs = {'a', 'b'};
+  std::vector<Framebuffer *> images;
+  Coordinator *coordinator = new Coordinator(address, 1);
+  failNum += !coordinator->ok();
+  // the bad ones connect first, so they are sure to get jobs
+  pid_t dead = fork_bad_worker(connect_socket(address), false);
+  pid_t stalled = fork_bad_worker(connect_socket(address), true);
+  pid_t good = fork();
+  if (good == 0) {
+    _exit(run_worker(address, cachePath));
+  }
+  for (int i = 0; i < 2; i++) {
+    images.push_back(new Framebuffer(128, 128));
+  }
+  auto start = chrono::steady_clock::now();
+  coordinator->render(scene, camera, *sampler, 4, 0, glyphs, images);
+  chrono::duration<double> s = chrono::steady_clock::now() - start;
+  kill(stalled, SIGKILL);
+  for (pid_t pid : {dead, stalled, good}) {
+    waitpid(pid, nullptr, 0);
+  }
+
+  int differentNum = 0;
+  for (int i = 0; i < 2; i++) {
+    Framebuffer local(128, 128);
+    scene.glyph = glyphs[i];
+    render(scene, camera, *sampler, local, 4);
+    differentNum += count_different(local, *images[i]);
+    delete images[i];
+  }
+  failNum += differentNum > 0 || coordinator->workerDeathNum != 2 ||
+             coordinator->lateWorkerNum != 1 || coordinator->localJobNum != 0;
+  cout << "distributed lost workers " << coordinator->workerDeathNum
+       << " late " << coordinator->lateWorkerNum << " local jobs "
+       << coordinator->localJobNum << " " << s.count()
+       << " s different pixels " << differentNum << " failed checks "
+       << failNum << endl;
+  delete coordinator;
+  delete sampler;
+  remove(cachePath.c_str());
+  rmdir(directory);
+  return failNum;
+}
+
+// the reference bytes of myavatar_render, render and resolve in this
+// process on the default transform with the sobol sampler
+std::vector<unsigned char> reference_image(unsigned seed, char glyph, int size,
+                                           int spp, int format,
+                                           size_t stride) {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.build();
+  scene.glyph = glyph;
+  Sampler *sampler = create_sampler(SAMPLER_SOBOL, seed, spp);
+  Camera camera = avatar_camera(size);
+  Framebuffer fb(size, size);
+  render(scene, camera, *sampler, fb, spp);
+  delete sampler;
+  ResolveOptions options;
+  options.alpha = format == MYAVATAR_RGBA8;
+  std::vector<unsigned char> bytes(stride * size, 0xab);
+  fb.resolve(&bytes[0], stride, options);
+  return bytes;
+}
+
+// output/libmyavatar.so, or MYAVATAR_LIBRARY, loaded like any client
+// would. packed and padded rows of both byte formats match render and
+// resolve here, padding is left alone, and renders and batches running at
+// once on one scene give the same bytes as alone
+int compare_c_api() {
+  const char *path = getenv("MYAVATAR_LIBRARY");
+  // never closed, the thread pool of the library lives on
+  void *lib = dlopen(path != nullptr ? path : "./output/libmyavatar.so",
+                     RTLD_NOW | RTLD_LOCAL);
+  if (lib == nullptr) {
+    cout << "c api fail to load " << dlerror() << endl;
+    return 1;
+  }
+  auto create =
+      (myavatar_scene * (*)(unsigned)) dlsym(lib, "myavatar_scene_create");
+  auto destroy =
+      (void (*)(myavatar_scene *))dlsym(lib, "myavatar_scene_destroy");
+  auto render_one = (int (*)(myavatar_scene *, const myavatar_image *))
+      dlsym(lib, "myavatar_render");
+  auto render_batch = (int (*)(myavatar_scene *, const myavatar_image *, int))
+      dlsym(lib, "myavatar_render_batch");
+  if (create == nullptr || destroy == nullptr || render_one == nullptr ||
+      render_batch == nullptr) {
+    cout << "c api missing symbols" << endl;
+    return 1;
+  }
+
+  unsigned seed = 7;
+  int size = 40, spp = 4, failNum = 0;
+  myavatar_scene *scene = create(seed);
+  failNum += scene == nullptr;
+  for (int format : {MYAVATAR_RGB8, MYAVATAR_RGBA8}) {
+    size_t packed = size * (format == MYAVATAR_RGB8 ? 3 : 4);
+    for (size_t stride : {packed, packed + 5}) {
+      std::vector<unsigned char> expected =
+          reference_image(seed, 'q', size, spp, format, stride);
+      std::vector<unsigned char> bytes(stride * size, 0xab);
+      myavatar_image image = {'q', size, spp, format,
+                              stride == packed ? 0 : stride, &bytes[0],
+                              nullptr};
+      failNum += render_one(scene, &image) != MYAVATAR_OK || bytes != expected;
+    }
+  }
+
+  // two threads render single images and two render batches, all at once
+  const char glyphs[] = "abcd";
+  std::vector<unsigned char> expected[4];
+  size_t stride = size * 3;
+  for (int i = 0; i < 4; i++) {
+    expected[i] = reference_image(seed, glyphs[i], size, spp, MYAVATAR_RGB8,
+                                  stride);
+  }
+  std::atomic<int> concurrentFailNum(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      for (int round = 0; round < 3; round++) {
+        std::vector<unsigned char> bytes[4];
+        myavatar_image images[4];
+        for (int i = 0; i < 4; i++) {
+          bytes[i].assign(stride * size, 0);
+          images[i] = {glyphs[i], size, spp, MYAVATAR_RGB8, 0, &bytes[i][0],
+                       nullptr};
+        }
+        int status = MYAVATAR_OK;
+        if (t < 2) {
+          for (int i = 0; i < 4 && status == MYAVATAR_OK; i++) {
+            status = render_one(scene, &images[(i + t) % 4]);
+          }
+        } else {
+          status = render_batch(scene, images, 4);
+        }
+        for (int i = 0; i < 4; i++) {
+          concurrentFailNum += status != MYAVATAR_OK || bytes[i] != expected[i];
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  failNum += concurrentFailNum;
+  destroy(scene);
+  cout << "c api different images " << concurrentFailNum << " failed checks "
+       << failNum << endl;
+  return failNum;
+}
+
+// a progressive render stopped after its first pass and resumed from the
+// checkpoint at the scalar level must give the sums of a straight one. a
+// finished checkpoint still writes the image, and another glyph does not
+// resume from it
+int compare_checkpoint() {
+  Scene scene;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(scene.triangles, mat);
+  scene.build();
+  Camera camera = avatar_camera(32);
+  SobolSampler sampler(0);
+  char directory[] = "/tmp/myavatar_checkpoint_XXXXXX";
+  int failNum = mkdtemp(directory) == nullptr;
+  std::string checkpointPath = std::string(directory) + "/checkpoint";
+  std::string previewPath = std::string(directory) + "/preview.ppm";
+
+  Framebuffer straight(32, 32), resumed(32, 32), finished(32, 32);
+  ProgressiveRenderer reference(scene, camera, sampler, 2, 3);
+  failNum += !reference.render(straight);
+
+  ProgressiveRenderer stopped(scene, camera, sampler, 2, 3);
+  stopped.checkpointPath = checkpointPath;
+  progressiveStop = 1;
+  failNum += stopped.render(resumed) || stopped.passDone != 1;
+  progressiveStop = 0;
+  // resumed by a host of another cpu level
+  CpuInfo &cpu = CpuInfo::get_instance();
+  cpu.set_level(CPU_SCALAR);
+  ProgressiveRenderer resumer(scene, camera, sampler, 2, 3);
+  resumer.checkpointPath = checkpointPath;
+  failNum += !resumer.render(resumed);
+  cpu.set_level(cpu.detected);
+  int differentNum = count_different(straight, resumed);
+
+  ProgressiveRenderer again(scene, camera, sampler, 2, 3);
+  again.checkpointPath = checkpointPath;
+  again.previewPath = previewPath;
+  again.previewInterval = 3;
+  failNum += !again.render(finished) || finished.sum != straight.sum;
+  failNum += access(previewPath.c_str(), F_OK) != 0;
+
+  scene.glyph = 'b';
+  ProgressiveRenderer other(scene, camera, sampler, 2, 3);
+  other.checkpointPath = checkpointPath;
+  other.checkpointInterval = 0;
+  failNum += !other.render(finished) || finished.sum == straight.sum;
+
+  remove(checkpointPath.c_str());
+  remove(previewPath.c_str());
+  rmdir(directory);
+  cout << "checkpoint different pixels " << differentNum
+       << " failed checks " << failNum << endl;
+  return differentNum + failNum;
+}
+
+// the sponge spun once around its center, then its upper half twisted
+// around the vertical axis a little more every frame. the spin only refits,
+// the twist degrades subtrees and then the whole tree, so both rebuilds must
+// run. after every frame the tree must find the hits of a fresh build of
+// the same triangles
+int compare_refit(std::vector<Triangle> &triangles, Box *root) {
+  BoxRefitter refitter(triangles, root);
+  int differentNum = 0;
+  auto check = [&]() {
+    std::vector<Triangle> copy = triangles;
+    Box *fresh = new Box();
+    build_box(copy.begin(), copy.end(), copy.size(), fresh);
+    differentNum +=
+        trace_grid([&](Ray &r, long &hitNum) { walk_box(root, r, hitNum); }) !=
+        trace_grid([&](Ray &r, long &hitNum) { walk_box(fresh, r, hitNum); });
+    delete fresh;
+  };
+  Mat4x4 step;
+  step.translate(Vec3(-0.5, -0.5, -0.5))
+      .rotate_y(6 * M_PI / 180)
+      .translate(Vec3(0.5, 0.5, 0.5));
+  for (int i = 0; i < 60; i++) {
+    refitter.update(step);
+    if (i % 10 == 9) {
+      check();
+    }
+  }
+  int rigidRebuildNum = refitter.partialRebuildNum + refitter.fullRebuildNum;
+  for (int i = 0; i < 20; i++) {
+    for (Triangle &t : triangles) {
+      for (Vec3 *v : {&t.v0, &t.v1, &t.v2}) {
+        double angle = 0.5 * std::max(v->b - 0.5, 0.0);
+        double x = v->a - 0.5, z = v->c - 0.5;
+        v->a = 0.5 + x * cos(angle) - z * sin(angle);
+        v->c = 0.5 + x * sin(angle) + z * cos(angle);
+      }
+      t.n = cross(t.v1 - t.v0, t.v2 - t.v0);
+      t.offset = dot(t.v0, t.n);
+    }
+    refitter.refit();
+    check();
+  }
+  cout << "refit " << refitter.refitNum << " partial rebuild "
+       << refitter.partialRebuildNum << " full rebuild "
+       << refitter.fullRebuildNum << " rigid rebuild " << rigidRebuildNum
+       << " sah " << box_sah_cost(root) << " different hits " << differentNum
+       << endl;
+  return differentNum + (refitter.partialRebuildNum == 0) +
+         (refitter.fullRebuildNum == 0);
+}
+
+// a turntable of the avatar cube at 10 degrees a frame. every frame that
+// reuses history is compared with a full render of it, the psnr must be
+// within SEQUENCE_PSNR_LOSS of the one between two full renders of the
+// frame with other samples, and the turntable must take less time than the
+// full renders
+#define SEQUENCE_PSNR_LOSS 3
+int compare_sequence() {
+  int size = 64, spp = RENDER_SPP;
+  Scene scene;
+  Mat4x4 identity;
+  generate_avatar_cube(scene.triangles, identity);
+  scene.build();
+  Camera camera = avatar_camera(size);
+  SobolSampler sampler(0);
+  SequenceRenderer sequence(scene, sampler, spp);
+  double seconds[2] = {0, 0}, worst = 99, floor = 99;
+  int failNum = 0;
+  for (int i = 0; i < 8; i++) {
+    SequenceFrame frame(avatar_transform(2 * M_PI * i / 36), camera, 'a');
+    Framebuffer fb(size, size), full(size, size), other(size, size);
+    auto start = chrono::steady_clock::now();
+    sequence.render_frame(frame, fb);
+    auto rendered = chrono::steady_clock::now();
+    // the scene is at this frame now
+    render(scene, camera, sampler, full, spp);
+    chrono::duration<double> a = rendered - start,
+                             b = chrono::steady_clock::now() - rendered;
+    render(scene, camera, sampler, other, spp, spp);
+    if (i > 0) {
+      seconds[0] += a.count();
+      seconds[1] += b.count();
+      worst = min(worst, psnr(fb, full));
+      floor = min(floor, psnr(other, full));
+    }
+  }
+  failNum += worst < floor - SEQUENCE_PSNR_LOSS || seconds[0] >= seconds[1];
+
+  // frames are placed from the rest pose, rebuilds included. a refitter
+  // that rebuilds on any change places the sponge twice per matrix, the
+  // second time must give the same triangles and need no rebuild
+  std::vector<Triangle> triangles;
+  test::generate_triangles(triangles);
+  Box *root = new Box();
+  build_box(triangles.begin(), triangles.end(), triangles.size(), root);
+  BoxRefitter refitter(triangles, root, 1.001);
+  refitter.keep_rest();
+  for (int i = 1; i <= 6; i++) {
+    Mat4x4 mat;
+    mat.scale(Vec3(1, 1.0 / (1 + i * i), 1)).rotate_x(0.3 * i);
+    refitter.place(mat);
+    std::vector<Triangle> placed = triangles;
+    int rebuildNum = refitter.partialRebuildNum + refitter.fullRebuildNum;
+    refitter.place(mat);
+    failNum += memcmp(&placed[0], &triangles[0],
+                      triangles.size() * sizeof(Triangle)) != 0 ||
+               refitter.partialRebuildNum + refitter.fullRebuildNum !=
+                   rebuildNum;
+  }
+  failNum += refitter.partialRebuildNum + refitter.fullRebuildNum == 0;
+  delete root;
+
+  cout << "sequence reused " << sequence.reusedNum << " rejected "
+       << sequence.rejectedNum << " full " << seconds[1] << " -> "
+       << seconds[0] << " s psnr " << worst << " full renders " << floor
+       << " place rebuild "
+       << refitter.partialRebuildNum + refitter.fullRebuildNum
+       << " failed checks " << failNum << endl;
+  return failNum;
+}
+
+// every sampler at 16 spp: points in [0, 1), the same value for the same
+// pixel, index and dimension when drawn again or by other threads in
+// another order, and at most 3/4 the error of random points when estimating
+// the quarter disk of radius 0.8 over 256 pixels
+int compare_samplers() {
+  const char *names[] = {"stratified", "halton", "sobol", "blue_noise"};
+  int spp = 16, dimensionNum = 4, pixelNum = 16 * 16;
+  int count = pixelNum * spp * dimensionNum;
+  double area = M_PI * 0.64 / 4;
+  double randomError = 0;
+  for (int p = 0; p < pixelNum; p++) {
+    int inside = 0;
+    for (int k = 0; k < spp; k++) {
+      unsigned h = hash_combine(hash_combine(12345, p), k);
+      double u = to_unit(h), v = to_unit(hash_u32(h));
+      inside += u * u + v * v < 0.64;
+    }
+    randomError += pow((double)inside / spp - area, 2) / pixelNum;
+  }
+  randomError = sqrt(randomError);
+
+  int failNum = 0;
+  for (int type = SAMPLER_STRATIFIED; type <= SAMPLER_BLUE_NOISE; type++) {
+    Sampler *sampler = create_sampler((SamplerType)type, 7, spp);
+    // value i is pixel i / (spp * dimensionNum), index and dimension below
+    auto draw = [&](int i) {
+      int p = i / (spp * dimensionNum);
+      return sampler->get_2d(p % 16, p / 16, i / dimensionNum % spp,
+                             i % dimensionNum);
+    };
+    std::vector<Vec3> first(count), again(count), threaded(count);
+    for (int i = 0; i < count; i++) {
+      first[i] = draw(i);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+      again[i] = draw(i);
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.push_back(std::thread([&, t]() {
+        for (int i = count - 1 - t; i >= 0; i -= 4) {
+          threaded[i] = draw(i);
+        }
+      }));
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    int differentNum = 0, outsideNum = 0;
+    for (int i = 0; i < count; i++) {
+      differentNum += memcmp(&first[i], &again[i], sizeof(Vec3)) != 0 ||
+                      memcmp(&first[i], &threaded[i], sizeof(Vec3)) != 0;
+      outsideNum += first[i].a < 0 || first[i].a >= 1 || first[i].b < 0 ||
+                    first[i].b >= 1;
+    }
+    double error = 0;
+    for (int p = 0; p < pixelNum; p++) {
+      int inside = 0;
+      for (int k = 0; k < spp; k++) {
+        Vec3 point = first[(p * spp + k) * dimensionNum];
+        inside += point.a * point.a + point.b * point.b < 0.64;
+      }
+      error += pow((double)inside / spp - area, 2) / pixelNum;
+    }
+    error = sqrt(error);
+    cout << "sampler " << names[type] << " different " << differentNum
+         << " outside " << outsideNum << " disk error " << error
+         << " random " << randomError << endl;
+    failNum += differentNum + outsideNum + (error > 0.75 * randomError);
+    delete sampler;
+  }
+  return failNum;
+}
+
+// the taps of resample for one axis written out plainly, taps past the
+// border read the edge pixel
+std::vector<std::vector<std::pair<int, double>>>
+reference_taps(ResampleFilter filter, int src, int dst) {
+  std::vector<std::vector<std::pair<int, double>>> taps(dst);
+  double scale = (double)src / dst;
+  double support = filter_radius(filter) * max(scale, 1.0);
+  for (int i = 0; i < dst; i++) {
+    double center = (i + 0.5) * scale - 0.5, total = 0;
+    for (int j = (int)ceil(center - support); j <= center + support; j++) {
+      double w = filter_weight(filter, (j - center) / max(scale, 1.0));
+      taps[i].push_back(make_pair(min(max(j, 0), src - 1), w));
+      total += w;
+    }
+    for (std::pair<int, double> &tap : taps[i]) {
+      tap.second /= total;
+    }
+  }
+  return taps;
+}
+
+// every filter down a size ladder and to a size that is not square, against
+// a two dimensional sum in doubles per output pixel. one temp is shared by
+// the whole ladder like in avatar_a
+int compare_resample() {
+  const char *names[] = {"box", "mitchell", "lanczos"};
+  LinearImage src, dst, temp;
+  src.resize(128, 128);
+  srand(2);
+  for (float &v : src.data) {
+    v = rand() % 1000 / 999.0;
+  }
+  int sizes[][2] = {{64, 64}, {32, 32}, {16, 16}, {8, 8}, {45, 23}};
+  int failNum = 0;
+  for (int filter = FILTER_BOX; filter <= FILTER_LANCZOS; filter++) {
+    double error = 0;
+    for (int *size : sizes) {
+      dst.resize(size[0], size[1]);
+      resample(src, dst, (ResampleFilter)filter, temp);
+      failNum += dst.width != size[0] || dst.height != size[1] ||
+                 (int)dst.data.size() != size[0] * size[1] * 4 ||
+                 temp.width != size[0] || temp.height != src.height;
+      auto horizontal =
+          reference_taps((ResampleFilter)filter, src.width, dst.width);
+      auto vertical =
+          reference_taps((ResampleFilter)filter, src.height, dst.height);
+      for (int y = 0; y < dst.height; y++) {
+        for (int x = 0; x < dst.width; x++) {
+          for (int k = 0; k < 4; k++) {
+            double sum = 0;
+            for (std::pair<int, double> &v : vertical[y]) {
+              for (std::pair<int, double> &h : horizontal[x]) {
+                sum += v.second * h.second * src.row(v.first)[h.first * 4 + k];
+              }
+            }
+            error = max(error, fabs(sum - dst.row(y)[x * 4 + k]));
+          }
+        }
+      }
+    }
+    cout << "resample " << names[filter] << " error " << error << endl;
+    failNum += error > 1e-5;
+  }
+  return failNum;
+}
+
 int main() {
+  int failNum = compare_cpu_levels();
+  failNum += compare_incremental();
+  failNum += compare_resolve();
+  failNum += compare_sponge_rects();
+  failNum += compare_lazy_build();
+  failNum += compare_raster();
+  failNum += compare_cache();
+  failNum += compare_server();
+  failNum += compare_distributed();
+  failNum += compare_c_api();
+  failNum += compare_checkpoint();
+  failNum += compare_samplers();
+  failNum += compare_resample();
+
   std::vector<Triangle> triangles;
   test::generate_triangles(triangles);
   Box *root = new Box();
   build_box(triangles.begin(), triangles.end(), triangles.size(), root);
+
+  failNum += compare_refit(triangles, root);
+  int layoutFailNum = bench_compact_bvh(triangles, root);
+
+  delete root;
+
+  // treelet restructuring of a fresh tree, same hits before and after
+  triangles.clear();
+  test::generate_triangles(triangles);
+  root = new Box();
+  build_box(triangles.begin(), triangles.end(), triangles.size(), root);
+  auto walk = [&](Ray &r, long &hitNum) { walk_box(root, r, hitNum); };
+  double before, after;
+  long meshHits =
+      bench_layout("treelet before", box_memory(root), walk, &before);
+  TreeletOptimizer optimizer(root);
+  optimizer.optimize();
+  layoutFailNum +=
+      bench_layout("treelet after", box_memory(root), walk, &after) !=
+      meshHits;
+  cout << "treelet passes " << optimizer.passNum << " restructures "
+       << optimizer.restructureNum << " sah " << optimizer.costBefore << " -> "
+       << optimizer.costAfter << " speedup " << after / before << endl;
   delete root;
-  return 0;
-}
\ No newline at end of file
+
+  // the same sponge traced without a mesh, it must hit what the mesh does,
+  // then a deep one cut off at about the pixel size of the bench camera
+  for (int level : {2, 8}) {
+    MengerSponge sponge(Vec3(0, 0, 0), 1, level, level > 2 ? 1.0 / 64 : 0);
+    string name = "sponge level " + to_string(level);
+    long hitNum =
+        bench_layout(name.c_str(), sizeof(sponge), [&](Ray &r, long &hitNum) {
+          sponge.trace(r, [&](SpongeHit &) { hitNum++; });
+        });
+    layoutFailNum += level == 2 && hitNum != meshHits;
+  }
+  cout << "layouts with other hits " << layoutFailNum << endl;
+  failNum += layoutFailNum;
+
+  failNum += compare_sequence();
+
+  Scene scene;
+  Mat4x4 identity;
+  generate_avatar_cube(scene.triangles, identity);
+  scene.build();
+  Camera camera = avatar_camera(32);
+  SobolSampler sampler(0);
+
+  // the wavefront renderer must give the image of the recursive one
+  Framebuffer recursive(32, 32), wavefront(32, 32);
+  WavefrontStats stats;
+  render(scene, camera, sampler, recursive, 8);
+  render_wavefront(scene, camera, sampler, wavefront, 8, 0, &stats);
+  int differentNum = count_different(recursive, wavefront);
+  cout << "wavefront rounds " << stats.roundNum << " different pixels "
+       << differentNum << endl;
+  failNum += differentNum;
+
+  // 2 and 4 spp with the denoiser against 40 spp images of other seeds.
+  // those have noise of their own, half the squared error between two of
+  // them, which comes off every error. denoising must remove more error
+  // than a 40 spp image has, a smaller gain could not be told from the
+  // noise of the reference. from 8 spp on the raw error is within 10x of
+  // that floor, so the test stops at 4
+  Scene letter;
+  Mat4x4 mat = avatar_transform();
+  generate_avatar_cube(letter.triangles, mat);
+  letter.build();
+  Camera letterCamera = avatar_camera(128);
+  SobolSampler referenceSampler(1), otherSampler(2);
+  Framebuffer reference(128, 128), other(128, 128);
+  render(letter, letterCamera, referenceSampler, reference, RENDER_SPP);
+  render(letter, letterCamera, otherSampler, other, RENDER_SPP);
+  double referenceError = squared_error(reference, other) / 2;
+  for (int spp : {2, 4}) {
+    Framebuffer low(128, 128);
+    AuxBuffer aux(128, 128);
+    render_aux(letter, letterCamera, sampler, low, aux, spp);
+    double noisy = squared_error(low, reference) - referenceError;
+    double before = psnr(low, reference);
+    denoise(low, aux);
+    double denoised = squared_error(low, reference) - referenceError;
+    cout << "denoise spp " << spp << " psnr " << before << " -> "
+         << psnr(low, reference) << " error removed "
+         << (noisy - denoised) / referenceError << "x the 40 spp error"
+         << endl;
+    failNum += noisy - denoised <= referenceError;
+  }
+  return failNum > 0 ? 1 : 0;
+}
@@ -57,9 +57,13 @@ void face_split(std::deque<Vec3> &target, const Vec3 &origin, const Vec3 &x,
   }
 }
 
-void generate_triangles(std::vector<Triangle> &triangles) {
+inline double coordinate(const Vec3 &v, int axis) {
+  return axis == 0 ? v.a : axis == 1 ? v.b : v.c;
+}
+
+// quads of a level 2 menger sponge in the unit cube, 4 corners each
+void generate_faces(std::deque<Vec3> &faces) {
   int n = 2;
-  std::deque<Vec3> faces;
   std::deque<Vec3> cubes;
   int faceNum;
   int cubeNum;
@@ -129,15 +133,48 @@ void generate_triangles(std::vector<Triangle> &triangles) {
       pop_cube(cubes);
     }
   }
+}
+
+// the sponge, two triangles per face
+void generate_triangles(std::vector<Triangle> &triangles) {
+  std::deque<Vec3> faces;
+  generate_faces(faces);
 
   // for each face, split to 2
-  faceNum = faces.size() / 4;
-  for (int i = 0; i < faces.size() / 4; i++) {
+  int faceNum = faces.size() / 4;
+  for (int i = 0; i < faceNum; i++) {
     triangles.push_back(Triangle(faces[0], faces[1], faces[2]));
     triangles.push_back(Triangle(faces[2], faces[3], faces[0]));
     pop_face(faces);
   }
-};
+}
+
+// the sponge, one rect per face. every face of the generator is axis
+// aligned, texture coordinates stay 0 like those of the triangles
+void generate_rects(std::vector<Rect> &rects) {
+  std::deque<Vec3> faces;
+  generate_faces(faces);
+
+  int faceNum = faces.size() / 4;
+  for (int i = 0; i < faceNum; i++) {
+    Vec3 min = help_min(help_min(faces[0], faces[1]),
+                        help_min(faces[2], faces[3]));
+    Vec3 max = help_max(help_max(faces[0], faces[1]),
+                        help_max(faces[2], faces[3]));
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+      if (coordinate(max, k) - coordinate(min, k) <
+          coordinate(max, axis) - coordinate(min, axis)) {
+        axis = k;
+      }
+    }
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    rects.push_back(Rect(axis, coordinate(min, axis), coordinate(min, u),
+                         coordinate(min, v), coordinate(max, u),
+                         coordinate(max, v)));
+    pop_face(faces);
+  }
+}
 } // namespace test
 
 #endif
\ No newline at end of file
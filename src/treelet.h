@@ -0,0 +1,181 @@
+#ifndef TREELET_H
+#define TREELET_H
+
+#include "refit.h"
+#include <unordered_map>
+
+// leaves of one treelet, 2^n subsets are searched for each
+#define TREELET_LEAF_NUM 7
+#define TREELET_MAX_PASS 8
+// passes stop once one improves the cost by less than this ratio
+#define TREELET_MIN_GAIN 1e-3
+
+// rearranges small treelets of a built tree into their sah optimal shape,
+// after Karras and Aila, "Fast Parallel Construction of High-Quality
+// Bounding Volume Hierarchies". nodes are reused, only child pointers and
+// bounds change. subtrees no longer cover a continuous range of triangles,
+// so the result must not be handed to BoxRefitter for partial rebuilds
+class TreeletOptimizer {
+public:
+  int passNum, restructureNum;
+  double costBefore, costAfter;
+
+  TreeletOptimizer(Box *iroot)
+      : passNum(0), restructureNum(0), costBefore(0), costAfter(0),
+        root(iroot) {
+    std::vector<Box *> stack(1, root);
+    while (!stack.empty()) {
+      Box *box = stack.back();
+      stack.pop_back();
+      index[box] = cost.size();
+      cost.push_back(0);
+      if (!box->is_leaf()) {
+        stack.push_back(box->lChild);
+        stack.push_back(box->rChild);
+      }
+    }
+  }
+
+  void optimize(int maxPass = TREELET_MAX_PASS) {
+    costBefore = box_sah_cost(root);
+    costAfter = costBefore;
+    for (passNum = 0; passNum < maxPass;) {
+      std::vector<Box *> subtrees;
+      collect_subtrees(root, BOX_REFIT_PARALLEL_DEPTH, subtrees);
+      std::vector<int> restructures(subtrees.size(), 0);
+      parallel_for(0, subtrees.size(), [&](int i) {
+        optimize_subtree(subtrees[i], restructures[i]);
+      });
+      for (int n : restructures) {
+        restructureNum += n;
+      }
+      optimize_top(root, BOX_REFIT_PARALLEL_DEPTH);
+      passNum++;
+
+      double last = costAfter;
+      costAfter = box_sah_cost(root);
+      if (last - costAfter < last * TREELET_MIN_GAIN) {
+        break;
+      }
+    }
+  }
+
+private:
+  Box *root;
+  // read only once built, threads write the cost of distinct nodes
+  std::unordered_map<Box *, int> index;
+  std::vector<double> cost; // sah cost of the subtree, not normalized
+
+  double &cost_of(Box *box) { return cost[index.find(box)->second]; }
+
+  void optimize_subtree(Box *box, int &restructures) {
+    if (box->is_leaf()) {
+      cost_of(box) =
+          box->surface_area() * box->primitive_num() * SAH_INTERSECT_COST;
+      return;
+    }
+    optimize_subtree(box->lChild, restructures);
+    optimize_subtree(box->rChild, restructures);
+    cost_of(box) = box->surface_area() * SAH_TRAVERSAL_COST +
+                   cost_of(box->lChild) + cost_of(box->rChild);
+    restructures += restructure(box);
+  }
+
+  // nodes above depth, the subtrees below are already done
+  void optimize_top(Box *box, int depth) {
+    if (depth == 0 || box->is_leaf()) {
+      return;
+    }
+    optimize_top(box->lChild, depth - 1);
+    optimize_top(box->rChild, depth - 1);
+    cost_of(box) = box->surface_area() * SAH_TRAVERSAL_COST +
+                   cost_of(box->lChild) + cost_of(box->rChild);
+    restructureNum += restructure(box);
+  }
+
+  // grows the treelet below box by opening its largest node until it has
+  // TREELET_LEAF_NUM leaves, then rebuilds it if a cheaper shape exists
+  bool restructure(Box *box) {
+    std::vector<Box *> leaves, inner;
+    leaves.push_back(box->lChild);
+    leaves.push_back(box->rChild);
+    while (leaves.size() < TREELET_LEAF_NUM) {
+      int largest = -1;
+      for (int i = 0; i < (int)leaves.size(); i++) {
+        if (!leaves[i]->is_leaf() &&
+            (largest < 0 ||
+             leaves[i]->surface_area() > leaves[largest]->surface_area())) {
+          largest = i;
+        }
+      }
+      if (largest < 0) {
+        break;
+      }
+      Box *opened = leaves[largest];
+      inner.push_back(opened);
+      leaves[largest] = opened->lChild;
+      leaves.push_back(opened->rChild);
+    }
+    int n = leaves.size();
+    if (n < 3) {
+      return false;
+    }
+
+    // best[s] is the cheapest tree over the leaves in bit set s, made of
+    // split[s] and the rest
+    int full = (1 << n) - 1;
+    std::vector<double> area(full + 1), best(full + 1);
+    std::vector<int> split(full + 1, 0);
+    for (int s = 1; s <= full; s++) {
+      Box bounds;
+      for (int i = 0; i < n; i++) {
+        if (s >> i & 1) {
+          bounds.combine(leaves[i]->min).combine(leaves[i]->max);
+        }
+      }
+      area[s] = bounds.surface_area();
+      if ((s & (s - 1)) == 0) {
+        best[s] = cost_of(leaves[__builtin_ctz(s)]);
+        continue;
+      }
+      // each split is seen once, the part holding the lowest bit goes left
+      int low = s & -s;
+      best[s] = DBL_MAX;
+      for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+        if ((p & low) && best[p] + best[s ^ p] < best[s]) {
+          best[s] = best[p] + best[s ^ p];
+          split[s] = p;
+        }
+      }
+      best[s] += area[s] * SAH_TRAVERSAL_COST;
+    }
+    if (best[full] >= cost_of(box) * (1 - 1e-9)) {
+      return false;
+    }
+    build(box, full, leaves, inner, split);
+    return true;
+  }
+
+  // box takes the leaves in s, inner nodes are reused for the new splits
+  void build(Box *box, int s, std::vector<Box *> &leaves,
+             std::vector<Box *> &inner, std::vector<int> &split) {
+    Box **children[2] = {&box->lChild, &box->rChild};
+    int parts[2] = {split[s], s ^ split[s]};
+    for (int c = 0; c < 2; c++) {
+      if ((parts[c] & (parts[c] - 1)) == 0) {
+        *children[c] = leaves[__builtin_ctz(parts[c])];
+      } else {
+        Box *node = inner.back();
+        inner.pop_back();
+        build(node, parts[c], leaves, inner, split);
+        *children[c] = node;
+      }
+    }
+    box->min = help_min(box->lChild->min, box->rChild->min);
+    box->max = help_max(box->lChild->max, box->rChild->max);
+    cost_of(box) = box->surface_area() * SAH_TRAVERSAL_COST +
+                   cost_of(box->lChild) + cost_of(box->rChild);
+  }
+};
+
+#endif
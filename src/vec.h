@@ -33,11 +33,11 @@ public:
     return Vec3(this->a + v.a, this->b + v.b, this->c + v.c);
   }
 
-  inline Vec3 operator-(const Vec3 &v) {
+  inline Vec3 operator-(const Vec3 &v) const {
     return Vec3(this->a - v.a, this->b - v.b, this->c - v.c);
   }
 
-  inline Vec3 operator/(double d) {
+  inline Vec3 operator/(double d) const {
     return Vec3(this->a / d, this->b / d, this->c / d);
   }
 
@@ -90,7 +90,7 @@ public:
     return output;
   }
 
-  inline Vec4 operator+(const Vec4 &v) {
+  inline Vec4 operator+(const Vec4 &v) const {
     return Vec4(this->a + v.a, this->b + v.b, this->c + v.c, this->d + v.d);
   }
 
@@ -106,7 +106,7 @@ public:
     return *this;
   }
 
-  inline Vec4 operator/(double d) {
+  inline Vec4 operator/(double d) const {
     return Vec4(this->a / d, this->b / d, this->c / d, this->d / d);
   }
 
@@ -189,7 +189,7 @@ public:
       int j = 0;
 
       if (currentRow[i] == 0) {
-        for (j = i + 1; j < n; i++) {
+        for (j = i + 1; j < n; j++) {
           if (rows[j][i] != 0) {
             currentRow = rows[j];
             double *t = rows[j];
@@ -0,0 +1,418 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "render.h"
+#include <cassert>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// samples in flight at once, small enough for the queues to stay in cache
+#define WAVEFRONT_SIZE (1 << 12)
+// rays given to one thread at a time by every stage
+#define WAVEFRONT_CHUNK 256
+// a box pops one entry and pushes two, so the stack holds depth + 1. trees
+// are split at the median, 64 levels are far more than memory allows
+#define WAVEFRONT_STACK_SIZE 64
+// layers found per ray and round, rays with more continue next round
+#define WAVEFRONT_LAYER_NUM 8
+
+enum WavefrontStage {
+  STAGE_GENERATE,
+  STAGE_SORT,
+  STAGE_INTERSECT,
+  STAGE_SHADE,
+  STAGE_CONTINUE,
+  STAGE_COMPOSITE,
+  STAGE_NUM
+};
+
+const char *wavefront_stage_name(int stage) {
+  static const char *names[STAGE_NUM] = {"generate",  "sort",
+                                         "intersect", "shade",
+                                         "continue",  "composite"};
+  return names[stage];
+}
+
+// items and seconds of every stage, summed over renders
+class WavefrontStats {
+public:
+  long itemNum[STAGE_NUM];
+  double seconds[STAGE_NUM];
+  long roundNum;
+
+  WavefrontStats() : roundNum(0) {
+    std::fill(itemNum, itemNum + STAGE_NUM, 0);
+    std::fill(seconds, seconds + STAGE_NUM, 0);
+  }
+
+  std::string report() {
+    std::ostringstream s;
+    s.precision(3);
+    s << std::fixed << "wavefront rounds " << roundNum << "\n";
+    for (int i = 0; i < STAGE_NUM; i++) {
+      s << wavefront_stage_name(i) << " " << itemNum[i] << " in "
+        << seconds[i] << " s, "
+        << (seconds[i] > 0 ? itemNum[i] / seconds[i] / 1e6 : 0) << " M/s\n";
+    }
+    return s.str();
+  }
+};
+
+// rays in structure of arrays layout, each continues a sample of the wave
+// past tMin
+class RayQueue {
+public:
+  std::vector<double> originA, originB, originC;
+  std::vector<double> directionA, directionB, directionC;
+  std::vector<double> tMin;
+  std::vector<int> sample;
+
+  int size() { return sample.size(); }
+
+  void resize(int n) {
+    originA.resize(n);
+    originB.resize(n);
+    originC.resize(n);
+    directionA.resize(n);
+    directionB.resize(n);
+    directionC.resize(n);
+    tMin.resize(n);
+    sample.resize(n);
+  }
+
+  void set(int i, const Ray &r, double t, int s) {
+    originA[i] = r.origin.a;
+    originB[i] = r.origin.b;
+    originC[i] = r.origin.c;
+    directionA[i] = r.direction.a;
+    directionB[i] = r.direction.b;
+    directionC[i] = r.direction.c;
+    tMin[i] = t;
+    sample[i] = s;
+  }
+
+  Ray get_ray(int i) {
+    return Ray(Vec3(originA[i], originB[i], originC[i]),
+               Vec3(directionA[i], directionB[i], directionC[i]));
+  }
+
+  // sign bits of the direction
+  int octant(int i) {
+    return (directionA[i] < 0) | (directionB[i] < 0) << 1 |
+           (directionC[i] < 0) << 2;
+  }
+};
+
+// layers of every ray of a RayQueue, WAVEFRONT_LAYER_NUM slots per ray,
+// filled by intersect and shade. a slot holds a triangle or a rect, the
+// other one is null. tNext is where a ray continues, or DBL_MAX once all of
+// its layers are found
+class HitQueue {
+public:
+  std::vector<int> hitNum;
+  std::vector<double> tNext;
+  std::vector<double> t;
+  std::vector<Triangle *> triangle;
+  std::vector<Rect *> rect;
+  std::vector<Vec4> color;
+  std::vector<char> inked;
+
+  void resize(int n) {
+    hitNum.resize(n);
+    tNext.resize(n);
+    t.resize(n * WAVEFRONT_LAYER_NUM);
+    triangle.resize(n * WAVEFRONT_LAYER_NUM);
+    rect.resize(n * WAVEFRONT_LAYER_NUM);
+    color.resize(n * WAVEFRONT_LAYER_NUM);
+    inked.resize(n * WAVEFRONT_LAYER_NUM);
+  }
+};
+
+// entry of r into box if it meets it within [tMin, tMax], inv is one over
+// the direction with zeros nudged so no lane computes 0 * inf
+inline bool wavefront_slab(Box *box, const double *origin, const double *inv,
+                           double tMin, double tMax, double &tEntry) {
+  const double lo[3] = {box->min.a, box->min.b, box->min.c};
+  const double hi[3] = {box->max.a, box->max.b, box->max.c};
+  for (int i = 0; i < 3; i++) {
+    double t0 = (lo[i] - origin[i]) * inv[i];
+    double t1 = (hi[i] - origin[i]) * inv[i];
+    if (t0 > t1) {
+      std::swap(t0, t1);
+    }
+    tMin = t0 > tMin ? t0 : tMin;
+    tMax = t1 < tMax ? t1 : tMax;
+  }
+  tEntry = tMin;
+  return tMin <= tMax;
+}
+
+// the nearest WAVEFRONT_LAYER_NUM hits past tMin along r, returns their
+// number and sets tNext. a hit goes to hits or to rectHits, the other slot
+// is null. when more hits exist, everything nearer than the
+// nearest one left out is kept and tNext is the farthest kept, so the next
+// round starts right after it and ties are never split between rounds.
+// nearer children go first, once hits are left out boxes behind the
+// farthest kept one are cut, with a little slack for rounding
+int collect_hits(Box *root, Ray &r, double tMin, double *t, Triangle **hits,
+                 Rect **rectHits, double &tNext) {
+  double origin[3] = {r.origin.a, r.origin.b, r.origin.c};
+  double direction[3] = {r.direction.a, r.direction.b, r.direction.c};
+  double inv[3];
+  for (int i = 0; i < 3; i++) {
+    double d = fabs(direction[i]) < 1e-300
+                   ? (direction[i] < 0 ? -1e-300 : 1e-300)
+                   : direction[i];
+    inv[i] = 1 / d;
+  }
+  double lo = tMin * (1 - 1e-9) - 1e-12;
+  Box *stack[WAVEFRONT_STACK_SIZE];
+  double entry[WAVEFRONT_STACK_SIZE];
+  int top = 0, n = 0, farthest = 0;
+  double leftOut = DBL_MAX; // nearest hit not kept
+  auto keep = [&](double th, Triangle *p, Rect *q) {
+    if (n < WAVEFRONT_LAYER_NUM) {
+      t[n] = th;
+      hits[n] = p;
+      rectHits[n] = q;
+      farthest = th > t[farthest] ? n : farthest;
+      n++;
+      return;
+    }
+    if (th >= t[farthest]) {
+      leftOut = std::min(leftOut, th);
+      return;
+    }
+    leftOut = std::min(leftOut, t[farthest]);
+    t[farthest] = th;
+    hits[farthest] = p;
+    rectHits[farthest] = q;
+    for (int i = 0; i < n; i++) {
+      farthest = t[i] > t[farthest] ? i : farthest;
+    }
+  };
+  if (wavefront_slab(root, origin, inv, lo, DBL_MAX, entry[0])) {
+    stack[top++] = root;
+  }
+  while (top > 0) {
+    top--;
+    Box *box = stack[top];
+    double hi =
+        leftOut == DBL_MAX ? DBL_MAX : t[farthest] * (1 + 1e-9) + 1e-12;
+    if (entry[top] > hi) {
+      continue;
+    }
+    if (!box->is_leaf()) {
+      double tc[2];
+      Box *children[2] = {box->lChild, box->rChild};
+      bool near[2];
+      for (int c = 0; c < 2; c++) {
+        near[c] = wavefront_slab(children[c], origin, inv, lo, hi, tc[c]);
+      }
+      // the far child goes on the stack first
+      int order = tc[0] <= tc[1] ? 1 : 0;
+      for (int k = 0; k < 2; k++) {
+        int c = k == 0 ? order : 1 - order;
+        if (near[c]) {
+          assert(top < WAVEFRONT_STACK_SIZE);
+          stack[top] = children[c];
+          entry[top] = tc[c];
+          top++;
+        }
+      }
+      continue;
+    }
+    double th;
+    for (Triangle *p : box->leaf) {
+      if (!p->interset(r, th) || th <= tMin) {
+        continue;
+      }
+      Vec3 point = r.origin + r.direction * th;
+      if (p->contain(point)) {
+        keep(th, p, nullptr);
+      }
+    }
+    for (Rect *q : box->rects) {
+      if (q->interset(r, th) && th > tMin) {
+        keep(th, nullptr, q);
+      }
+    }
+  }
+  if (leftOut == DBL_MAX) {
+    tNext = DBL_MAX;
+    return n;
+  }
+  int kept = 0;
+  for (int i = 0; i < n; i++) {
+    if (t[i] < leftOut) {
+      t[kept] = t[i];
+      hits[kept] = hits[i];
+      rectHits[kept] = rectHits[i];
+      kept++;
+    }
+  }
+  if (kept == 0) {
+    // more equal hits than slots, the extra ones are lost
+    kept = n;
+  }
+  tNext = t[0];
+  for (int i = 1; i < kept; i++) {
+    tNext = std::max(tNext, t[i]);
+  }
+  return kept;
+}
+
+// runs f(begin, end) over chunks of [0, n) on the thread pool
+template <typename F> void wavefront_kernel(int n, F f) {
+  int chunkNum = (n + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK;
+  parallel_for(0, chunkNum, [&](int c) {
+    f(c * WAVEFRONT_CHUNK, std::min((c + 1) * WAVEFRONT_CHUNK, n));
+  });
+}
+
+// same samples and same image as render_region, but run as a stream of
+// stages over a whole wave of samples instead of one recursion per sample.
+// generate makes the camera rays, sort groups the queue by direction
+// octant, intersect finds the nearest layers of every ray, shade colors
+// them, continue keeps them and requeues the rays that have more past the
+// last one found. the loop ends when the queue is empty, then composite
+// blends the layers of each sample like cal_color
+void render_wavefront_region(Scene &scene, Camera &camera, Sampler &sampler,
+                             Framebuffer &fb, int x0, int y0, int spp,
+                             int first, WavefrontStats *stats = nullptr) {
+  std::vector<int> order =
+      tile_morton_order(fb.width, fb.height, RENDER_TILE_SIZE);
+  int wavePixels = std::max(WAVEFRONT_SIZE / std::max(spp, 1), 1);
+  RayQueue queue, sorted;
+  HitQueue hits;
+  std::vector<std::vector<TransparentColor>> layers;
+  WavefrontStats local;
+  WavefrontStats &counters = stats != nullptr ? *stats : local;
+  auto start = std::chrono::steady_clock::now();
+  auto lap = [&](int stage, long n) {
+    auto now = std::chrono::steady_clock::now();
+    counters.itemNum[stage] += n;
+    counters.seconds[stage] +=
+        std::chrono::duration<double>(now - start).count();
+    start = now;
+  };
+
+  for (int p0 = 0; p0 < (int)order.size(); p0 += wavePixels) {
+    int pixelNum = std::min(wavePixels, (int)order.size() - p0);
+    int sampleNum = pixelNum * spp;
+    // sample s is number s % spp of pixel order[p0 + s / spp]
+    start = std::chrono::steady_clock::now();
+    queue.resize(sampleNum);
+    wavefront_kernel(sampleNum, [&](int begin, int end) {
+      RayBatch batch;
+      double x[RAY_BATCH_SIZE], y[RAY_BATCH_SIZE];
+      for (int b = begin; b < end; b += RAY_BATCH_SIZE) {
+        int n = std::min(RAY_BATCH_SIZE, end - b);
+        for (int i = 0; i < n; i++) {
+          int pixel = order[p0 + (b + i) / spp];
+          int px = x0 + pixel % fb.width, py = y0 + pixel / fb.width;
+          Vec3 jitter = sampler.get_2d(px, py, first + (b + i) % spp, 0);
+          x[i] = px + jitter.a;
+          y[i] = py + jitter.b;
+        }
+        camera.generate_batch(x, y, n, batch);
+        for (int i = 0; i < n; i++) {
+          queue.set(b + i, batch.get_ray(i), 0, b + i);
+        }
+      }
+    });
+    layers.resize(std::max((int)layers.size(), sampleNum));
+    for (int s = 0; s < sampleNum; s++) {
+      layers[s].clear();
+    }
+    lap(STAGE_GENERATE, sampleNum);
+
+    while (queue.size() > 0) {
+      int n = queue.size();
+      counters.roundNum++;
+
+      // counting sort, stable so rays keep their tile order in an octant
+      int offset[9] = {0};
+      for (int i = 0; i < n; i++) {
+        offset[queue.octant(i) + 1]++;
+      }
+      for (int k = 0; k < 8; k++) {
+        offset[k + 1] += offset[k];
+      }
+      sorted.resize(n);
+      for (int i = 0; i < n; i++) {
+        sorted.set(offset[queue.octant(i)]++, queue.get_ray(i),
+                   queue.tMin[i], queue.sample[i]);
+      }
+      std::swap(queue, sorted);
+      lap(STAGE_SORT, n);
+
+      hits.resize(n);
+      wavefront_kernel(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+          Ray r = queue.get_ray(i);
+          int k = i * WAVEFRONT_LAYER_NUM;
+          hits.hitNum[i] =
+              collect_hits(scene.root, r, queue.tMin[i], &hits.t[k],
+                           &hits.triangle[k], &hits.rect[k], hits.tNext[i]);
+        }
+      });
+      lap(STAGE_INTERSECT, n);
+
+      wavefront_kernel(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+          Ray r = queue.get_ray(i);
+          for (int j = 0; j < hits.hitNum[i]; j++) {
+            int k = i * WAVEFRONT_LAYER_NUM + j;
+            Vec3 point = r.origin + r.direction * hits.t[k];
+            bool inked;
+            hits.color[k] =
+                hits.rect[k] != nullptr
+                    ? surface_color(scene, hits.rect[k], r, point, inked)
+                    : surface_color(scene, hits.triangle[k], r, point, inked);
+            hits.inked[k] = inked;
+          }
+        }
+      });
+      lap(STAGE_SHADE, n);
+
+      // rays with layers left go on from the farthest one found
+      int next = 0;
+      for (int i = 0; i < n; i++) {
+        std::vector<TransparentColor> &l = layers[queue.sample[i]];
+        for (int j = 0; j < hits.hitNum[i]; j++) {
+          int k = i * WAVEFRONT_LAYER_NUM + j;
+          l.push_back(TransparentColor(hits.color[k], hits.t[k],
+                                       hits.inked[k]));
+        }
+        if (hits.tNext[i] != DBL_MAX) {
+          sorted.set(next++, queue.get_ray(i), hits.tNext[i],
+                     queue.sample[i]);
+        }
+      }
+      sorted.resize(next);
+      std::swap(queue, sorted);
+      lap(STAGE_CONTINUE, n);
+    }
+
+    parallel_for(0, pixelNum, [&](int i) {
+      int pixel = order[p0 + i];
+      for (int k = 0; k < spp; k++) {
+        fb.add(pixel, composite(scene, layers[i * spp + k], nullptr));
+      }
+      fb.sampleNum[pixel] += spp;
+    });
+    lap(STAGE_COMPOSITE, sampleNum);
+  }
+}
+
+void render_wavefront(Scene &scene, Camera &camera, Sampler &sampler,
+                      Framebuffer &fb, int spp = RENDER_SPP, int first = 0,
+                      WavefrontStats *stats = nullptr) {
+  render_wavefront_region(scene, camera, sampler, fb, 0, 0, spp, first,
+                          stats);
+}
+
+#endif
@@ -1,4 +1,6 @@
 #!/bin/sh
 mkdir output
-g++ src/test.cpp -o output/test
-./output/test
\ No newline at end of file
+g++ -ffp-contract=off src/test.cpp -pthread -ldl -o output/test
+g++ -ffp-contract=off src/avatar_a.cpp -pthread -o output/avatar_a
+g++ -ffp-contract=off -shared -fPIC -fvisibility=hidden src/myavatar.cpp -pthread -o output/libmyavatar.so
+./output/test